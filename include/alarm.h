@@ -0,0 +1,355 @@
+#ifndef MADB__ALARM_H
+#define MADB__ALARM_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* C includes */
+#include <fnmatch.h>
+#include <pthread.h>
+
+/* Internal imports */
+#include "notify.h"
+#include "traits.h"
+#include "columns.h"
+
+namespace madb {
+    /* A condition on one field of a data point's value, like "max is above
+     * 90", for alarms */
+    template <typename D>
+    class threshold {
+    public:
+        /* The field goes above a value */
+        template <typename F>
+        static threshold above(F D::* field, double value) {
+            return threshold(field, greater, value, value);
+        }
+
+        /* The field goes below a value */
+        template <typename F>
+        static threshold below(F D::* field, double value) {
+            return threshold(field, less, value, value);
+        }
+
+        /* The field goes outside of a range, inclusive */
+        template <typename F>
+        static threshold outside(F D::* field, double low, double high) {
+            return threshold(field, beyond, low, high);
+        }
+
+        /* The field goes into a range, inclusive */
+        template <typename F>
+        static threshold inside(F D::* field, double low, double high) {
+            return threshold(field, within, low, high);
+        }
+
+        /* Whether a value meets the condition */
+        bool test(const D& value) const {
+            double v = field.read(&value);
+            switch (mode) {
+                case greater: return v > low;
+                case less:    return v < low;
+                case beyond:  return v < low || v > high;
+                default:      return v >= low && v <= high;
+            }
+        }
+    private:
+        /* How the field compares */
+        enum mode_type { greater, less, beyond, within };
+
+        /* Members */
+        column    field;  /* Which field, and what type it is */
+        mode_type mode;   /* How it compares */
+        double    low;    /* The value, or the bottom of the range */
+        double    high;   /* The value, or the top of the range */
+
+        template <typename F>
+        threshold(F D::* member, mode_type mode, double low, double high):
+            field(column::of(member)), mode(mode), low(low), high(high) {}
+    };
+
+    /* Alarms on metrics' data points, checked as they're inserted.
+     *
+     * Each alarm has a pattern for the metrics it applies to, and a
+     * threshold. The alarms that apply to a metric are gathered into a rule
+     * set the first time it's inserted into (and again whenever alarms are
+     * added or removed), and metrics with the same alarms share one. An
+     * insert into a metric without any alarms only checks which generation
+     * of alarms it last looked at.
+     *
+     * Alarms go off when a data point meets the threshold after one that
+     * didn't, and clear when one doesn't after one that did. Those events
+     * go into a queue that's allocated up front, and are handed out on a
+     * background thread. If the queue fills up, more are dropped and counted.
+     *
+     * This is thread-safe */
+    template <typename D>
+    class alarms: public notifier {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type       key_type;
+        typedef typename traits::data_type      data_type;
+        typedef typename traits::alarm_cb_type  alarm_cb_type;
+
+        /* One alarm */
+        typedef struct alarm_ {
+            uint32_t      id;
+            key_type      pattern;
+            threshold<D>  condition;
+            alarm_cb_type cb;
+            void*         data;
+
+            alarm_(uint32_t id, const key_type& pattern,
+                const threshold<D>& condition, alarm_cb_type cb, void* data):
+                id(id), pattern(pattern), condition(condition), cb(cb),
+                data(data) {}
+        } alarm;
+
+        /* The alarms that apply to a metric. Rule sets are never changed,
+         * and each is freed once every metric that compiled it has released
+         * it, and the alarms have changed since */
+        typedef std::vector<alarm> rules_type;
+
+        /* The most alarms that apply to any one metric */
+        static const size_t max_rules = 64;
+
+        /* Constructor
+         *
+         * @param queue_size -- most events that may be waiting to be handed
+         *      out */
+        alarms(uint32_t queue_size): notifier(), queue_size(queue_size),
+            rules(), sets(), refs(), events(), head(0), count(0), next(1),
+            batch(), callbacks() {}
+
+        /* Destructor */
+        ~alarms() {
+            stop();
+            typename ref_map::iterator it(refs.begin());
+            for (; it != refs.end(); ++it) {
+                delete it->first;
+            }
+        }
+
+        /* Add an alarm
+         *
+         * @param pattern -- which metrics, as with fnmatch(3)
+         * @param condition -- when it goes off
+         * @param cb -- invoked when it goes off or clears
+         * @param data -- user data to pass to the callback
+         * @returns an id for removing it */
+        uint32_t add(const key_type& pattern, const threshold<D>& condition,
+            alarm_cb_type cb, void* data) {
+            pthread_mutex_lock(&lock);
+            uint32_t id = next++;
+            rules.insert(std::make_pair(id,
+                alarm(id, pattern, condition, cb, data)));
+            if (events.empty()) {
+                events.resize(queue_size);
+            }
+            regroup();
+            pthread_mutex_unlock(&lock);
+            return id;
+        }
+
+        /* Remove an alarm. Its callback won't be invoked once this returns,
+         * so this mustn't be called from a callback
+         *
+         * @param id -- from add() */
+        void remove(uint32_t id) {
+            pthread_mutex_lock(&delivering);
+            pthread_mutex_lock(&lock);
+            rules.erase(id);
+            regroup();
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_unlock(&delivering);
+        }
+
+        /* Get the rule set for a metric, which must be released once the
+         * metric's done with it
+         *
+         * @param name -- name of the metric
+         * @returns its rule set, or NULL if no alarms apply */
+        const rules_type* compile(const key_type& name) {
+            rules_type matched;
+            std::vector<uint32_t> ids;
+            pthread_mutex_lock(&lock);
+            typename alarm_map::const_iterator it(rules.begin());
+            for (; it != rules.end() && matched.size() < max_rules; ++it) {
+                const key_type& pattern(it->second.pattern);
+                if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+                    matched.push_back(it->second);
+                    ids.push_back(it->first);
+                }
+            }
+
+            const rules_type* set = NULL;
+            if (!matched.empty()) {
+                typename set_map::iterator found(sets.find(ids));
+                if (found == sets.end()) {
+                    rules_type* made = new rules_type(matched);
+                    refs[made] = 1;
+                    found = sets.insert(std::make_pair(ids, made)).first;
+                }
+                set = found->second;
+                ++refs[set];
+            }
+            pthread_mutex_unlock(&lock);
+            return set;
+        }
+
+        /* Release a rule set from compile()
+         *
+         * @param set -- the rule set */
+        void release(const rules_type* set) {
+            pthread_mutex_lock(&lock);
+            drop(set);
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* How many rule sets there are, including old ones still in use */
+        size_t rule_sets() {
+            pthread_mutex_lock(&lock);
+            size_t total = refs.size();
+            pthread_mutex_unlock(&lock);
+            return total;
+        }
+
+        /* Check a data point against a metric's rule set, queueing an event
+         * for each alarm that goes off or clears. This never allocates
+         *
+         * @param set -- the metric's rule set
+         * @param name -- its name, which must outlive us
+         * @param datum -- the data point
+         * @param firing -- which of the set's alarms are going off, updated
+         *      in place */
+        void check(const rules_type& set, const key_type* name,
+            const data_type& datum, uint64_t& firing) {
+            for (size_t i = 0; i < set.size(); ++i) {
+                uint64_t bit = static_cast<uint64_t>(1) << i;
+                bool hit = set[i].condition.test(datum.value);
+                if (hit != ((firing & bit) != 0)) {
+                    firing ^= bit;
+                    push(set[i].id, name, datum, hit);
+                }
+            }
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        alarms();
+        alarms(const alarms& other);
+        const alarms& operator=(const alarms& other);
+
+        /* An alarm going off or clearing */
+        typedef struct event_ {
+            uint32_t        id;       /* Which alarm */
+            const key_type* name;     /* Which metric */
+            data_type       datum;    /* The data point that did it */
+            bool            tripped;  /* Whether it went off */
+        } event;
+
+        /* Every alarm, by id */
+        typedef std::map<uint32_t, alarm> alarm_map;
+
+        /* Each distinct list of alarm ids, and its rule set */
+        typedef std::map<std::vector<uint32_t>, rules_type*> set_map;
+
+        /* Every rule set, and how many metrics (and sets) refer to it */
+        typedef std::map<const rules_type*, size_t> ref_map;
+
+        /* A callback, and its user data */
+        typedef std::pair<alarm_cb_type, void*> callback;
+
+        /* Members */
+        uint32_t                 queue_size; /* Most events queued */
+        alarm_map                rules;      /* Every alarm */
+        set_map                  sets;       /* Current rule sets */
+        ref_map                  refs;       /* Every rule set in use */
+        std::vector<event>       events;     /* A ring of queued events */
+        size_t                   head;       /* Oldest queued event */
+        size_t                   count;      /* How many are queued */
+        uint32_t                 next;       /* Next alarm's id */
+        std::vector<event>       batch;      /* Being handed out */
+        std::vector<callback>    callbacks;  /* Who to hand each to */
+
+        /* Queue up an event, unless there's no room */
+        void push(uint32_t id, const key_type* name, const data_type& datum,
+            bool tripped) {
+            pthread_mutex_lock(&lock);
+            if (!started) {
+                /* Nothing will hand it out */
+            } else if (count == events.size()) {
+                ++dropped;
+            } else {
+                event& e(events[(head + count) % events.size()]);
+                e.id      = id;
+                e.name    = name;
+                e.datum   = datum;
+                e.tripped = tripped;
+                if (count++ == 0) {
+                    pthread_cond_signal(&ready);
+                }
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* Note that the alarms changed, with our lock held. Rule sets for
+         * the old alarms stay around until every metric using them has
+         * compiled a new one */
+        void regroup() {
+            typename set_map::const_iterator it(sets.begin());
+            for (; it != sets.end(); ++it) {
+                drop(it->second);
+            }
+            sets.clear();
+            changed(rules.size());
+        }
+
+        /* Drop a reference to a rule set, with our lock held, freeing it if
+         * it was the last */
+        void drop(const rules_type* set) {
+            typename ref_map::iterator found(refs.find(set));
+            if (found != refs.end() && --found->second == 0) {
+                delete found->first;
+                refs.erase(found);
+            }
+        }
+
+        /* Whether any events are queued, with our lock held */
+        bool pending() const {
+            return count != 0;
+        }
+
+        /* Take the queued events, and look up each alarm's callback while
+         * we have the lock */
+        void take() {
+            batch.clear();
+            callbacks.clear();
+            for (; count; --count) {
+                const event& e(events[head]);
+                head = (head + 1) % events.size();
+                typename alarm_map::const_iterator found(rules.find(e.id));
+                batch.push_back(e);
+                callbacks.push_back(found == rules.end() ?
+                    callback(NULL, NULL) :
+                    callback(found->second.cb, found->second.data));
+            }
+        }
+
+        /* Hand out what take() took */
+        void hand_out() {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (callbacks[i].first) {
+                    callbacks[i].first(*batch[i].name, batch[i].datum,
+                        batch[i].tripped, callbacks[i].second);
+                }
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef MADB__ASYNC_H
+#define MADB__ASYNC_H
+
+#include <deque>
+#include <utility>
+#include <stdint.h>
+
+/* C includes */
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/* Internal imports */
+#include "pool.h"
+
+namespace madb {
+    /* Runs asynchronous operations on a pool of threads, and hands their
+     * completions back to whichever thread runs the event loop.
+     *
+     * Completions are queued up and announced on an eventfd, so any event
+     * loop can watch for them: libuv with uv_poll, epoll, or just poll(2).
+     * Once it's readable, dispatch() runs every completion that's ready, on
+     * the calling thread, so that callbacks never run on a worker and never
+     * need to lock anything of their own */
+    class executor {
+    public:
+        /* What runs on a worker, and then what runs on the event loop */
+        typedef void(* work_type)(void*);
+        typedef void(* done_type)(void*);
+
+        /* Constructor
+         *
+         * @param num_threads -- how many worker threads to start. With none,
+         *      work runs inline, but completions are still dispatched
+         * @param queue_size -- how many operations may be queued at once */
+        executor(uint32_t num_threads, uint32_t queue_size):
+            workers(num_threads, queue_size), ready(), event(-1) {
+            pthread_mutex_init(&lock, NULL);
+            event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (event < 0) {
+                perror("Failed to make eventfd");
+            }
+        }
+
+        /* Destructor -- finishes every operation, and dispatches whatever
+         * completions are left on the destroying thread */
+        ~executor() {
+            workers.drain();
+            dispatch();
+            if (event >= 0) {
+                ::close(event);
+            }
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Queue up an operation, blocking only if the queue is full
+         *
+         * @param work -- run on a worker
+         * @param done -- run on the event loop once the work is done
+         * @param data -- user data to pass to both */
+        void submit(work_type work, done_type done, void* data) {
+            workers.submit(run, new task(this, work, done, data));
+        }
+
+        /* Wait until every operation submitted so far has run. Their
+         * completions are left for dispatch() */
+        void drain() {
+            workers.drain();
+        }
+
+        /* The eventfd that's readable whenever completions are ready */
+        int fd() const {
+            return event;
+        }
+
+        /* Run every completion that's ready
+         *
+         * @returns how many were run */
+        size_t dispatch() {
+            uint64_t count;
+            if (event >= 0 && read(event, &count, sizeof(count)) < 0 &&
+                errno != EAGAIN) {
+                perror("Failed to read eventfd");
+            }
+
+            pthread_mutex_lock(&lock);
+            std::deque<completion> batch;
+            batch.swap(ready);
+            pthread_mutex_unlock(&lock);
+
+            std::deque<completion>::iterator it(batch.begin());
+            for (; it != batch.end(); ++it) {
+                it->first(it->second);
+            }
+            return batch.size();
+        }
+
+        /* Wait for completions and run them, for event loops that have
+         * nothing else to watch
+         *
+         * @param timeout -- most milliseconds to wait, or -1 for as long as it
+         *      takes
+         * @returns how many were run */
+        size_t poll(int timeout) {
+            struct pollfd p;
+            p.fd      = event;
+            p.events  = POLLIN;
+            p.revents = 0;
+            if (::poll(&p, 1, timeout) < 0 && errno != EINTR) {
+                perror("Failed to poll eventfd");
+            }
+            return dispatch();
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        executor();
+        executor(const executor& other);
+        const executor& operator=(const executor& other);
+
+        /* A completion, and its user data */
+        typedef std::pair<done_type, void*> completion;
+
+        /* An operation on its way through a worker */
+        typedef struct task_ {
+            executor* self;
+            work_type work;
+            done_type done;
+            void*     data;
+
+            task_(executor* self, work_type work, done_type done, void* data):
+                self(self), work(work), done(done), data(data) {}
+        } task;
+
+        /* Members */
+        pool                   workers;  /* Where work runs */
+        std::deque<completion> ready;    /* Waiting to be dispatched */
+        int                    event;    /* Readable when ready isn't empty */
+        pthread_mutex_t        lock;     /* Guards ready */
+
+        /* Do an operation's work, and queue its completion */
+        static void run(void* data) {
+            task* t = static_cast<task*>(data);
+            t->work(t->data);
+
+            executor* self = t->self;
+            pthread_mutex_lock(&self->lock);
+            self->ready.push_back(completion(t->done, t->data));
+            pthread_mutex_unlock(&self->lock);
+            delete t;
+
+            uint64_t one = 1;
+            if (self->event >= 0 &&
+                write(self->event, &one, sizeof(one)) < 0) {
+                perror("Failed to write eventfd");
+            }
+        }
+    };
+}
+
+#endif
@@ -2,12 +2,27 @@
 #define MADB__BUFFER_H
 
 #include <string>
-#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
+
+/* C includes */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 /* Internal import */
+#include "io.h"
 #include "slab.h"
+#include "cache.h"
 #include "traits.h"
+#include "crc32c.h"
+#include "varint.h"
+#include "segment.h"
 
 /* I am somewhat loathe to do this, but alas, I must */
 #include <boost/filesystem.hpp>
@@ -16,16 +31,39 @@ namespace madb {
     template <typename D>
     class buffer {
     public:
-        /* This file should only grow to 10MB before it gets rotated out */
+        /* This file should only grow to 5MB before it gets rotated out. Each
+         * buffer file is preallocated to exactly this size and mapped */
         static const int32_t max_size = 5 * 1024 * 1024;
 
-        /* To mode with which we open files */
-        static const typename std::fstream::openmode open_mode =
-            static_cast<std::fstream::openmode>(
-                static_cast<int>(std::fstream::binary) |
-                static_cast<int>(std::fstream::out)    |
-                static_cast<int>(std::fstream::app)    |
-                static_cast<int>(std::fstream::in));
+        /* Identifies a mapped buffer file, and its format version */
+        static const uint32_t magic   = 0x6d616462;
+        static const uint32_t version = 3;
+
+        /* The last version whose records had no checksums, which we still
+         * read (and append to) as it was */
+        static const uint32_t unchecked = 2;
+
+        /* The first mapped version, whose records each carried the metric's
+         * name in full. We still read those, but never append to them */
+        static const uint32_t named = 1;
+
+        /* The header at the beginning of every buffer file. Since the file is
+         * preallocated, this is how we know how much of it has been used.
+         *
+         * After the header come the records. Each buffer keeps its own
+         * dictionary of metric names, and each record begins with a varint
+         * tag of (id << 1 | defines). The first record for a metric sets the
+         * `defines` bit and is followed by a varint length and the name
+         * itself, to give that name its id. Every record then ends with its
+         * data_type, so that all later points for a metric cost only a byte
+         * or two more than the point itself, and then a CRC-32C of all of the
+         * above. A record whose checksum doesn't match was torn or corrupted,
+         * and it and everything after it are discarded */
+        typedef struct header_ {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t written;
+        } header;
 
         /* Our traits */
         typedef data_traits<D> traits;
@@ -37,41 +75,83 @@ namespace madb {
         typedef typename traits::data_type       data_type;
         typedef typename traits::values_type     values_type;
         typedef typename traits::values_map_type values_map_type;
+        typedef typename traits::record_type     record_type;
 
         /* Callback traits */
         typedef typename traits::insert_cb_type  insert_cb_type;
         typedef typename traits::read_cb_type    read_cb_type;
         typedef typename traits::get_cb_type     get_cb_type;
 
+        /* Maps each metric in the buffer to its id in our dictionary */
+        typedef std::tr1::unordered_map<key_type, uint32_t> ids_type;
+
+        /* Maps the ids that a shard has given its metric names to our own
+         * ids, so inserts through a resolved handle never hash the name */
+        typedef std::tr1::unordered_map<uint32_t, uint32_t> locals_type;
+
+        /* For each id, the offsets of its data points within the mapping, so
+         * that lookups never have to scan the file */
+        typedef std::vector<std::vector<uint32_t> > index_type;
+
         /* Default constructor
          *
          * Opens nothing, sits idle */
-        buffer(): stream(), path(""), base(""), written(0) {}
+        buffer(): fd(-1), map(NULL), mapped(0), path(""), base(""),
+            checked(true), legacy(false) {}
 
-        /* Open a file
+        /* Open an existing buffer file
          *
          * @param path -- the path to open
          * @param base -- base of the buffer directory to open */
         buffer(const std::string& path, const std::string& base):
-            stream(path.c_str(), open_mode), path(path), base(base),
-            written(0) {
-            /* Read how far along in the file we are */
-            written = stream.tellp();
+            fd(-1), map(NULL), mapped(0), path(""), base(base),
+            checked(true), legacy(false) {
+            open(path, false);
         }
 
         /* Copy constructor */
-        buffer(const buffer& other): stream(other.path.c_str()),
-            path(other.path),base(other.base), written(other.written) {}
+        buffer(const buffer& other): fd(-1), map(NULL), mapped(0), path(""),
+            base(other.base), checked(true), legacy(false) {
+            if (other.path.length()) {
+                open(other.path, false);
+            }
+        }
 
         /* Destructor */
         ~buffer() {
             close();
         }
 
+        /* Make a new temporary buffer for one of a database's shards. Its
+         * name records the shard and when it was made, so that it can be
+         * handed back to the same shard, in order, if it's left behind
+         *
+         * @param base -- path to the base directory to put the file in
+         * @param shard -- which shard the buffer belongs to
+         * @param shards -- how many shards the database has
+         * @param durable -- whether to sync the buffer's directory, so that
+         *      the new buffer survives a crash
+         * @returns 0 on success, else -1 if it couldn't be made */
+        int mktemp(const std::string& base_path, uint32_t shard,
+            uint32_t shards, bool durable=false) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            char name[64];
+            snprintf(name, sizeof(name), ".buffer.%u.%u.%016llu.%%%%%%%%%%%%",
+                shards, shard, static_cast<unsigned long long>(
+                    tv.tv_sec) * 1000000ULL + tv.tv_usec);
+            return mktemp(base_path, name, durable);
+        }
+
         /* Make a new temporary buffer
          *
-         * @param base -- path to the base directory to put the file in */
-        void mktemp(const std::string& base_path) {
+         * @param base -- path to the base directory to put the file in
+         * @param pattern -- name for the file, where each % is replaced
+         *      with a random character
+         * @param durable -- whether to sync the buffer's directory
+         * @returns 0 on success, else -1 if it couldn't be made */
+        int mktemp(const std::string& base_path,
+            const std::string& pattern=".buffer.%%%%%%", bool durable=false) {
             /* Close the old file descriptor if necessary */
             close();
 
@@ -83,23 +163,45 @@ namespace madb {
             /* Make sure the directory we need for the buffers exists, and then
              * generate a new, unique path */
             new_path /= "buffers";
-            boost::filesystem::create_directories(new_path);
-            new_path /= ".buffer.%%%%%%";
-            new_path = boost::filesystem::unique_path(new_path);
-            
-            /* And then let's open up our stream */
-            path = new_path.string();
-            std::cout << "Opening up new path " << path << std::endl;
-            stream.open(path.c_str(), open_mode);
-            written = 0;
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(new_path, ec);
+            new_path /= pattern;
+            new_path = boost::filesystem::unique_path(new_path, ec);
+            if (ec) {
+                std::cout << "Failed to make a buffer in " << base_path
+                    << ": " << ec.message() << std::endl;
+                return -1;
+            }
+
+            /* And then let's map it in. One that was made but couldn't be
+             * sized or mapped is removed again */
+            std::cout << "Opening up new path " << new_path.string()
+                << std::endl;
+            if (open(new_path.string(), true) != 0) {
+                boost::filesystem::remove(new_path, ec);
+                return -1;
+            }
+            if (durable) {
+                io::sync(new_path.parent_path().string());
+            }
+            return 0;
         }
 
         /* Take all the data out of the current buffer and write it out to all
          * of the files where they belong */
         int dump() {
+            slab_cache<D> cache(base, 1);
+            return dump(cache);
+        }
+
+        /* Take all the data out of the current buffer and write it out to all
+         * of the files where they belong, through a cache of open slabs
+         *
+         * @param cache -- where to find open slabs */
+        int dump(slab_cache<D>& cache) {
             /* Make sure it's open */
             std::cout << "Dumping " << path << std::endl;
-            if (!stream.is_open()) {
+            if (map == NULL) {
                 std::cout << "Not open..." << std::endl;
                 return 0;
             }
@@ -110,8 +212,17 @@ namespace madb {
             typename values_map_type::iterator it(results.begin());
             for (; it != results.end(); ++it) {
                 //std::cout << "Reading " << it->first << std::endl;
-                slab<D>(base, it->first).insert(
-                    it->second.begin(), it->second.end());
+                if (cache.get(it->first).insert(
+                    it->second.begin(), it->second.end()) != 0) {
+                    cache.fail();
+                }
+            }
+
+            /* If any of it didn't make it out, keep the file to try again */
+            if (cache.flush() != 0) {
+                std::cout << "Keeping " << path << " after a failed dump"
+                    << std::endl;
+                return -1;
             }
 
             /* Afterwards, remove the file */
@@ -126,59 +237,199 @@ namespace madb {
             return 0;
         }
 
+        /* Take all the data out of the current buffer and write it out as
+         * a single segment
+         *
+         * @param store -- where to write the segment */
+        int dump(segments<D>& store) {
+            std::cout << "Dumping " << path << std::endl;
+            if (map == NULL) {
+                std::cout << "Not open..." << std::endl;
+                return 0;
+            }
+
+            values_map_type results(read());
+            if (store.write(results) != 0) {
+                return -1;
+            }
+
+            if (!boost::filesystem::remove(path)) {
+                perror("Failed to remove path");
+                return -1;
+            }
+            close();
+            return 0;
+        }
+
         /* Rotate out the current buffer file for a new one
          *
-         * @returns 0 on success, else -1 */
+         * @returns 0 on success, else -1 if the old one couldn't be dumped,
+         *      and was left on disk to be recovered, or a new one couldn't
+         *      be made */
         int rotate() {
-            dump();
-            mktemp(base);
-            return 0;
+            int result = dump();
+            return (mktemp(base) == 0) ? result : -1;
         }
 
         /* Rotate out all the old buffer files in the provided path
          *
          * @param db_path -- path to the database's directory */
         static void rotate(const std::string& db_path) {
+            slab_cache<D> cache(db_path, 1);
+            rotate(db_path, cache);
+        }
+
+        /* Rotate out all the old buffer files in the provided path, to
+         * either a cache of open slabs or a store of segments
+         *
+         * @param db_path -- path to the database's directory
+         * @param sink -- where to dump them */
+        template <typename S>
+        static void rotate(const std::string& db_path, S& sink) {
+            std::vector<std::string> paths(leftovers(db_path));
+            std::vector<std::string>::iterator it(paths.begin());
+            for (; it != paths.end(); ++it) {
+                buffer(*it, db_path).dump(sink);
+            }
+        }
+
+        /* Every buffer file left in the provided path, sorted by name so
+         * that each shard's come oldest first
+         *
+         * @param db_path -- path to the database's directory */
+        static std::vector<std::string> leftovers(const std::string& db_path) {
             boost::filesystem::path buffers_path(db_path);
             buffers_path /= "buffers";
             std::cout << "Rotate(" << buffers_path.string() << ")"
                 << std::endl;
 
+            std::vector<std::string> paths;
             if (boost::filesystem::is_directory(buffers_path)) {
                 boost::filesystem::directory_iterator it(buffers_path);
                 boost::filesystem::directory_iterator it_end;
-
                 for (; it != it_end; ++it) {
-                    buffer(it->path().string(), db_path).dump();
+                    paths.push_back(it->path().string());
                 }
             }
+            std::sort(paths.begin(), paths.end());
+            return paths;
+        }
+
+        /* Figure out which shard a buffer file was made for
+         *
+         * @param path -- path of the buffer file
+         * @param shard -- set to the shard it belongs to
+         * @param shards -- set to how many shards its database had
+         * @returns whether the file was made for a shard at all */
+        static bool owner(const std::string& path, uint32_t& shard,
+            uint32_t& shards) {
+            std::string name(boost::filesystem::path(path).filename().string());
+            return sscanf(name.c_str(), ".buffer.%u.%u.", &shards, &shard) == 2
+                && shard < shards;
+        }
+
+        /* The most space a record for this key could take, whether or not
+         * the buffer has already seen this key */
+        static size_t record_size(const key_type& key) {
+            return 2 * varint::max_size + key.length() + sizeof(data_type) +
+                sizeof(uint32_t);
+        }
+
+        /* Whether a record for this key would fit in an empty buffer */
+        static bool fits(const key_type& key) {
+            return sizeof(header) + record_size(key) <=
+                static_cast<size_t>(max_size);
+        }
+
+        /* Whether the buffer's file is open and mapped in */
+        bool is_open() const {
+            return map != NULL;
+        }
+
+        /* Whether a record for this key might not fit in what's left of the
+         * buffer, meaning that it needs to be rotated first */
+        bool full(const key_type& key) const {
+            return map == NULL || legacy || sizeof(header) + written() +
+                record_size(key) > static_cast<size_t>(max_size);
         }
 
         /* Write a data point to the file */
         int insert(const key_type& key, timestamp_type time,
             const value_type& val) {
+            /* If this record won't fit in what's left of the mapping, then we
+             * have to rotate first */
+            if (full(key)) {
+                if (!fits(key)) {
+                    std::cout << "Record too large for buffer" << std::endl;
+                    return -1;
+                }
+                rotate();
+                if (map == NULL) {
+                    return -1;
+                }
+            }
 
-            /* Length of string */
-            size_t len = key.length();
-            stream.write(reinterpret_cast<char*>(&len), sizeof(size_t));
+            char* ptr = map + sizeof(header) + written();
+            hdr()->written += append(ptr, key, time, val) - ptr;
+            return 0;
+        }
 
-            /* And then the key */
-            stream << key;
+        /* Write a data point for a metric that's already been interned. The
+         * caller must have made sure that it isn't full
+         *
+         * @param id -- the metric's id within its shard
+         * @param key -- the metric's name, only read the first time we see
+         *      this id */
+        int insert(uint32_t id, const key_type& key, timestamp_type time,
+            const value_type& val) {
+            char* ptr = map + sizeof(header) + written();
+            hdr()->written += append(ptr, id, key, time, val) - ptr;
+            return 0;
+        }
 
-            /* And now the time */
-            data_type datum;
-            datum.time = time;
-            datum.value = val;
-            stream.write(reinterpret_cast<char*>(&datum), sizeof(data_type));
+        /* Write as many records of a batch as will fit in the buffer, in
+         * order, bumping the header only once for all of them
+         *
+         * @param first -- the first of the records to write
+         * @param last -- one past the last of the records to write
+         * @param ids -- the id of each record's metric within its shard, or
+         *      NULL to go by their names
+         * @returns how many of the records were written */
+        size_t insert(const record_type* const* first,
+            const record_type* const* last, const uint32_t* ids) {
+            if (map == NULL || legacy) {
+                return 0;
+            }
+
+            char* start = map + sizeof(header) + written();
+            char* ptr   = start;
+            const record_type* const* it(first);
+            for (; it != last; ++it) {
+                if (record_size((*it)->name) >
+                    static_cast<size_t>(map + max_size - ptr)) {
+                    break;
+                }
+                ptr = ids ? append(ptr, ids[it - first], (*it)->name,
+                    (*it)->time, (*it)->value) : append(ptr, (*it)->name,
+                    (*it)->time, (*it)->value);
+            }
 
-            written += sizeof(size_t) + key.length() + sizeof(data_type);
+            hdr()->written += ptr - start;
+            return it - first;
+        }
 
-            /* If this has exceeded our write size, then rotate... */
-            if (written < max_size) {
+        /* Wait until everything appended so far, and the header that counts
+         * it, is on disk
+         *
+         * @returns 0 on success, else -1 */
+        int sync() const {
+            if (map == NULL || legacy) {
                 return 0;
+            } else if (msync(map, sizeof(header) + written(), MS_SYNC) != 0) {
+                perror("Failed to sync buffer");
+                return -1;
             }
-
-            return rotate();
+            return 0;
         }
 
         /* Get all the data in this file synchronously
@@ -187,25 +438,9 @@ namespace madb {
          * buffer */
         values_map_type read() {
             values_map_type results;
-
-            /* This is a buffer, and admittedly a weakpoint */
-            char      key[1024];
-            size_t    len = 0;
-            data_type datum;
-
-            /* Seek to the beginning of the file for reading */
-            stream.seekg(0, std::fstream::beg);
-
-            /* Now, while the file descriptor is good, keep reading */
-            int count = 0;
-            while (count < written) {
-                stream.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-                stream.read(key, len);
-                stream.read(reinterpret_cast<char*>(&datum), sizeof(datum));
-                results[std::string(key, len)].push_back(datum);
-                count += (sizeof(size_t) + len + sizeof(datum));
+            for (uint32_t id = 0; id < keys.size(); ++id) {
+                points(index[id], results[keys[id]]);
             }
-
             return results;
         }
 
@@ -224,19 +459,36 @@ namespace madb {
          * @param end -- end of the range, inclusive */
         values_type get(const key_type& name, timestamp_type start,
             timestamp_type end) {
-            /* First, read in all the data points for this metric */
-            values_type all(read()[name]);
-
-            /* And then prepare the response */
+            /* Prepare the response from what's already been dumped */
             values_type results(slab<D>(base, name).get(start, end));
 
-            typename values_type::iterator it(all.begin());
-            for (; it != all.end(); ++it) {
-                if (it->time <= end && it->time >= start) {
-                    results.push_back(*it);
+            /* And then only the records for this metric in the buffer */
+            points(name, start, end, results);
+            return results;
+        }
+
+        /* Get only the data points in this buffer for a metric
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param results -- where to append the data points */
+        void points(const key_type& name, timestamp_type start,
+            timestamp_type end, values_type& results) const {
+            typename ids_type::const_iterator found(ids.find(name));
+            if (found == ids.end()) {
+                return;
+            }
+
+            data_type datum;
+            const std::vector<uint32_t>& offsets(index[found->second]);
+            std::vector<uint32_t>::const_iterator it(offsets.begin());
+            for (; it != offsets.end(); ++it) {
+                memcpy(&datum, map + *it, sizeof(data_type));
+                if (datum.time <= end && datum.time >= start) {
+                    results.push_back(datum);
                 }
             }
-            return results;
         }
 
         /* Get data asynchronously
@@ -255,15 +507,333 @@ namespace madb {
         const buffer& operator=(const buffer& other);
 
         /* Members */
-        std::fstream stream;    /* Our file stream */
+        int          fd;        /* Our file descriptor */
+        char*        map;       /* The mapped file */
+        size_t       mapped;    /* How much of it is mapped */
         std::string  path;      /* Path of our filename */
         std::string  base;      /* Our base path */
-        int          written;   /* How many bytes have been written */
+        ids_type     ids;       /* Our dictionary of metric names */
+        locals_type  locals;    /* Shard ids to our ids */
+        std::vector<key_type> keys;  /* Metric name for each id */
+        index_type   index;     /* Where each metric's records live */
+        bool         checked;   /* Whether records carry checksums */
+        bool         legacy;    /* Whether it's from an older format that's
+                                 * only read */
+
+        /* The header at the beginning of our mapping */
+        header* hdr() const {
+            return reinterpret_cast<header*>(map);
+        }
+
+        /* How many bytes of records have been written */
+        uint64_t written() const {
+            return (map == NULL) ? 0 : hdr()->written;
+        }
+
+        /* Encode a record into the mapping and index it. The caller is
+         * responsible for making sure it fits, and for bumping the header
+         *
+         * @param ptr -- where in the mapping to write the record
+         * @returns a pointer just past the record */
+        char* append(char* ptr, const key_type& key, timestamp_type time,
+            const value_type& val) {
+            std::pair<uint32_t, bool> found(define(key));
+            return encode(ptr, found.first, found.second, key, time, val);
+        }
+
+        /* Encode a record for a metric that's been interned by its shard. We
+         * only need the name the first time we see its id */
+        char* append(char* ptr, uint32_t id, const key_type& key,
+            timestamp_type time, const value_type& val) {
+            typename locals_type::const_iterator local(locals.find(id));
+            if (local != locals.end()) {
+                return encode(ptr, local->second, false, key, time, val);
+            }
+
+            std::pair<uint32_t, bool> found(define(key));
+            locals[id] = found.first;
+            return encode(ptr, found.first, found.second, key, time, val);
+        }
+
+        /* Look up the id for a name in our dictionary, adding it if need be
+         *
+         * @returns the id, and whether it was just added */
+        std::pair<uint32_t, bool> define(const key_type& key) {
+            std::pair<typename ids_type::iterator, bool> found(
+                ids.insert(std::make_pair(key, keys.size())));
+            if (found.second) {
+                keys.push_back(key);
+                index.push_back(std::vector<uint32_t>());
+            }
+            return std::make_pair(found.first->second, found.second);
+        }
+
+        /* Encode a record, including the name if this defines its id */
+        char* encode(char* ptr, uint32_t id, bool defines, const key_type& key,
+            timestamp_type time, const value_type& val) {
+            char* start = ptr;
+            if (defines) {
+                ptr = varint::encode((id << 1) | 1, ptr);
+                ptr = varint::encode(key.length(), ptr);
+                memcpy(ptr, key.data(), key.length());
+                ptr += key.length();
+            } else {
+                ptr = varint::encode(id << 1, ptr);
+            }
+
+            /* And now the time */
+            data_type datum;
+            datum.time = time;
+            datum.value = val;
+            memcpy(ptr, &datum, sizeof(data_type));
+            index[id].push_back(ptr - map);
+            ptr += sizeof(data_type);
+
+            if (checked) {
+                uint32_t crc = crc32c::compute(start, ptr - start);
+                memcpy(ptr, &crc, sizeof(crc));
+                ptr += sizeof(crc);
+            }
+            return ptr;
+        }
+
+        /* Copy out the data points at the provided offsets
+         *
+         * @param offsets -- offsets of records within the mapping
+         * @param results -- where to append the data points */
+        void points(const std::vector<uint32_t>& offsets,
+            values_type& results) const {
+            data_type datum;
+            results.reserve(results.size() + offsets.size());
+            std::vector<uint32_t>::const_iterator it(offsets.begin());
+            for (; it != offsets.end(); ++it) {
+                memcpy(&datum, map + *it, sizeof(data_type));
+                results.push_back(datum);
+            }
+        }
+
+        /* Walk the records in the mapping to rebuild the index. We never
+         * trust a length that would take us past what's been written, and
+         * anything after the last whole record whose checksum matches is
+         * forgotten */
+        void scan() {
+            forget();
+
+            uint32_t    tag = 0;
+            uint32_t    len = 0;
+            const char* ptr = map + sizeof(header);
+            const char* end = ptr + written();
+            while (ptr < end) {
+                const char* next = varint::decode(ptr, end, tag);
+                if (next == NULL) {
+                    break;
+                }
+
+                uint32_t id = tag >> 1;
+                const char* name = NULL;
+                if (tag & 1) {
+                    /* Names are always defined in order */
+                    next = varint::decode(next, end, len);
+                    if (next == NULL || id != keys.size() ||
+                        len > static_cast<size_t>(end - next)) {
+                        break;
+                    }
+                    name = next;
+                    next += len;
+                } else if (id >= keys.size()) {
+                    break;
+                }
+
+                const char* after = next + sizeof(data_type);
+                if (sizeof(data_type) + (checked ? sizeof(uint32_t) : 0) >
+                    static_cast<size_t>(end - next)) {
+                    break;
+                } else if (checked) {
+                    uint32_t crc;
+                    memcpy(&crc, after, sizeof(crc));
+                    if (crc != crc32c::compute(ptr, after - ptr)) {
+                        break;
+                    }
+                    after += sizeof(crc);
+                }
+
+                if (name != NULL) {
+                    key_type key(name, len);
+                    ids[key] = id;
+                    keys.push_back(key);
+                    index.push_back(std::vector<uint32_t>());
+                }
+                index[id].push_back(next - map);
+                ptr = after;
+            }
+            hdr()->written = ptr - (map + sizeof(header));
+        }
+
+        /* Index records in the older format, each of which is the length
+         * of the metric's name as a size_t, the name, and the data point.
+         * Anything after the last whole record is ignored
+         *
+         * @param begin -- where in the mapping the records begin
+         * @param end -- where they end */
+        void scan_named(size_t begin, size_t end) {
+            forget();
+
+            size_t len = 0;
+            const char* ptr  = map + begin;
+            const char* stop = map + end;
+            while (sizeof(size_t) <= static_cast<size_t>(stop - ptr)) {
+                memcpy(&len, ptr, sizeof(size_t));
+                size_t left = stop - ptr - sizeof(size_t);
+                if (len > left || sizeof(data_type) > left - len) {
+                    break;
+                }
+                uint32_t id = define(key_type(ptr + sizeof(size_t),
+                    len)).first;
+                index[id].push_back(ptr + sizeof(size_t) + len - map);
+                ptr += sizeof(size_t) + len + sizeof(data_type);
+            }
+        }
+
+        /* Map in a buffer file in the older format, to be read and dumped
+         * but never appended to
+         *
+         * @param file_path -- path of the buffer file
+         * @param begin -- where its records begin
+         * @param end -- where they end
+         * @param size -- how large the file is
+         * @returns 0 on success, else -1 */
+        int open_named(const std::string& file_path, size_t begin, size_t end,
+            size_t size) {
+            void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                perror("Failed to map buffer");
+                ::close(fd);
+                fd = -1;
+                return -1;
+            }
+
+            map     = static_cast<char*>(addr);
+            mapped  = size;
+            path    = file_path;
+            checked = false;
+            legacy  = true;
+            scan_named(begin, std::min(end, size));
+            return 0;
+        }
+
+        /* Drop our dictionary and index */
+        void forget() {
+            ids.clear();
+            locals.clear();
+            keys.clear();
+            index.clear();
+        }
+
+        /* Open up and map a buffer file
+         *
+         * @param file_path -- path of the buffer file
+         * @param create -- whether to create and preallocate the file
+         * @returns 0 on success, else -1 */
+        int open(const std::string& file_path, bool create) {
+            int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR;
+            fd = ::open(file_path.c_str(), flags, 0644);
+            if (fd < 0) {
+                perror("Failed to open buffer");
+                return -1;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                perror("Failed to stat buffer");
+                ::close(fd);
+                fd = -1;
+                return -1;
+            }
+
+            /* Buffers from before records were interned are read as they
+             * are, without resizing them. So are those from before buffers
+             * were mapped, which are a stream of the same records without a
+             * header. Anything else that isn't ours is left alone. A file
+             * too short for a header, or with nothing in it yet, was cut off
+             * while being created */
+            header h;
+            memset(&h, 0, sizeof(header));
+            if (!create && st.st_size >= static_cast<off_t>(sizeof(header)) &&
+                pread(fd, &h, sizeof(header), 0) == sizeof(header) &&
+                (h.magic != 0 || h.version != 0 || h.written != 0)) {
+                if (h.magic == magic && h.version == named) {
+                    std::cout << "Reading older buffer " << file_path
+                        << std::endl;
+                    return open_named(file_path, sizeof(header),
+                        sizeof(header) + h.written, st.st_size);
+                } else if (h.magic != magic) {
+                    if (open_named(file_path, 0, st.st_size, st.st_size) == 0
+                        && !keys.empty()) {
+                        std::cout << "Reading streamed buffer " << file_path
+                            << std::endl;
+                        return 0;
+                    }
+                    close();
+                    std::cout << "Leaving unknown buffer " << file_path
+                        << " alone" << std::endl;
+                    return -1;
+                } else if (h.version != version && h.version != unchecked) {
+                    ::close(fd);
+                    fd = -1;
+                    std::cout << "Leaving buffer " << file_path
+                        << " from a newer version alone" << std::endl;
+                    return -1;
+                }
+            }
+
+            /* Make sure the file is as large as the mapping. A leftover buffer
+             * might be shorter if we crashed while creating it */
+            if (st.st_size < max_size && ftruncate(fd, max_size) != 0) {
+                perror("Failed to size buffer");
+                ::close(fd);
+                fd = -1;
+                return -1;
+            }
+
+            void* addr = mmap(NULL, max_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                perror("Failed to map buffer");
+                ::close(fd);
+                fd = -1;
+                return -1;
+            }
+
+            map    = static_cast<char*>(addr);
+            mapped = max_size;
+            path   = file_path;
+            if (create || hdr()->magic != magic) {
+                /* Either a brand new file, or one that was cut off */
+                hdr()->magic   = magic;
+                hdr()->version = version;
+                hdr()->written = 0;
+            } else if (hdr()->written > max_size - sizeof(header)) {
+                hdr()->written = max_size - sizeof(header);
+            }
+            checked = (hdr()->version != unchecked);
+            scan();
+            return 0;
+        }
 
         /* Close up our current file descriptor */
         void close() {
-            path = "";
-            stream.close();
+            if (map != NULL) {
+                munmap(map, mapped);
+                map    = NULL;
+                mapped = 0;
+            }
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+            forget();
+            path   = "";
+            legacy = false;
         }
     };
 }
@@ -0,0 +1,167 @@
+#ifndef MADB__CACHE_H
+#define MADB__CACHE_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <utility>
+#include <tr1/unordered_map>
+
+/* Internal imports */
+#include "io.h"
+#include "slab.h"
+#include "traits.h"
+#include "catalog.h"
+
+namespace madb {
+    /* A bounded cache of open slabs, evicting the least recently used.
+     * Opening a slab makes sure its directory exists and that the catalog
+     * has its metric, every time, since either may have been removed since
+     * it was last open.
+     *
+     * This is not thread-safe. Each shard keeps its own, and only uses it
+     * while dumping, which is serialized for the shard anyway */
+    template <typename D>
+    class slab_cache {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+
+        /* Told about each slab that's rotated out */
+        typedef typename slab<D>::rotate_cb_type rotate_cb_type;
+
+        /* Most recently used slabs are at the front */
+        typedef std::list<std::pair<key_type, slab<D>*> > lru_type;
+
+        /* Where in the list each open slab is */
+        typedef std::tr1::unordered_map<key_type,
+            typename lru_type::iterator> slabs_type;
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param capacity -- how many slabs to keep open at once
+         * @param compress -- whether slabs compress as they're rotated
+         * @param on_rotate -- callback for each slab rotated out, if any
+         * @param data -- user data to pass to the callback
+         * @param known -- catalog to add new metrics to, if any
+         * @param durable -- whether flush() syncs what it writes to disk
+         * @param uring -- whether writes go through io_uring, if it's
+         *      available */
+        slab_cache(const std::string& base, size_t capacity,
+            bool compress=false, rotate_cb_type on_rotate=NULL,
+            void* data=NULL, catalog* known=NULL, bool durable=false,
+            bool uring=false):
+            base(base), capacity(capacity ? capacity : 1), compress(compress),
+            durable(durable), uring(uring), failed(false),
+            on_rotate(on_rotate), on_rotate_data(data), known(known), lru(),
+            slabs() {}
+
+        /* Destructor -- closes all the open slabs */
+        ~slab_cache() {
+            clear();
+        }
+
+        /* Get the open slab for a metric, opening it if need be
+         *
+         * @param name -- name of the metric */
+        slab<D>& get(const key_type& name) {
+            typename slabs_type::iterator found(slabs.find(name));
+            if (found != slabs.end()) {
+                lru.splice(lru.begin(), lru, found->second);
+                return *(found->second->second);
+            }
+
+            if (slabs.size() >= capacity) {
+                slabs.erase(lru.back().first);
+                if (lru.back().second->flush() != 0 ||
+                    (durable && lru.back().second->sync() != 0)) {
+                    failed = true;
+                }
+                delete lru.back().second;
+                lru.pop_back();
+            }
+
+            if (known) {
+                known->add(name);
+            }
+            lru.push_front(std::make_pair(name, new slab<D>(base, name,
+                false, compress, durable, uring)));
+            lru.front().second->notify(on_rotate, on_rotate_data);
+            slabs[name] = lru.begin();
+            return *(lru.front().second);
+        }
+
+        /* Push out anything the open slabs have buffered, all at once, and
+         * then sync it if we're durable. Slabs evicted since the last flush
+         * were flushed (and synced) as they closed
+         *
+         * @returns 0 if everything since the last flush was written, else -1
+         *      if any of it failed */
+        int flush() {
+            int result = failed ? -1 : 0;
+            failed = false;
+            std::vector<io::op>    ops;
+            std::vector<slab<D>*>  queued;
+            typename lru_type::iterator it(lru.begin());
+            for (; it != lru.end(); ++it) {
+                if (it->second->flush(ops)) {
+                    queued.push_back(it->second);
+                }
+            }
+
+            io::local(uring).run(ops);
+            for (size_t i = 0; i < queued.size(); ++i) {
+                if (queued[i]->flushed(ops[i]) != 0) {
+                    result = -1;
+                }
+            }
+            for (it = lru.begin(); durable && it != lru.end(); ++it) {
+                if (it->second->sync() != 0) {
+                    result = -1;
+                }
+            }
+            return result;
+        }
+
+        /* Note that inserting into one of our slabs failed, for the next
+         * flush() to report */
+        void fail() {
+            failed = true;
+        }
+
+        /* Close all the open slabs */
+        void clear() {
+            typename lru_type::iterator it(lru.begin());
+            for (; it != lru.end(); ++it) {
+                delete it->second;
+            }
+            lru.clear();
+            slabs.clear();
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        slab_cache();
+        slab_cache(const slab_cache& other);
+        const slab_cache& operator=(const slab_cache& other);
+
+        /* Members */
+        std::string base;         /* Base path of the database */
+        size_t      capacity;     /* Most slabs we'll keep open */
+        bool        compress;     /* Whether slabs compress when rotated */
+        bool        durable;      /* Whether flushes are synced */
+        bool        uring;        /* Whether writes go through io_uring */
+        bool        failed;       /* Whether anything's failed since the
+                                   * last flush */
+        rotate_cb_type on_rotate;       /* Told about every rotation */
+        void*          on_rotate_data;  /* User data for on_rotate */
+        catalog*       known;           /* Where new metrics are added */
+        lru_type    lru;          /* Open slabs, most recently used first */
+        slabs_type  slabs;        /* Where each open slab is in the list */
+    };
+}
+
+#endif
@@ -0,0 +1,565 @@
+#ifndef MADB__CATALOG_H
+#define MADB__CATALOG_H
+
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+/* C includes */
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Internal imports */
+#include "io.h"
+#include "varint.h"
+
+#include <boost/filesystem.hpp>
+
+namespace madb {
+    /* The names of every metric in the database, so that they can be listed
+     * without walking the nested directories under `metrics/`.
+     *
+     * Most of the names are in a sorted index, `catalog.index`, which is
+     * mapped in and searched in place rather than read into memory. Each
+     * name is preceded by its length as a varint, and the offset of every
+     * `stride`-th one is kept at the end, to binary search. Metrics that
+     * dumps create are appended to `catalog`, in the same format but in the
+     * order they were added, and kept in a small sorted set as well. Once
+     * there are `max_pending` of those, they're merged into a new index,
+     * which is written alongside and renamed into place, and the log starts
+     * over. A database that predates its catalog has its directories walked
+     * just once, to write the index out the same way.
+     *
+     * This is thread-safe */
+    class catalog {
+    public:
+        /* Identifies an index */
+        static const uint32_t magic = 0x6d636174;
+
+        /* Which version of the index we write */
+        static const uint32_t version = 1;
+
+        /* How many names there are between each offset in the index */
+        static const uint32_t stride = 64;
+
+        /* A list of metric names, sorted */
+        typedef std::vector<std::string> names_type;
+
+        /* Told about each metric that's added */
+        typedef void(* added_type)(const std::string&, void*);
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param max_pending -- most names kept outside of the index */
+        catalog(const std::string& base, size_t max_pending=65536):
+            path(), index_path(), max_pending(max_pending ? max_pending : 1),
+            fd(-1), index_fd(-1), map(NULL), mapped(0), pending(),
+            on_add(NULL), data(NULL) {
+            pthread_mutex_init(&lock, NULL);
+
+            boost::filesystem::create_directories(base);
+            boost::filesystem::path p(base);
+            path       = (p / "catalog").string();
+            index_path = (p / "catalog.index").string();
+            boost::filesystem::remove(index_path + ".tmp");
+
+            if (!boost::filesystem::exists(path) &&
+                !boost::filesystem::exists(index_path)) {
+                bootstrap(base);
+            }
+            remap();
+
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (fd < 0) {
+                perror("Failed to open catalog");
+            } else {
+                load();
+            }
+            if (pending.size() >= this->max_pending) {
+                compact();
+            }
+        }
+
+        /* Destructor */
+        ~catalog() {
+            unmap();
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Add a metric, if it isn't already in the catalog
+         *
+         * @param name -- name of the metric
+         * @returns whether it was new */
+        bool add(const std::string& name) {
+            pthread_mutex_lock(&lock);
+            bool added = !indexed(name) && pending.insert(name).second;
+            if (added) {
+                append(name);
+                if (pending.size() >= max_pending) {
+                    compact();
+                }
+            }
+            added_type cb = on_add;
+            void* cb_data = data;
+            pthread_mutex_unlock(&lock);
+
+            if (added && cb) {
+                cb(name, cb_data);
+            }
+            return added;
+        }
+
+        /* Set a callback for each metric that's added from now on
+         *
+         * @param cb -- the callback, or NULL for none
+         * @param cb_data -- user data to pass to it */
+        void notify(added_type cb, void* cb_data) {
+            pthread_mutex_lock(&lock);
+            on_add = cb;
+            data   = cb_data;
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* List every metric whose name begins with a prefix
+         *
+         * @param prefix -- the prefix, which may be empty */
+        names_type list(const std::string& prefix) {
+            return range(prefix, NULL);
+        }
+
+        /* List every metric whose name matches a shell-style pattern, as
+         * with fnmatch(3). Only the names that begin with the pattern's
+         * literal prefix are checked
+         *
+         * @param pattern -- the pattern to match */
+        names_type glob(const std::string& pattern) {
+            return range(pattern.substr(0, pattern.find_first_of("*?[\\")),
+                &pattern);
+        }
+
+        /* List the metrics that come after a name, a page at a time, so that
+         * every metric can be gone through without listing them all at once
+         *
+         * @param from -- the last name of the previous page, or empty to
+         *      start from the first
+         * @param limit -- most names to list */
+        names_type page(const std::string& from, size_t limit) {
+            names_type results;
+            pthread_mutex_lock(&lock);
+            std::string name;
+            const char* ptr = seek(from, name);
+            if (ptr != NULL && !from.empty() && name == from) {
+                ptr = read(ptr, name);
+            }
+            std::set<std::string>::const_iterator it(from.empty() ?
+                pending.begin() : pending.upper_bound(from));
+            while (results.size() < limit &&
+                (ptr != NULL || it != pending.end())) {
+                if (ptr != NULL && (it == pending.end() || name < *it)) {
+                    results.push_back(name);
+                    ptr = read(ptr, name);
+                } else {
+                    results.push_back(*it++);
+                }
+            }
+            pthread_mutex_unlock(&lock);
+            return results;
+        }
+
+        /* How many metrics there are */
+        size_t size() {
+            pthread_mutex_lock(&lock);
+            size_t count = pending.size() + (map ? head()->count : 0);
+            pthread_mutex_unlock(&lock);
+            return count;
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        catalog();
+        catalog(const catalog& other);
+        const catalog& operator=(const catalog& other);
+
+        /* Begins every index */
+        typedef struct header_ {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t count;         /* How many names there are */
+            uint64_t marks_offset;  /* Where the offsets begin */
+        } header;
+
+        /* Writes out a new index, one name at a time in order. It's written
+         * alongside first and renamed into place once it's complete */
+        class writer {
+        public:
+            writer(const std::string& path): path(path),
+                temp(path + ".tmp"), fd(-1), count(0), offset(sizeof(header)),
+                chunk(), marks(), ok(true) {
+                fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    perror("Failed to open catalog index");
+                }
+            }
+
+            ~writer() {
+                if (fd >= 0) {
+                    ::close(fd);
+                    boost::filesystem::remove(temp);
+                }
+            }
+
+            /* Add a name, after any already added */
+            void add(const std::string& name) {
+                if (count++ % stride == 0) {
+                    marks.push_back(offset + chunk.size());
+                }
+                size_t size = chunk.size();
+                chunk.resize(size + varint::max_size + name.length());
+                char* ptr = varint::encode(name.length(), &chunk[size]);
+                ptr += name.copy(ptr, name.length());
+                chunk.resize(ptr - &chunk[0]);
+                if (chunk.size() >= 1024 * 1024) {
+                    write(&chunk[0], chunk.size());
+                    chunk.clear();
+                }
+            }
+
+            /* Write out the offsets, sync it and move it into place
+             *
+             * @returns 0 on success, else -1 */
+            int finish() {
+                if (fd < 0) {
+                    return -1;
+                }
+                if (!chunk.empty()) {
+                    write(&chunk[0], chunk.size());
+                }
+
+                header h;
+                h.magic        = magic;
+                h.version      = version;
+                h.count        = count;
+                h.marks_offset = offset;
+                if (!marks.empty()) {
+                    write(&marks[0], marks.size() * sizeof(uint64_t));
+                }
+                if (pwrite(fd, &h, sizeof(header), 0) != sizeof(header) ||
+                    fdatasync(fd) != 0) {
+                    ok = false;
+                }
+                ::close(fd);
+                fd = -1;
+
+                if (!ok) {
+                    perror("Failed to write catalog index");
+                    boost::filesystem::remove(temp);
+                    return -1;
+                }
+                boost::filesystem::rename(temp, path);
+                return io::sync(boost::filesystem::path(
+                    path).parent_path().string());
+            }
+        private:
+            std::string           path;    /* Where it ends up */
+            std::string           temp;    /* Where it's written */
+            int                   fd;      /* Open on temp */
+            uint64_t              count;   /* Names added so far */
+            uint64_t              offset;  /* How much has been written */
+            std::vector<char>     chunk;   /* Names not yet written */
+            std::vector<uint64_t> marks;   /* Every stride-th name's offset */
+            bool                  ok;      /* Whether every write succeeded */
+
+            /* Write out the next part of the index */
+            void write(const void* data, size_t size) {
+                if (pwrite(fd, data, size, offset) !=
+                    static_cast<ssize_t>(size)) {
+                    ok = false;
+                }
+                offset += size;
+            }
+        };
+
+        /* Members */
+        std::string           path;         /* Path of the log of new names */
+        std::string           index_path;   /* Path of the sorted index */
+        size_t                max_pending;  /* Most names kept in pending */
+        int                   fd;           /* Log, open for appending */
+        int                   index_fd;     /* Open on the index */
+        const char*           map;          /* The index, mapped in */
+        size_t                mapped;       /* How much of it is mapped */
+        std::set<std::string> pending;      /* Names only in the log */
+        added_type            on_add;       /* Told about new metrics */
+        void*                 data;         /* User data for on_add */
+        pthread_mutex_t       lock;         /* Guards all of the above */
+
+        /* The index's header, which must be mapped */
+        const header* head() const {
+            return reinterpret_cast<const header*>(map);
+        }
+
+        /* Read the name at a position in the index
+         *
+         * @param ptr -- where the name's record begins
+         * @param name -- where to put the name
+         * @returns where the next record begins, or NULL if there are no
+         *      more */
+        const char* read(const char* ptr, std::string& name) const {
+            const char* end = map + head()->marks_offset;
+            uint32_t length = 0;
+            const char* start = (ptr < end) ? varint::decode(ptr, end, length)
+                : NULL;
+            if (start == NULL || length > static_cast<size_t>(end - start)) {
+                return NULL;
+            }
+            name.assign(start, length);
+            return start + length;
+        }
+
+        /* Find the first name in the index that's not before a key
+         *
+         * @param key -- what to look for
+         * @param name -- where to put the name that was found
+         * @returns where the record after it begins, or NULL if every name
+         *      is before the key */
+        const char* seek(const std::string& key, std::string& name) const {
+            if (map == NULL || head()->count == 0) {
+                return NULL;
+            }
+
+            /* The last offset whose name is before the key, and then on
+             * from there */
+            const uint64_t* marks = reinterpret_cast<const uint64_t*>(
+                map + head()->marks_offset);
+            size_t low = 0;
+            size_t high = (head()->count + stride - 1) / stride;
+            while (high - low > 1) {
+                size_t middle = low + (high - low) / 2;
+                if (read(map + marks[middle], name) && name < key) {
+                    low = middle;
+                } else {
+                    high = middle;
+                }
+            }
+
+            const char* ptr = map + marks[low];
+            while ((ptr = read(ptr, name)) != NULL && name < key) {}
+            return ptr;
+        }
+
+        /* Whether a name is in the index */
+        bool indexed(const std::string& name) const {
+            std::string found;
+            return seek(name, found) != NULL && found == name;
+        }
+
+        /* List every name with a prefix, and matching a pattern if there is
+         * one, from both the index and the names that aren't in it yet */
+        names_type range(const std::string& prefix,
+            const std::string* pattern) {
+            names_type results;
+            pthread_mutex_lock(&lock);
+            std::string name;
+            const char* ptr = seek(prefix, name);
+            std::set<std::string>::const_iterator it(
+                pending.lower_bound(prefix));
+            while (true) {
+                bool from_index = ptr != NULL &&
+                    name.compare(0, prefix.length(), prefix) == 0;
+                bool from_pending = it != pending.end() &&
+                    it->compare(0, prefix.length(), prefix) == 0;
+                if (!from_index && !from_pending) {
+                    break;
+                }
+
+                if (from_index && (!from_pending || name < *it)) {
+                    keep(name, pattern, results);
+                    ptr = read(ptr, name);
+                } else {
+                    keep(*it, pattern, results);
+                    ++it;
+                }
+            }
+            pthread_mutex_unlock(&lock);
+            return results;
+        }
+
+        /* Add a name to a listing, if it matches the pattern there is one */
+        static void keep(const std::string& name, const std::string* pattern,
+            names_type& results) {
+            if (!pattern || fnmatch(pattern->c_str(), name.c_str(), 0) == 0) {
+                results.push_back(name);
+            }
+        }
+
+        /* Map in the index as it is on disk, if it's there and whole */
+        void remap() {
+            unmap();
+            index_fd = ::open(index_path.c_str(), O_RDONLY);
+            if (index_fd < 0) {
+                return;
+            }
+
+            struct stat st;
+            header h;
+            if (fstat(index_fd, &st) != 0 ||
+                pread(index_fd, &h, sizeof(header), 0) != sizeof(header) ||
+                h.magic != magic || h.version != version ||
+                h.marks_offset < sizeof(header) || h.marks_offset +
+                    (h.count + stride - 1) / stride * sizeof(uint64_t) !=
+                    static_cast<uint64_t>(st.st_size)) {
+                fprintf(stderr, "Ignoring malformed %s\n", index_path.c_str());
+                unmap();
+                return;
+            }
+
+            void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, index_fd,
+                0);
+            if (m == MAP_FAILED) {
+                perror("Failed to map catalog index");
+                unmap();
+                return;
+            }
+            map    = static_cast<const char*>(m);
+            mapped = st.st_size;
+        }
+
+        /* Let go of the index */
+        void unmap() {
+            if (map) {
+                munmap(const_cast<char*>(map), mapped);
+            }
+            if (index_fd >= 0) {
+                ::close(index_fd);
+            }
+            map      = NULL;
+            mapped   = 0;
+            index_fd = -1;
+        }
+
+        /* Write a name out to the end of the log */
+        void append(const std::string& name) {
+            if (fd < 0) {
+                return;
+            }
+
+            std::vector<char> record(varint::size(name.length()) +
+                name.length());
+            char* ptr = varint::encode(name.length(), &record[0]);
+            name.copy(ptr, name.length());
+            if (write(fd, &record[0], record.size()) !=
+                static_cast<ssize_t>(record.size())) {
+                perror("Failed to append to catalog");
+            }
+        }
+
+        /* Read in every name in the log that isn't in the index. Anything
+         * after the last complete name was cut off by a crash, and is
+         * truncated away */
+        void load() {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                return;
+            }
+
+            void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (m == MAP_FAILED) {
+                perror("Failed to map catalog");
+                return;
+            }
+
+            const char* start = static_cast<const char*>(m);
+            const char* end   = start + st.st_size;
+            const char* ptr   = start;
+            while (ptr < end) {
+                uint32_t length = 0;
+                const char* name = varint::decode(ptr, end, length);
+                if (name == NULL || length > static_cast<size_t>(end - name)) {
+                    break;
+                }
+                std::string found(name, length);
+                if (!indexed(found)) {
+                    pending.insert(found);
+                }
+                ptr = name + length;
+            }
+            munmap(m, st.st_size);
+
+            if (ptr != end && ftruncate(fd, ptr - start) != 0) {
+                perror("Failed to truncate catalog");
+            }
+        }
+
+        /* Merge the names that are only in the log into a new index, and
+         * start the log over. If this fails, they stay in the log */
+        void compact() {
+            writer out(index_path);
+            std::string name;
+            const char* ptr = (map && head()->count) ?
+                read(map + sizeof(header), name) : NULL;
+            std::set<std::string>::const_iterator it(pending.begin());
+            while (ptr != NULL || it != pending.end()) {
+                if (ptr != NULL && (it == pending.end() || name < *it)) {
+                    out.add(name);
+                    ptr = read(ptr, name);
+                } else {
+                    out.add(*it++);
+                }
+            }
+            if (out.finish() != 0) {
+                return;
+            }
+
+            remap();
+            pending.clear();
+            if (fd >= 0 && ftruncate(fd, 0) != 0) {
+                perror("Failed to truncate catalog");
+            }
+        }
+
+        /* Write out the index for a database that didn't have a catalog, by
+         * walking its metrics' directories */
+        void bootstrap(const std::string& base) {
+            boost::filesystem::path root(base);
+            root /= "metrics";
+            if (!boost::filesystem::is_directory(root)) {
+                return;
+            }
+
+            /* A directory is a metric's if it has slabs in it */
+            names_type found;
+            std::string prefix(root.string() + "/");
+            boost::filesystem::recursive_directory_iterator it(root);
+            boost::filesystem::recursive_directory_iterator it_end;
+            for (; it != it_end; ++it) {
+                if (!boost::filesystem::is_regular_file(it->path())) {
+                    continue;
+                }
+
+                std::string name(it->path().parent_path().string());
+                if (name.length() > prefix.length()) {
+                    found.push_back(name.substr(prefix.length()));
+                }
+            }
+            std::sort(found.begin(), found.end());
+            found.erase(std::unique(found.begin(), found.end()), found.end());
+
+            writer out(index_path);
+            names_type::iterator name(found.begin());
+            for (; name != found.end(); ++name) {
+                out.add(*name);
+            }
+            out.finish();
+        }
+    };
+}
+
+#endif
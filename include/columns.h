@@ -0,0 +1,388 @@
+#ifndef MADB__COLUMNS_H
+#define MADB__COLUMNS_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+/* C includes */
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Internal imports */
+#include "io.h"
+#include "traits.h"
+
+namespace madb {
+    /* One field of a value, which columnar slabs store as its own column */
+    typedef struct column_ {
+        /* What type the field is, if it's a number */
+        enum kind_type { opaque, i8, u8, i16, u16, i32, u32, i64, u64, f32,
+            f64 };
+
+        uint32_t  offset;  /* Where the field is within the value */
+        uint32_t  width;   /* How many bytes it takes */
+        kind_type kind;    /* What type it is */
+
+        column_(uint32_t offset, uint32_t width, kind_type kind=opaque):
+            offset(offset), width(width), kind(kind) {}
+
+        /* Describe a field by its member, like `column::of(&foo::max)` */
+        template <typename D, typename F>
+        static column_ of(F D::* field) {
+            D probe;
+            return column_(reinterpret_cast<const char*>(&(probe.*field)) -
+                reinterpret_cast<const char*>(&probe), sizeof(F),
+                type(static_cast<F*>(NULL)));
+        }
+
+        /* Whether the field is a number */
+        bool numeric() const {
+            return kind != opaque;
+        }
+
+        /* Read the field out of a value, whatever its type. Fields that
+         * aren't numbers read as 0 */
+        double read(const void* value) const {
+            const char* ptr = static_cast<const char*>(value) + offset;
+            switch (kind) {
+                case i8:  return load<int8_t>(ptr);
+                case u8:  return load<uint8_t>(ptr);
+                case i16: return load<int16_t>(ptr);
+                case u16: return load<uint16_t>(ptr);
+                case i32: return load<int32_t>(ptr);
+                case u32: return load<uint32_t>(ptr);
+                case i64: return load<int64_t>(ptr);
+                case u64: return load<uint64_t>(ptr);
+                case f32: return load<float>(ptr);
+                case f64: return load<double>(ptr);
+                default:  return 0;
+            }
+        }
+    private:
+        static kind_type type(int8_t*)   { return i8;  }
+        static kind_type type(uint8_t*)  { return u8;  }
+        static kind_type type(int16_t*)  { return i16; }
+        static kind_type type(uint16_t*) { return u16; }
+        static kind_type type(int32_t*)  { return i32; }
+        static kind_type type(uint32_t*) { return u32; }
+        static kind_type type(int64_t*)  { return i64; }
+        static kind_type type(uint64_t*) { return u64; }
+        static kind_type type(float*)    { return f32; }
+        static kind_type type(double*)   { return f64; }
+
+        template <typename T>
+        static kind_type type(T*) { return opaque; }
+
+        template <typename T>
+        static double load(const char* ptr) {
+            T value;
+            memcpy(&value, ptr, sizeof(T));
+            return static_cast<double>(value);
+        }
+    } column;
+
+    /* Which fields of a value type are stored column by column when slabs
+     * are rotated out. By default there are none, and values are stored
+     * whole. To store a type's slabs by column, specialize this to list
+     * every one of its fields:
+     *
+     *     namespace madb {
+     *         template <> struct layout<foo> {
+     *             static std::vector<column> columns() {
+     *                 std::vector<column> fields;
+     *                 fields.push_back(column::of(&foo::count));
+     *                 fields.push_back(column::of(&foo::max));
+     *                 return fields;
+     *             }
+     *         };
+     *     }
+     *
+     * Any bytes that aren't in a column (like padding) read back as zeros */
+    template <typename D>
+    struct layout {
+        static std::vector<column> columns() {
+            return std::vector<column>();
+        }
+    };
+
+    /* Rotated slabs stored as a structure of arrays: a header, then every
+     * data point's timestamp, then each field of every data point in turn.
+     * Each column begins on a 64-byte boundary, so that a reader that only
+     * needs one field reads only that field, in a run that's ready for
+     * vector instructions. After the columns come the sum, minimum and
+     * maximum of each field that's a number, so that summaries of ranges
+     * that cover a whole slab needn't read its columns at all.
+     *
+     * Column 0 is the timestamps, and column i is the (i - 1)th field of
+     * layout<D>. Data points are sorted, so a range is found by binary
+     * searching the timestamps alone */
+    template <typename D>
+    class columns {
+    public:
+        /* Identifies a columnar slab */
+        static const uint32_t magic = 0x636f6c73;
+
+        /* What each column is aligned to */
+        static const size_t alignment = 64;
+
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+
+        /* Begins every columnar slab */
+        typedef struct header_ {
+            uint32_t magic;
+            uint32_t count;     /* How many data points there are */
+            uint32_t min_time;
+            uint32_t max_time;
+            uint32_t fields;    /* How many columns besides timestamps */
+            uint32_t summaries; /* Where the fields' totals are, or 0 */
+        } header;
+
+        /* The sum, minimum and maximum of one field over a whole slab */
+        typedef struct totals_ {
+            double sum;
+            double min;
+            double max;
+        } totals;
+
+        /* The fields of our value type, from layout<D> */
+        static const std::vector<column>& fields() {
+            static const std::vector<column> described(layout<D>::columns());
+            return described;
+        }
+
+        /* Whether our value type's slabs are stored by column */
+        static bool enabled() {
+            return !fields().empty();
+        }
+
+        /* Where a column begins in a slab
+         *
+         * @param h -- the slab's header
+         * @param index -- which column, where 0 is the timestamps */
+        static off_t where(const header& h, size_t index) {
+            off_t offset = align(sizeof(header));
+            for (size_t i = 0; i < index; ++i) {
+                offset = align(offset + static_cast<off_t>(h.count) *
+                    width(i));
+            }
+            return offset;
+        }
+
+        /* Which of our fields a column is
+         *
+         * @returns its index in fields(), or fields().size() if it's not one
+         *      of them */
+        static size_t find(const column& c) {
+            size_t index = 0;
+            for (; index < fields().size(); ++index) {
+                if (fields()[index].offset == c.offset &&
+                    fields()[index].width == c.width) {
+                    break;
+                }
+            }
+            return index;
+        }
+
+        /* How many bytes each entry in a column takes */
+        static size_t width(size_t index) {
+            return index ? fields()[index - 1].width : sizeof(timestamp_type);
+        }
+
+        /* Encode sorted data points, never empty, as a columnar slab
+         *
+         * @param first -- the first data point
+         * @param count -- how many data points there are
+         * @param out -- where to put the slab */
+        static void encode(const data_type* first, size_t count,
+            std::vector<char>& out) {
+            header h;
+            h.magic     = magic;
+            h.count     = count;
+            h.min_time  = first[0].time;
+            h.max_time  = first[count - 1].time;
+            h.fields    = fields().size();
+            h.summaries = where(h, fields().size() + 1);
+
+            out.assign(h.summaries + fields().size() * sizeof(totals), 0);
+            memcpy(&out[0], &h, sizeof(header));
+            char* times = &out[where(h, 0)];
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(times + i * sizeof(timestamp_type), &first[i].time,
+                    sizeof(timestamp_type));
+            }
+            for (size_t f = 0; f < fields().size(); ++f) {
+                const column& c(fields()[f]);
+                char* dest = &out[where(h, f + 1)];
+                totals t = {0, 0, 0};
+                for (size_t i = 0; i < count; ++i) {
+                    memcpy(dest + i * c.width, reinterpret_cast<const char*>(
+                        &first[i].value) + c.offset, c.width);
+                    double value = c.read(&first[i].value);
+                    t.sum += value;
+                    t.min  = (i == 0 || value < t.min) ? value : t.min;
+                    t.max  = (i == 0 || value > t.max) ? value : t.max;
+                }
+                memcpy(&out[h.summaries + f * sizeof(totals)], &t,
+                    sizeof(totals));
+            }
+        }
+
+        /* Read a slab's header, and check that it matches our layout
+         *
+         * @returns false if it's malformed */
+        static bool open(int fd, header& h) {
+            return pread(fd, &h, sizeof(header), 0) == sizeof(header) &&
+                h.magic == magic && h.fields == fields().size();
+        }
+
+        /* Find the first data point at or after a time, by binary searching
+         * the timestamps
+         *
+         * @param path -- path of the slab
+         * @param start -- beginning of the range, inclusive
+         * @returns the index of the first data point in the range */
+        static size_t seek(const std::string& path, timestamp_type start) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            header h;
+            if (fd < 0) {
+                return 0;
+            } else if (!open(fd, h)) {
+                ::close(fd);
+                return 0;
+            }
+
+            timestamp_type time;
+            off_t  base = where(h, 0);
+            size_t lo = 0, hi = h.count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (pread(fd, &time, sizeof(time),
+                    base + mid * sizeof(time)) != sizeof(time)) {
+                    hi = mid;
+                } else if (time < start) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            ::close(fd);
+            return lo;
+        }
+
+        /* Check the header of a slab that's been mapped into memory, and
+         * that the whole slab is there
+         *
+         * @param map -- the slab
+         * @param size -- how many bytes of it there are
+         * @param h -- where to put its header
+         * @returns false if it's malformed */
+        static bool open(const char* map, size_t size, header& h) {
+            if (size < sizeof(header)) {
+                return false;
+            }
+            memcpy(&h, map, sizeof(header));
+            size_t end = where(h, fields().size() + 1);
+            if (h.summaries) {
+                end = h.summaries + fields().size() * sizeof(totals);
+            }
+            return h.magic == magic && h.fields == fields().size() &&
+                size >= end;
+        }
+
+        /* Put one data point of a mapped slab back together
+         *
+         * @param map -- the slab
+         * @param h -- its header
+         * @param index -- which data point
+         * @param datum -- where to put it */
+        static void row(const char* map, const header& h, size_t index,
+            data_type& datum) {
+            memset(&datum, 0, sizeof(data_type));
+            memcpy(&datum.time, map + where(h, 0) + index *
+                sizeof(timestamp_type), sizeof(timestamp_type));
+            for (size_t f = 0; f < fields().size(); ++f) {
+                const column& c(fields()[f]);
+                memcpy(reinterpret_cast<char*>(&datum.value) + c.offset,
+                    map + where(h, f + 1) + index * c.width, c.width);
+            }
+        }
+
+        /* A field's totals over a whole mapped slab, if it has them
+         *
+         * @returns NULL if it doesn't */
+        static const totals* summary(const char* map, const header& h,
+            size_t field) {
+            if (h.summaries == 0 || !fields()[field].numeric()) {
+                return NULL;
+            }
+            return reinterpret_cast<const totals*>(map + h.summaries) + field;
+        }
+
+        /* Read a run of data points back into whole rows. Every column's
+         * part of the run is read at once
+         *
+         * @param fd -- the slab
+         * @param h -- its header
+         * @param from -- index of the first data point
+         * @param count -- most data points to read
+         * @param results -- where to put them
+         * @param uring -- whether to read through io_uring, if it's there
+         * @returns false if the slab couldn't be read */
+        static bool rows(int fd, const header& h, size_t from, size_t count,
+            values_type& results, bool uring=false) {
+            results.clear();
+            if (from >= h.count) {
+                return true;
+            }
+            count = std::min<size_t>(count, h.count - from);
+
+            std::vector<std::vector<char> > slices(fields().size() + 1);
+            std::vector<io::op> ops;
+            for (size_t i = 0; i < slices.size(); ++i) {
+                slices[i].resize(count * width(i));
+                ops.push_back(io::read(fd, &slices[i][0], slices[i].size(),
+                    where(h, i) + from * width(i)));
+            }
+            io::local(uring).run(ops);
+            for (size_t i = 0; i < ops.size(); ++i) {
+                if (ops[i].result != static_cast<ssize_t>(ops[i].len)) {
+                    return false;
+                }
+            }
+
+            results.resize(count);
+            memset(&results[0], 0, count * sizeof(data_type));
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(&results[i].time, &slices[0][i * sizeof(
+                    timestamp_type)], sizeof(timestamp_type));
+            }
+            for (size_t f = 0; f < fields().size(); ++f) {
+                const column& c(fields()[f]);
+                const char* src = &slices[f + 1][0];
+                for (size_t i = 0; i < count; ++i) {
+                    memcpy(reinterpret_cast<char*>(&results[i].value) +
+                        c.offset, src + i * c.width, c.width);
+                }
+            }
+            return true;
+        }
+    private:
+        /* Round an offset up to our alignment */
+        static off_t align(off_t offset) {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef MADB__CRC32C_H
+#define MADB__CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace madb {
+    /* CRC-32C (Castagnoli) checksums, for telling torn or corrupt records
+     * apart from whole ones. On x86 processors with SSE 4.2 this uses the
+     * crc32 instruction, and otherwise a table */
+    namespace crc32c {
+        /* The reflected Castagnoli polynomial */
+        static const uint32_t polynomial = 0x82f63b78;
+
+        /* A byte's worth of the polynomial's remainders */
+        struct table {
+            uint32_t entries[256];
+
+            table() {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t entry = i;
+                    for (int bit = 0; bit < 8; ++bit) {
+                        entry = (entry >> 1) ^ ((entry & 1) ? polynomial : 0);
+                    }
+                    entries[i] = entry;
+                }
+            }
+        };
+
+        /* Checksum a byte at a time with a table, on any processor */
+        inline uint32_t portable(uint32_t crc, const char* ptr, size_t len) {
+            static const table remainders;
+            const unsigned char* p =
+                reinterpret_cast<const unsigned char*>(ptr);
+            for (size_t i = 0; i < len; ++i) {
+                crc = remainders.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+            }
+            return crc;
+        }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MADB_HAVE_CRC32_INSTRUCTION 1
+        /* Checksum eight bytes at a time with the crc32 instruction */
+        __attribute__((target("sse4.2")))
+        inline uint32_t hardware(uint32_t crc, const char* ptr, size_t len) {
+            uint64_t wide = crc;
+            for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, ptr, sizeof(word));
+                wide = __builtin_ia32_crc32di(wide, word);
+                ptr += sizeof(word);
+            }
+            crc = static_cast<uint32_t>(wide);
+            for (; len; --len) {
+                crc = __builtin_ia32_crc32qi(crc, *ptr++);
+            }
+            return crc;
+        }
+#endif
+
+        /* Checksum some bytes
+         *
+         * @param ptr -- the bytes to checksum
+         * @param len -- how many there are */
+        inline uint32_t compute(const char* ptr, size_t len) {
+#ifdef MADB_HAVE_CRC32_INSTRUCTION
+            static const bool instruction = __builtin_cpu_supports("sse4.2");
+            if (instruction) {
+                return ~hardware(~0U, ptr, len);
+            }
+#endif
+            return ~portable(~0U, ptr, len);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef MADB__CURSOR_H
+#define MADB__CURSOR_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <tr1/memory>
+
+/* C includes */
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Internal imports */
+#include "io.h"
+#include "traits.h"
+#include "columns.h"
+#include "gorilla.h"
+
+namespace madb {
+    /* A forward cursor over the data points of one metric in a time range.
+     *
+     * A cursor is made up of sources that are each already sorted: rotated
+     * slab files, which are read a chunk (or a compressed block, or a run of
+     * each column) at a time as the cursor reaches them, and small runs of
+     * points held in memory (the latest slab and anything still in a
+     * buffer). The sources are merged lazily with a heap, so a cursor over a
+     * long range never holds more than a chunk per source, and never has to
+     * sort everything it returns. Points with the same timestamp come out in
+     * the order their sources were added.
+     *
+     * Slab files are opened as they're added, and stay open until the cursor
+     * is done with them, so that a slab that's rotated, compacted or pruned
+     * in the meantime is still read as it was. Copies of a cursor share them
+     */
+    template <typename D>
+    class cursor {
+    public:
+        /* How many data points to read from a slab file at once */
+        static const size_t chunk_size = 512;
+
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+
+        /* Constructor
+         *
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param uring -- whether reads go through io_uring, if it's
+         *      available */
+        cursor(timestamp_type start, timestamp_type end, bool uring=false):
+            start(start), end(end), sources(), heap(), started(false),
+            uring(uring) {}
+
+        /* Add a sorted run of data points, all within our range
+         *
+         * @param points -- the data points */
+        void add(const values_type& points) {
+            if (points.empty()) {
+                return;
+            }
+            sources.push_back(source());
+            sources.back().chunk = points;
+        }
+
+        /* Add a sorted slab file, to be read up to the end of our range
+         *
+         * @param path -- path to the slab file
+         * @param offset -- byte offset of the first point in our range, or
+         *      of the first block for a compressed slab
+         * @param compressed -- whether the slab is made of gorilla blocks */
+        void add(const std::string& path, off_t offset,
+            bool compressed=false) {
+            file_type f(open(path));
+            if (!f) {
+                return;
+            }
+            sources.push_back(source());
+            sources.back().file       = f;
+            sources.back().offset     = offset;
+            sources.back().compressed = compressed;
+        }
+
+        /* Add a sorted run of data points in part of a file that's already
+         * open, like one metric's in a segment, to be read up to the end of
+         * our range or of the run. The file is duplicated, so it stays open
+         * for us whatever happens to it in the meantime
+         *
+         * @param fd -- the open file
+         * @param offset -- byte offset of the first point in our range
+         * @param limit -- byte offset where the run ends */
+        void add(int fd, off_t offset, off_t limit) {
+            if (offset >= limit) {
+                return;
+            }
+            int copy = dup(fd);
+            if (copy < 0) {
+                return;
+            }
+            sources.push_back(source());
+            sources.back().file   = file_type(new descriptor(copy));
+            sources.back().offset = offset;
+            sources.back().limit  = limit;
+        }
+
+        /* Add a columnar slab file, to be read up to the end of our range
+         *
+         * @param path -- path to the slab file
+         * @param row -- index of the first point in our range */
+        void add_columns(const std::string& path, size_t row) {
+            file_type f(open(path));
+            if (!f) {
+                return;
+            }
+            sources.push_back(source());
+            sources.back().file     = f;
+            sources.back().offset   = row;
+            sources.back().columnar = true;
+        }
+
+        /* Get the next data point
+         *
+         * @param datum -- where to store the data point
+         * @returns whether there was another data point */
+        bool next(data_type& datum) {
+            if (!started) {
+                begin();
+            }
+
+            if (heap.empty()) {
+                return false;
+            }
+
+            std::pop_heap(heap.begin(), heap.end(), later(sources));
+            source& s(sources[heap.back()]);
+            datum = s.chunk[s.position++];
+            if (fill(s)) {
+                std::push_heap(heap.begin(), heap.end(), later(sources));
+            } else {
+                heap.pop_back();
+            }
+            return true;
+        }
+
+        /* Read everything that's left into a vector
+         *
+         * @param results -- where to append the data points */
+        void drain(values_type& results) {
+            data_type datum;
+            while (next(datum)) {
+                results.push_back(datum);
+            }
+        }
+    private:
+        /* An open slab file, closed once nothing refers to it */
+        class descriptor {
+        public:
+            explicit descriptor(int fd): fd(fd) {}
+
+            ~descriptor() {
+                ::close(fd);
+            }
+
+            /* Members */
+            int fd;  /* The open file */
+        private:
+            /* Private, unimplemented to prevent use */
+            descriptor(const descriptor& other);
+            const descriptor& operator=(const descriptor& other);
+        };
+
+        /* Shared between copies of a source */
+        typedef std::tr1::shared_ptr<descriptor> file_type;
+
+        /* One sorted source of data points */
+        typedef struct source_ {
+            file_type   file;      /* Slab file, or empty if in memory or
+                                    * done with */
+            off_t       offset;    /* Where the next chunk begins, or for a
+                                    * columnar file, its first point */
+            off_t       limit;     /* Where the points end, or 0 for the
+                                    * end of the file */
+            bool        compressed;  /* Whether the file is gorilla blocks */
+            bool        columnar;  /* Whether the file is stored by column */
+            values_type chunk;     /* Points read but not yet returned */
+            size_t      position;  /* Next point in the chunk */
+
+            source_(): file(), offset(0), limit(0), compressed(false),
+                columnar(false), chunk(), position(0) {}
+        } source;
+
+        /* Orders the heap so that the earliest head is on top, and among
+         * equal heads the source that was added first */
+        struct later {
+            const std::vector<source>& sources;
+
+            later(const std::vector<source>& sources): sources(sources) {}
+
+            bool operator()(size_t a, size_t b) const {
+                timestamp_type ta(sources[a].chunk[sources[a].position].time);
+                timestamp_type tb(sources[b].chunk[sources[b].position].time);
+                return (ta > tb) || (ta == tb && a > b);
+            }
+        };
+
+        /* Members */
+        timestamp_type      start;    /* Beginning of the range */
+        timestamp_type      end;      /* End of the range */
+        std::vector<source> sources;  /* Everything we're merging */
+        std::vector<size_t> heap;     /* Sources that have points left */
+        bool                started;  /* Whether we've built the heap */
+        bool                uring;    /* Whether to read through io_uring */
+
+        /* Open a slab file
+         *
+         * @returns the file, or empty if it couldn't be opened */
+        static file_type open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            return (fd < 0) ? file_type() : file_type(new descriptor(fd));
+        }
+
+        /* Prime every source, and build the heap. The first chunk of every
+         * slab file is read all at once */
+        void begin() {
+            started = true;
+
+            std::vector<io::op> ops;
+            std::vector<size_t> reading;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                source& s(sources[i]);
+                if (s.file && !s.compressed && !s.columnar) {
+                    ops.push_back(io::op());
+                    prepare(s, ops.back());
+                    reading.push_back(i);
+                }
+            }
+
+            io::local(uring).run(ops);
+            for (size_t i = 0; i < reading.size(); ++i) {
+                complete(sources[reading[i]], ops[i]);
+                trim(sources[reading[i]]);
+            }
+
+            for (size_t i = 0; i < sources.size(); ++i) {
+                if (fill(sources[i])) {
+                    heap.push_back(i);
+                }
+            }
+            std::make_heap(heap.begin(), heap.end(), later(sources));
+        }
+
+        /* Make sure a source has a point ready, reading the next chunk of
+         * its file if need be
+         *
+         * @returns whether the source has a point ready */
+        bool fill(source& s) {
+            if (s.position < s.chunk.size()) {
+                return true;
+            }
+            if (!s.file) {
+                values_type().swap(s.chunk);
+                return false;
+            }
+
+            if (s.compressed) {
+                s.position = 0;
+                inflate(s);
+            } else if (s.columnar) {
+                s.position = 0;
+                gather(s);
+            } else {
+                io::op o;
+                prepare(s, o);
+                io::local(uring).run(&o, 1);
+                complete(s, o);
+            }
+            return trim(s);
+        }
+
+        /* Make the read of a source's next chunk
+         *
+         * @param s -- the source
+         * @param o -- where to make the read */
+        void prepare(source& s, io::op& o) {
+            size_t points = chunk_size;
+            if (s.limit && s.offset + static_cast<off_t>(
+                points * sizeof(data_type)) > s.limit) {
+                points = (s.limit - s.offset) / sizeof(data_type);
+            }
+            s.position = 0;
+            s.chunk.resize(chunk_size);
+            o = io::read(s.file->fd, &s.chunk[0], points * sizeof(data_type),
+                s.offset);
+        }
+
+        /* Take in the chunk that a read made by prepare() got, and let go
+         * of the file once it's all been read */
+        void complete(source& s, const io::op& o) {
+            size_t points = (o.result > 0) ? o.result / sizeof(data_type) : 0;
+            s.chunk.resize(points);
+            s.offset += points * sizeof(data_type);
+            if (points < chunk_size || (s.limit && s.offset >= s.limit)) {
+                s.file.reset();
+            }
+        }
+
+        /* Once we're past the end of our range, or the file, we're done
+         * with a source after whatever's left in its chunk
+         *
+         * @returns whether the source has a point ready */
+        bool trim(source& s) {
+            if (!s.chunk.empty() && s.chunk.back().time > end) {
+                s.file.reset();
+                typename values_type::iterator past(std::upper_bound(
+                    s.chunk.begin(), s.chunk.end(), end, after()));
+                s.chunk.erase(past, s.chunk.end());
+            }
+
+            if (s.chunk.empty()) {
+                values_type().swap(s.chunk);
+                return false;
+            }
+            return true;
+        }
+
+        /* Decode the next compressed block of a source that overlaps our
+         * range, skipping any that come entirely before it. The source lets
+         * go of its file once there are no more blocks to read */
+        void inflate(source& s) {
+            typedef typename gorilla<D>::header header;
+
+            s.chunk.clear();
+            int fd = s.file->fd;
+            header h;
+            std::vector<char> payload;
+            while (s.chunk.empty()) {
+                if (pread(fd, &h, sizeof(header), s.offset) !=
+                    sizeof(header) || h.magic != gorilla<D>::magic) {
+                    s.file.reset();
+                    break;
+                }
+                s.offset += sizeof(header) + h.bytes;
+
+                if (h.max_time < start) {
+                    continue;
+                }
+                if (h.min_time > end) {
+                    s.file.reset();
+                    break;
+                }
+
+                payload.resize(h.bytes);
+                if (pread(fd, &payload[0], h.bytes, s.offset - h.bytes) !=
+                    static_cast<ssize_t>(h.bytes) ||
+                    !gorilla<D>::decode(h, &payload[0], s.chunk)) {
+                    s.chunk.clear();
+                    s.file.reset();
+                    break;
+                }
+
+                /* Only the first block we decode can begin before our range */
+                s.chunk.erase(s.chunk.begin(), std::lower_bound(
+                    s.chunk.begin(), s.chunk.end(), start, before()));
+            }
+        }
+
+        /* Read the next chunk of a columnar source's points, a column at a
+         * time. The source lets go of its file once there are no more */
+        void gather(source& s) {
+            typedef typename columns<D>::header header;
+
+            s.chunk.clear();
+            int fd = s.file->fd;
+            header h;
+            if (!columns<D>::open(fd, h) ||
+                !columns<D>::rows(fd, h, s.offset, chunk_size, s.chunk,
+                    uring)) {
+                s.chunk.clear();
+                s.file.reset();
+            } else {
+                s.offset += s.chunk.size();
+                if (static_cast<size_t>(s.offset) >= h.count) {
+                    s.file.reset();
+                }
+            }
+        }
+
+        /* For finding the first point in the range */
+        struct before {
+            bool operator()(const data_type& d, timestamp_type time) const {
+                return d.time < time;
+            }
+        };
+
+        /* For finding the first point past the end of the range */
+        struct after {
+            bool operator()(timestamp_type time, const data_type& d) const {
+                return time < d.time;
+            }
+        };
+    };
+}
+
+#endif
@@ -3,14 +3,34 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 /* C includes */
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 /* The default hash funciton */
 #include "hash.h"
+#include "io.h"
+#include "async.h"
+#include "pool.h"
+#include "prune.h"
+#include "shard.h"
+#include "sync.h"
+#include "summary.h"
+#include "alarm.h"
+#include "stale.h"
+#include "subscribe.h"
+#include "cursor.h"
 #include "buffer.h"
+#include "rollup.h"
+#include "catalog.h"
+#include "segment.h"
 #include "traits.h"
+#include "options.h"
 
 #include <boost/filesystem.hpp>
 
@@ -20,6 +40,10 @@ namespace madb {
      * argument may be a hash struct that implements:
      *
      *    uint32_t operator()(const char* data, size_t len) const
+     *
+     * Inserts and gets may be issued from any number of threads at once.
+     * Metric names are hashed to one of `num_files` shards, each with its own
+     * lock, so threads only contend when their metrics share a shard.
      */
     template <typename D, typename H=superfast>
     class db {
@@ -34,15 +58,62 @@ namespace madb {
         typedef typename traits::data_type       data_type;
         typedef typename traits::values_type     values_type;
         typedef typename traits::values_map_type values_map_type;
+        typedef typename traits::record_type     record_type;
 
         /* Callback traits */
         typedef typename traits::insert_cb_type  insert_cb_type;
         typedef typename traits::read_cb_type    read_cb_type;
         typedef typename traits::get_cb_type     get_cb_type;
+        typedef typename traits::update_cb_type  update_cb_type;
+        typedef typename traits::name_cb_type    name_cb_type;
+        typedef typename traits::stale_cb_type   stale_cb_type;
+        typedef typename traits::alarm_cb_type   alarm_cb_type;
+
+        /* When an alarm goes off */
+        typedef          threshold<D>            threshold_type;
+
+        /* One field of a metric's data points, summarized over a range */
+        typedef          summary<D>              summary_type;
+
+        /* Combines the data points in a bucket when rolling up */
+        typedef typename traits::aggregate_type  aggregate_type;
 
         /* Our hash type */
         typedef          H                       hash_type;
 
+        /* Cursors over a range of data */
+        typedef          cursor<D>               cursor_type;
+
+        /* A metric name that's already been hashed and interned, so that
+         * inserting through it never has to look at the name again. Handles
+         * stay valid for as long as the database is open. A name too long to
+         * insert gets a handle that inserts nothing */
+        typedef struct handle_ {
+            uint32_t shard;  /* Which shard the metric maps to */
+            uint32_t id;     /* The metric's id within that shard */
+        } handle;
+
+        /* How the database is doing */
+        typedef struct stats_ {
+            size_t   recovered;         /* Buffers recovered when opening */
+            size_t   recovering;        /* How many are still being dumped */
+            double   recovery_seconds;  /* How long it took from opening
+                                         * until they'd all been dumped */
+            uint64_t recent_bytes;      /* Memory holding recent points */
+            uint64_t recent_budget;     /* The most it may hold */
+            uint64_t recent_hits;       /* Gets answered from memory */
+            uint64_t recent_misses;     /* Gets that went to disk */
+            uint64_t subscription_drops;  /* Updates and names dropped for
+                                           * lack of room to queue them */
+            uint64_t alarm_drops;       /* Alarms going off or clearing,
+                                         * dropped for lack of room */
+            size_t   alarm_rule_sets;   /* Distinct sets of alarms that
+                                         * metrics are checked against */
+            uint64_t syncs;             /* Times the buffers were synced */
+            bool     io_uring;          /* Whether dumps and reads go
+                                         * through io_uring */
+        } stats_type;
+
         /* Constructor
          *
          * Open up a database at the provided path with a certain number of
@@ -51,39 +122,153 @@ namespace madb {
          * @param base -- where to store the database
          * @param num_files -- how many open file descriptors to use */
         db(const std::string& base, uint32_t num_files):
-            path(base), num_files(num_files), hasher(), buffers(num_files) {
-            /* If the provided path doesn't end with a slash, it should */
-            if (path.length() && path[path.length() - 1] != '/') {
-                path = path + "/";
-            }
-
-            /* We should also make sure that the directory exists */
+            path(base), num_files(num_files), opts(), hasher(),
+            flushers(NULL), rolled(NULL), expiry(NULL), known(NULL),
+            store(NULL), async(NULL), recovery(NULL), durable(NULL),
+            hot(NULL), watchers(NULL), stale(NULL), alerts(NULL), shards() {
+            open();
+        }
 
-            /* Rotate out any existing buffers */
-            buffer<D>::rotate(path);
+        /* Constructor
+         *
+         * Open up a database at the provided path with a certain number of
+         * open file descriptors, and some tuning options.
+         *
+         * @param base -- where to store the database
+         * @param num_files -- how many open file descriptors to use
+         * @param opts -- tuning options */
+        db(const std::string& base, uint32_t num_files, const options& opts):
+            path(base), num_files(num_files), opts(opts), hasher(),
+            flushers(NULL), rolled(NULL), expiry(NULL), known(NULL),
+            store(NULL), async(NULL), recovery(NULL), durable(NULL),
+            hot(NULL), watchers(NULL), stale(NULL), alerts(NULL), shards() {
+            open();
+        }
 
-            for (uint32_t i = 0; i < num_files; ++i) {
-                buffers[i].mktemp(path);
+        /* Destructor
+         *
+         * Waits for any buffers being dumped. The rest are left on disk and
+         * recovered when the database is next opened */
+        ~db() {
+            watchers->stop();
+            stale->stop();
+            alerts->stop();
+            delete async;
+            delete durable;
+            reap();
+            delete expiry;
+            delete flushers;
+            delete rolled;
+            for (uint32_t i = 0; i < shards.size(); ++i) {
+                delete shards[i];
             }
+            delete store;
+            delete hot;
+            delete known;
+            delete watchers;
+            delete stale;
+            delete alerts;
+            pthread_mutex_destroy(&recovery_lock);
+            pthread_mutex_destroy(&async_lock);
+            pthread_mutex_destroy(&reap_lock);
         }
 
-        /* Destructor */
-        ~db() {}
-
         /* Insert a datapoint synchronously
          *
          * @param name -- name of the metric
          * @param time -- timestamp for the data point
-         * @param value -- data point to insert */
-        void insert(const key_type& name, timestamp_type time,
+         * @param value -- data point to insert
+         * @returns 0 on success, else -1 if it couldn't be inserted or
+         *      synced */
+        int insert(const key_type& name, timestamp_type time,
             const value_type& value) {
             /* Figure out which buffer this needs to be mapped to */
             uint32_t hashed = hasher(
-                name.c_str(), name.length()) % buffers.size();
-            buffers[hashed].insert(name, time, value);
+                name.c_str(), name.length()) % shards.size();
+            int result = shards[hashed]->insert(name, time, value);
+            if (commit(name.length() + sizeof(data_type)) != 0) {
+                result = -1;
+            }
+            return result;
+        }
+
+        /* Resolve a metric name to a handle for fast inserts
+         *
+         * @param name -- name of the metric */
+        handle resolve(const key_type& name) {
+            handle h;
+            h.shard = hasher(name.c_str(), name.length()) % shards.size();
+            h.id    = shards[h.shard]->resolve(name);
+            return h;
+        }
+
+        /* Insert a datapoint synchronously through a resolved handle
+         *
+         * @param h -- handle for the metric, from resolve()
+         * @param time -- timestamp for the data point
+         * @param value -- data point to insert
+         * @returns 0 on success, else -1 if it couldn't be inserted or
+         *      synced */
+        int insert(const handle& h, timestamp_type time,
+            const value_type& value) {
+            int result = shards[h.shard]->insert(h.id, time, value);
+            if (commit(sizeof(data_type)) != 0) {
+                result = -1;
+            }
+            return result;
+        }
+
+        /* Insert a batch of datapoints synchronously
+         *
+         * Every name is hashed up front, and the batch is partitioned by
+         * shard so that each shard is locked and written to just once. Points
+         * for the same metric are inserted in the order they appear.
+         *
+         * @param first -- the first of the records to insert
+         * @param last -- one past the last of the records to insert
+         * @returns 0 on success, else -1 if any records couldn't be
+         *      inserted or synced */
+        int insert_batch(const record_type* first, const record_type* last) {
+            int result = 0;
+            size_t size = last - first;
+            std::vector<uint32_t> hashed(size);
+            std::vector<size_t>   offsets(shards.size() + 1, 0);
+
+            /* Count how many records are headed to each shard */
+            size_t bytes = size * sizeof(data_type);
+            for (size_t i = 0; i < size; ++i) {
+                hashed[i] = hasher(first[i].name.c_str(),
+                    first[i].name.length()) % shards.size();
+                ++offsets[hashed[i] + 1];
+                bytes += first[i].name.length();
+            }
+            for (size_t i = 1; i < offsets.size(); ++i) {
+                offsets[i] += offsets[i - 1];
+            }
+
+            /* And then lay them out grouped by shard */
+            std::vector<const record_type*> sorted(size);
+            std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < size; ++i) {
+                sorted[next[hashed[i]]++] = first + i;
+            }
+
+            for (size_t i = 0; i < shards.size(); ++i) {
+                if (offsets[i] != offsets[i + 1] &&
+                    shards[i]->insert(&sorted[0] + offsets[i],
+                        &sorted[0] + offsets[i + 1]) != 0) {
+                    result = -1;
+                }
+            }
+            if (commit(bytes) != 0) {
+                result = -1;
+            }
+            return result;
         }
 
-        /* Insert a datapoint asynchronously
+        /* Insert a datapoint asynchronously. The callback is invoked from
+         * dispatch() once the point's been inserted. Asynchronous inserts
+         * may be carried out in any order
          *
          * @param name -- name of the metric
          * @param time -- timestamp for the data point
@@ -92,7 +277,14 @@ namespace madb {
          * @param data -- user data to provide to the callback */
         void insert(const key_type& name, timestamp_type time,
             const value_type& value, insert_cb_type cb, void* data) {
-            cb(data);
+            pending_insert* p = new pending_insert();
+            p->self  = this;
+            p->name  = name;
+            p->time  = time;
+            p->value = value;
+            p->cb    = cb;
+            p->data  = data;
+            jobs()->submit(pending_insert::work, pending_insert::done, p);
         }
 
         /* Get data synchronously
@@ -103,11 +295,114 @@ namespace madb {
         values_type get(const key_type& name, timestamp_type start,
             timestamp_type end) {
             uint32_t hashed = hasher(
-                name.c_str(), name.length()) % buffers.size();
-            return buffers[hashed].get(name, start, end);
+                name.c_str(), name.length()) % shards.size();
+            return shards[hashed]->get(name, start, end);
         }
 
-        /* Get data asynchronously
+        /* Get data synchronously at a lower resolution
+         *
+         * Reads from the coarsest of the metric's tiers that has at least
+         * this resolution, and anything that hasn't been rolled up yet is
+         * downsampled on the fly. Each data point is stamped with the
+         * beginning of its bucket, and the range is widened to whole buckets.
+         * Metrics with no such tier get their raw data points.
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param resolution -- the coarsest acceptable resolution, in
+         *      seconds */
+        values_type get(const key_type& name, timestamp_type start,
+            timestamp_type end, uint32_t resolution) {
+            const tier* t = rolled ? rolled->coarsest(name, resolution) : NULL;
+            if (t == NULL) {
+                return get(name, start, end);
+            }
+
+            start = rollups<D>::floor(start, t->resolution);
+            values_type results(rolled->get(name, *t, start, end));
+
+            /* Whatever comes after the last rolled up bucket */
+            timestamp_type from = results.empty() ? start :
+                results.back().time + t->resolution;
+            if (from <= end) {
+                values_type raw(get(name, from, end));
+                if (!raw.empty()) {
+                    rolled->downsample(&raw[0], &raw[0] + raw.size(),
+                        t->resolution, results);
+                }
+            }
+            return results;
+        }
+
+        /* Summarize one field of a metric's data points in a range, like
+         * `db.aggregate("web.latency", start, end, &foo::max)`, without
+         * getting every data point. Slabs are read in place, and only those
+         * that can overlap the range. Columnar slabs are read a whole column
+         * at a time, and those entirely in the range are summarized from
+         * their headers; other layouts are read a data point at a time.
+         * Fields are read as doubles
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param field -- which field of the value
+         * @param ops -- which parts of the summary are wanted, from
+         *      summary_op. Without the sum, minimum or maximum, no values
+         *      need to be read */
+        template <typename F>
+        summary_type aggregate(const key_type& name, timestamp_type start,
+            timestamp_type end, F D::* field, int ops=summary_all) {
+            summary_type result;
+            summarizer<D, F> s(field, ops, result);
+            uint32_t hashed = hasher(
+                name.c_str(), name.length()) % shards.size();
+            shards[hashed]->summarize(name, start, end, s);
+            return result;
+        }
+
+        /* Set how the data points in a bucket are combined when rolling up.
+         * By default a bucket keeps its latest data point. Slabs left behind
+         * by a crash may be rolled up as the database opens, before this can
+         * be called, so prefer `options::aggregate_with`
+         *
+         * @param fn -- the aggregate, or NULL for the default */
+        void aggregate_with(aggregate_type fn) {
+            if (rolled) {
+                rolled->aggregate_with(fn);
+            }
+        }
+
+        /* List the metrics whose names begin with a prefix. Metrics are
+         * listed once any of their data points have been dumped
+         *
+         * @param prefix -- the prefix, or empty for every metric */
+        std::vector<key_type> list(const key_type& prefix) {
+            return known->list(prefix);
+        }
+
+        /* List the metrics whose names match a shell-style pattern, like
+         * `web.*.requests`
+         *
+         * @param pattern -- the pattern to match */
+        std::vector<key_type> glob(const key_type& pattern) {
+            return known->glob(pattern);
+        }
+
+        /* Get a cursor over data, which reads points lazily in order
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive */
+        cursor_type scan(const key_type& name, timestamp_type start,
+            timestamp_type end) {
+            uint32_t hashed = hasher(
+                name.c_str(), name.length()) % shards.size();
+            return shards[hashed]->scan(name, start, end);
+        }
+
+        /* Get data asynchronously. The callback is invoked from dispatch()
+         * with the results
          *
          * @param name -- name of the metric
          * @param start -- beginning of the range, inclusive
@@ -116,11 +411,182 @@ namespace madb {
          * @param data -- user data to pass to the callback */
         void get(const key_type& name, timestamp_type start,
             timestamp_type end, get_cb_type cb, void* data) {
-            cb(get(name, start, end), data);
+            pending_get* p = new pending_get();
+            p->self  = this;
+            p->name  = name;
+            p->start = start;
+            p->end   = end;
+            p->cb    = cb;
+            p->data  = data;
+            jobs()->submit(pending_get::work, pending_get::done, p);
+        }
+
+        /* A file descriptor that's readable whenever there are asynchronous
+         * completions waiting to be dispatched, for adding to an event loop
+         * (with uv_poll_start, epoll_ctl, and the like) */
+        int fd() const {
+            return jobs()->fd();
+        }
+
+        /* Invoke the callbacks of every asynchronous operation that's
+         * completed, on this thread
+         *
+         * @returns how many callbacks were invoked */
+        size_t dispatch() {
+            return jobs()->dispatch();
+        }
+
+        /* Wait for asynchronous operations to complete, and invoke their
+         * callbacks, for threads with no other event loop
+         *
+         * @param timeout -- most milliseconds to wait, or -1 for ever
+         * @returns how many callbacks were invoked */
+        size_t poll(int timeout) {
+            return jobs()->poll(timeout);
+        }
+
+        /* Subscribe to the data points inserted into every metric whose
+         * name matches a shell-style pattern. The callback is invoked on a
+         * background thread, with batches of a metric's data points in the
+         * order they were inserted
+         *
+         * @param pattern -- which metrics, like `web.*.requests`
+         * @param cb -- user callback
+         * @param data -- user data to pass to the callback
+         * @returns an id for unsubscribing */
+        uint32_t subscribe(const key_type& pattern, update_cb_type cb,
+            void* data) {
+            return watchers->subscribe(pattern, cb, data);
+        }
+
+        /* Subscribe to the names of new metrics that match a shell-style
+         * pattern. Like list(), a metric is new once its first data points
+         * have been dumped
+         *
+         * @param pattern -- which metrics, like `web.*`
+         * @param cb -- user callback
+         * @param data -- user data to pass to the callback
+         * @returns an id for unsubscribing */
+        uint32_t subscribe(const key_type& pattern, name_cb_type cb,
+            void* data) {
+            return watchers->subscribe(pattern, cb, data);
+        }
+
+        /* Stop a subscription. Its callback won't be invoked once this
+         * returns, so this mustn't be called from a callback
+         *
+         * @param id -- from subscribe() */
+        void unsubscribe(uint32_t id) {
+            watchers->unsubscribe(id);
+        }
+
+        /* Watch for metrics whose names match a shell-style pattern going
+         * some number of seconds without a new data point. A metric is only
+         * watched once it's had a data point since the watch began, and is
+         * only reported once until it has another. The callback is invoked
+         * on a background thread, with every metric that went stale in the
+         * same second at once
+         *
+         * @param pattern -- which metrics, like `web.*.requests`
+         * @param seconds -- how long is too long
+         * @param cb -- user callback
+         * @param data -- user data to pass to the callback
+         * @returns an id for unwatching */
+        uint32_t watch_stale(const key_type& pattern, uint32_t seconds,
+            stale_cb_type cb, void* data) {
+            return stale->watch(pattern, seconds, cb, data);
+        }
+
+        /* Stop watching for metrics going stale. The callback won't be
+         * invoked once this returns, so this mustn't be called from it
+         *
+         * @param id -- from watch_stale() */
+        void unwatch_stale(uint32_t id) {
+            stale->unwatch(id);
+        }
+
+        /* Raise an alarm whenever a data point inserted into a metric whose
+         * name matches a shell-style pattern meets a threshold, after one
+         * that didn't, like `threshold_type::above(&D::max, 90)`. It clears
+         * with the first data point after that which doesn't. Alarms are
+         * checked as data points are inserted, and the callback is invoked
+         * on a background thread, with the metric's name, the data point,
+         * and whether the alarm went off or cleared. At most 64 alarms apply
+         * to any one metric
+         *
+         * @param pattern -- which metrics, like `web.*.latency`
+         * @param condition -- when it goes off
+         * @param cb -- user callback
+         * @param data -- user data to pass to the callback
+         * @returns an id for removing it */
+        uint32_t alarm(const key_type& pattern,
+            const threshold_type& condition, alarm_cb_type cb, void* data) {
+            return alerts->add(pattern, condition, cb, data);
+        }
+
+        /* Remove an alarm. Its callback won't be invoked once this returns,
+         * so this mustn't be called from a callback
+         *
+         * @param id -- from alarm() */
+        void unalarm(uint32_t id) {
+            alerts->remove(id);
+        }
+
+        /* Wait until every full buffer has been dumped out to its slabs,
+         * every rotated slab rolled up, every segment merged, and every
+         * subscriber and alarm told about what's been inserted */
+        void flush() {
+            pthread_mutex_lock(&async_lock);
+            if (async) {
+                async->drain();
+            }
+            pthread_mutex_unlock(&async_lock);
+            reap();
+            flushers->drain();
+            if (rolled) {
+                rolled->drain();
+            }
+            if (store) {
+                store->drain();
+            }
+            watchers->drain();
+            alerts->drain();
+        }
+
+        /* Remove every slab whose data points have all expired, according
+         * to the retention of the policies in our options, along with the
+         * segments that have. This also happens in the background every
+         * `prune_interval` seconds
+         *
+         * @param now -- the current time
+         * @returns how many slabs and segments were removed or rewritten */
+        size_t prune(timestamp_type now) {
+            return expiry->prune(now);
+        }
+
+        /* How the database is doing, such as how long it took to recover
+         * from a crash */
+        stats_type stats() {
+            pthread_mutex_lock(&recovery_lock);
+            stats_type copy(counters);
+            pthread_mutex_unlock(&recovery_lock);
+            copy.subscription_drops = watchers->drops();
+            copy.alarm_drops        = alerts->drops();
+            copy.alarm_rule_sets    = alerts->rule_sets();
+            copy.syncs              = durable ? durable->syncs() : 0;
+            copy.io_uring           = opts.io_uring &&
+                io::local(true).uses_uring();
+            if (hot) {
+                copy.recent_budget = hot->budget;
+                hot->read(copy.recent_bytes, copy.recent_hits,
+                    copy.recent_misses);
+            }
+            return copy;
         }
 
         /* Destroy this database */
         void destroy() {
+            flush();
             boost::filesystem::remove_all(path);
         }
     private:
@@ -132,8 +598,318 @@ namespace madb {
         /* Members */
         std::string path;        /* Path we're working from */
         uint32_t    num_files;   /* How many open file descriptors to use */
+        options     opts;        /* Our tuning options */
         hash_type   hasher;      /* Hashing function struct */
-        std::vector<buffer<value_type> > buffers;
+        pool*       flushers;    /* Dumps full buffers out to slabs */
+        rollups<D>* rolled;      /* Rolls up rotated slabs, if need be */
+        pruner<D>*  expiry;      /* Removes expired slabs */
+        catalog*    known;       /* Every metric's name */
+        segments<D>* store;      /* Where dumps go, if not to slabs */
+        mutable executor* async; /* Runs asynchronous operations, once
+                                  * there have been any */
+        pool*       recovery;    /* Dumps buffers left behind by a crash,
+                                  * until they all have been */
+        syncer*     durable;     /* Syncs buffers, if need be */
+        memtable*   hot;         /* Budget for recent points, if any */
+        subscriptions<D>* watchers;  /* Told about inserts and new names */
+        staleness<D>* stale;     /* Times metrics going stale */
+        alarms<D>*  alerts;      /* Checked against inserts */
+        stats_type  counters;    /* How we're doing */
+        timeval     opened;      /* When open() began */
+        pthread_mutex_t recovery_lock;  /* Guards counters */
+        mutable pthread_mutex_t async_lock;  /* Guards creating async */
+        pthread_mutex_t reap_lock;      /* Guards deleting recovery */
+        std::vector<shard<value_type>*> shards;
+
+        /* Our executor for asynchronous operations, started the first time
+         * one's needed so that databases that never use them have no threads
+         * or eventfd for them */
+        executor* jobs() const {
+            pthread_mutex_lock(&async_lock);
+            if (async == NULL) {
+                async = new executor(opts.async_threads, opts.async_pending);
+            }
+            executor* result = async;
+            pthread_mutex_unlock(&async_lock);
+            return result;
+        }
+
+        /* Note some bytes inserted, for the syncer, and wait for them to be
+         * on disk if need be
+         *
+         * @returns 0 on success, else -1 if syncing them failed */
+        int commit(size_t bytes) {
+            return durable ? durable->commit(bytes) : 0;
+        }
+
+        /* Whether new buffers, and the slabs and segments that buffers are
+         * dumped to, must be synced before the buffers are removed */
+        bool durable_dumps() const {
+            return opts.sync_mode != durability_none;
+        }
+
+        /* Sync every shard's buffers */
+        static int sync(void* self) {
+            db* d = static_cast<db*>(self);
+            int result = 0;
+            for (uint32_t i = 0; i < d->shards.size(); ++i) {
+                if (d->shards[i]->sync() != 0) {
+                    result = -1;
+                }
+            }
+            return result;
+        }
+
+        /* A shard's leftover buffers, on their way to being dumped */
+        typedef struct pending_recovery_ {
+            db*                self;
+            shard<value_type>* owner;
+            size_t             count;
+
+            static void work(void* p) {
+                pending_recovery_* r = static_cast<pending_recovery_*>(p);
+                for (size_t i = 0; i < r->count; ++i) {
+                    shard<value_type>::flush(r->owner);
+                }
+                r->self->recovered(r->count);
+                delete r;
+            }
+        } pending_recovery;
+
+        /* Wait for every leftover buffer to be dumped, and then get rid of
+         * the recovery threads */
+        void reap() {
+            pthread_mutex_lock(&reap_lock);
+            if (recovery) {
+                recovery->drain();
+                delete recovery;
+                recovery = NULL;
+            }
+            pthread_mutex_unlock(&reap_lock);
+        }
+
+        /* Note that some recovered buffers have been dumped, and how long
+         * recovery has taken once they all have */
+        void recovered(size_t count) {
+            pthread_mutex_lock(&recovery_lock);
+            counters.recovering -= count;
+            if (counters.recovering == 0) {
+                struct timeval now;
+                gettimeofday(&now, NULL);
+                counters.recovery_seconds = (now.tv_sec - opened.tv_sec) +
+                    (now.tv_usec - opened.tv_usec) / 1e6;
+            }
+            pthread_mutex_unlock(&recovery_lock);
+        }
+
+        /* An asynchronous insert on its way */
+        typedef struct pending_insert_ {
+            db*            self;
+            key_type       name;
+            timestamp_type time;
+            value_type     value;
+            insert_cb_type cb;
+            void*          data;
+
+            static void work(void* p) {
+                pending_insert_* i = static_cast<pending_insert_*>(p);
+                i->self->insert(i->name, i->time, i->value);
+            }
+
+            static void done(void* p) {
+                pending_insert_* i = static_cast<pending_insert_*>(p);
+                i->cb(i->data);
+                delete i;
+            }
+        } pending_insert;
+
+        /* An asynchronous get on its way */
+        typedef struct pending_get_ {
+            db*            self;
+            key_type       name;
+            timestamp_type start;
+            timestamp_type end;
+            values_type    results;
+            get_cb_type    cb;
+            void*          data;
+
+            static void work(void* p) {
+                pending_get_* g = static_cast<pending_get_*>(p);
+                g->results = g->self->get(g->name, g->start, g->end);
+            }
+
+            static void done(void* p) {
+                pending_get_* g = static_cast<pending_get_*>(p);
+                g->cb(g->results, g->data);
+                delete g;
+            }
+        } pending_get;
+
+        /* Rename every metric's slabs from when they were named for their
+         * latest data point, and leave a `bounds` file behind once they all
+         * have been, so that it's only done once */
+        void renumber() {
+            std::string marker(path + "bounds");
+            if (boost::filesystem::exists(marker)) {
+                return;
+            }
+
+            std::string from;
+            catalog::names_type names(known->page(from, 1024));
+            while (!names.empty()) {
+                catalog::names_type::iterator it(names.begin());
+                for (; it != names.end(); ++it) {
+                    slab<D> s(path, *it, true);
+                    if (s.renumber() && durable_dumps()) {
+                        io::sync(s.directory());
+                    }
+                }
+                from = names.back();
+                names = known->page(from, 1024);
+            }
+
+            int fd = ::open(marker.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd < 0) {
+                perror("Failed to mark slabs renamed");
+            } else {
+                ::close(fd);
+            }
+        }
+
+        /* Recover any leftover buffers, and then open up our shards */
+        void open() {
+            /* If the provided path doesn't end with a slash, it should */
+            if (path.length() && path[path.length() - 1] != '/') {
+                path = path + "/";
+            }
+
+            gettimeofday(&opened, NULL);
+            pthread_mutex_init(&recovery_lock, NULL);
+            pthread_mutex_init(&async_lock, NULL);
+            pthread_mutex_init(&reap_lock, NULL);
+            counters.recovered        = 0;
+            counters.recovering       = 0;
+            counters.recovery_seconds = 0;
+            counters.recent_bytes     = 0;
+            counters.recent_budget    = 0;
+            counters.recent_hits      = 0;
+            counters.recent_misses    = 0;
+            counters.subscription_drops = 0;
+            counters.alarm_drops        = 0;
+            counters.alarm_rule_sets    = 0;
+            counters.syncs              = 0;
+            counters.io_uring           = false;
+
+            /* We should also make sure that the directory exists */
+
+            known = new catalog(path);
+            renumber();
+            watchers = new subscriptions<D>(opts.subscription_pending);
+            known->notify(subscriptions<D>::created, watchers);
+            stale = new staleness<D>();
+            alerts = new alarms<D>(opts.alarm_pending);
+
+            /* Slabs tell our rollups whenever they rotate, if we have any */
+            typename slab<D>::rotate_cb_type on_rotate = NULL;
+            if (!opts.policies.empty()) {
+                rolled = new rollups<D>(path, opts.policies,
+                    opts.compress_slabs);
+                if (opts.aggregate && !opts.aggregate_of<D>()) {
+                    std::cout << "Ignoring an aggregate set for another "
+                        << "data type" << std::endl;
+                }
+                rolled->aggregate_with(opts.aggregate_of<D>());
+                on_rotate = rollups<D>::rotated;
+            }
+
+            /* Any buffers left behind go back to the shards that made them.
+             * Those from before the number of shards changed, or from before
+             * buffers were named for their shards, can't, and are rotated
+             * out one at a time right away */
+            std::vector<std::vector<std::string> > owned(num_files);
+            std::vector<std::string> leftovers(buffer<D>::leftovers(path));
+            std::vector<std::string>::iterator it(leftovers.begin());
+            for (; it != leftovers.end(); ++it) {
+                uint32_t index, count;
+                if (buffer<D>::owner(*it, index, count) &&
+                    count == num_files) {
+                    owned[index].push_back(*it);
+                } else if (opts.segments) {
+                    if (store == NULL) {
+                        store = new segments<D>(path, opts.segment_fanout,
+                            known, durable_dumps(), opts.policies);
+                    }
+                    buffer<D>(*it, path).dump(*store);
+                } else {
+                    slab_cache<D> cache(path, 1, opts.compress_slabs,
+                        on_rotate, rolled, known, durable_dumps(),
+                        opts.io_uring);
+                    buffer<D>(*it, path).dump(cache);
+                }
+            }
+            /* Segments are read even when dumps no longer go to them */
+            if (store == NULL && (opts.segments ||
+                boost::filesystem::is_directory(path + "/segments"))) {
+                store = new segments<D>(path, opts.segment_fanout, known,
+                    durable_dumps(), opts.policies);
+            }
+
+            expiry = new pruner<D>(path, opts.policies, opts.prune_interval,
+                opts.prune_rate, known, store);
+            flushers = new pool(opts.flush_threads, opts.max_pending);
+            if (opts.recent_points) {
+                hot = new memtable(opts.recent_points, opts.recent_seconds,
+                    opts.recent_budget);
+            }
+            for (uint32_t i = 0; i < num_files; ++i) {
+                shards.push_back(new shard<value_type>(path, i, num_files,
+                    flushers, opts.slab_cache_size, opts.compress_slabs,
+                    on_rotate, rolled, known, store, hot, watchers, stale,
+                    alerts, durable_dumps(), opts.io_uring, opts.segments));
+            }
+
+            /* The rest are dumped a shard at a time on the recovery threads,
+             * and until they are, gets read from them as sealed buffers.
+             * There's no use in more threads than shards with leftovers or
+             * processors, and they exit as soon as they run out of shards */
+            uint32_t busy = 0;
+            for (uint32_t i = 0; i < num_files; ++i) {
+                counters.recovered  += owned[i].size();
+                counters.recovering += owned[i].size();
+                for (size_t j = 0; j < owned[i].size(); ++j) {
+                    shards[i]->recover(owned[i][j]);
+                }
+                busy += owned[i].empty() ? 0 : 1;
+            }
+            if (busy) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                uint32_t threads = std::min(opts.recovery_threads, busy);
+                if (cpus > 0 && threads > static_cast<uint32_t>(cpus)) {
+                    threads = cpus;
+                }
+                recovery = new pool(threads, num_files);
+            }
+            for (uint32_t i = 0; i < num_files; ++i) {
+                if (!owned[i].empty()) {
+                    pending_recovery* r = new pending_recovery();
+                    r->self  = this;
+                    r->owner = shards[i];
+                    r->count = owned[i].size();
+                    recovery->submit(pending_recovery::work, r);
+                }
+            }
+            if (counters.recovered == 0) {
+                recovered(0);
+            } else if (!opts.background_recovery) {
+                reap();
+            } else {
+                recovery->finish();
+            }
+            if (opts.sync_mode != durability_none) {
+                durable = new syncer(opts.sync_mode, opts.sync_interval,
+                    opts.sync_bytes, sync, this);
+            }
+        }
     };
 }
 
@@ -0,0 +1,315 @@
+#ifndef MADB__GORILLA_H
+#define MADB__GORILLA_H
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+/* Internal imports */
+#include "traits.h"
+
+namespace madb {
+    /* Writes a stream of bits, most significant first */
+    class bit_writer {
+    public:
+        bit_writer(std::vector<char>& out): out(out), acc(0), used(0) {}
+
+        /* Write the low `bits` bits of a value, at most 32 of them */
+        void write(uint32_t value, uint32_t bits) {
+            acc   = (acc << bits) | (value & mask(bits));
+            used += bits;
+            while (used >= 8) {
+                used -= 8;
+                out.push_back(static_cast<char>(acc >> used));
+            }
+            acc &= mask(used);
+        }
+
+        /* Pad out the last byte with zeros */
+        void finish() {
+            if (used) {
+                out.push_back(static_cast<char>(acc << (8 - used)));
+                used = 0;
+                acc  = 0;
+            }
+        }
+
+        /* A mask of the low `bits` bits */
+        static uint64_t mask(uint32_t bits) {
+            return (static_cast<uint64_t>(1) << bits) - 1;
+        }
+    private:
+        std::vector<char>& out;   /* Where the bytes go */
+        uint64_t           acc;   /* Bits not yet written out */
+        uint32_t           used;  /* How many bits are in acc */
+    };
+
+    /* Reads a stream of bits written by a bit_writer */
+    class bit_reader {
+    public:
+        bit_reader(const char* ptr, const char* end):
+            ptr(reinterpret_cast<const uint8_t*>(ptr)),
+            end(reinterpret_cast<const uint8_t*>(end)), acc(0), avail(0) {}
+
+        /* Read `bits` bits, at most 32 of them
+         *
+         * @returns false if we ran out of bits */
+        bool read(uint32_t bits, uint32_t& value) {
+            while (avail < bits) {
+                if (ptr == end) {
+                    return false;
+                }
+                acc = (acc << 8) | *ptr++;
+                avail += 8;
+            }
+            avail -= bits;
+            value = static_cast<uint32_t>(acc >> avail) &
+                static_cast<uint32_t>(bit_writer::mask(bits));
+            acc &= bit_writer::mask(avail);
+            return true;
+        }
+    private:
+        const uint8_t* ptr;    /* Next byte to read */
+        const uint8_t* end;    /* One past the last byte */
+        uint64_t       acc;    /* Bits read but not yet returned */
+        uint32_t       avail;  /* How many bits are in acc */
+    };
+
+    /* Compressed blocks of sorted data points, after Facebook's Gorilla.
+     *
+     * Timestamps are stored as the difference between consecutive deltas,
+     * which is almost always zero for regularly-sampled series. Values are
+     * treated as a sequence of 32-bit words (so floats and integers alike),
+     * and each word is XORed with the same word of the previous point, which
+     * for slowly-changing series is zero or has only a few meaningful bits.
+     *
+     * Every block begins with a header with its number of points, its first
+     * and last timestamps, and how many bytes of bits follow, so that readers
+     * can skip blocks outside of a range without decoding them */
+    template <typename D>
+    class gorilla {
+    public:
+        /* Identifies a compressed block */
+        static const uint32_t magic = 0x67726c61;
+
+        /* How many data points go in each block */
+        static const size_t block_size = 1024;
+
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+
+        /* Precedes every block */
+        typedef struct header_ {
+            uint32_t magic;
+            uint32_t count;
+            uint32_t min_time;
+            uint32_t max_time;
+            uint32_t bytes;
+        } header;
+
+        /* How many 32-bit words each value is made of */
+        static const size_t words = (sizeof(value_type) + 3) / 4;
+
+        /* Encode sorted data points as a series of blocks
+         *
+         * @param first -- the first data point
+         * @param count -- how many data points there are
+         * @param out -- where to append the blocks */
+        static void encode(const data_type* first, size_t count,
+            std::vector<char>& out) {
+            for (size_t i = 0; i < count; i += block_size) {
+                size_t n = (count - i < block_size) ? count - i : block_size;
+                encode_block(first + i, n, out);
+            }
+        }
+
+        /* Decode one block
+         *
+         * @param h -- the block's header
+         * @param payload -- the h.bytes bytes that follow the header
+         * @param results -- where to append the data points
+         * @returns false if the block was malformed */
+        static bool decode(const header& h, const char* payload,
+            values_type& results) {
+            if (h.magic != magic || h.count == 0) {
+                return false;
+            }
+
+            bit_reader in(payload, payload + h.bytes);
+            uint32_t   prev[words];
+            uint32_t   lead[words];
+            uint32_t   trail[words];
+            data_type  datum;
+            memset(&datum, 0, sizeof(data_type));
+
+            /* The first point is stored as-is */
+            datum.time = h.min_time;
+            for (size_t w = 0; w < words; ++w) {
+                if (!in.read(32, prev[w])) {
+                    return false;
+                }
+                lead[w] = trail[w] = 0;
+            }
+            memcpy(&datum.value, prev, sizeof(value_type));
+            results.push_back(datum);
+
+            int64_t delta = 0;
+            for (uint32_t i = 1; i < h.count; ++i) {
+                /* Figure out which bucket the delta of delta is in */
+                uint32_t bit = 0, ones = 0;
+                while (ones < 4) {
+                    if (!in.read(1, bit)) {
+                        return false;
+                    }
+                    if (!bit) {
+                        break;
+                    }
+                    ++ones;
+                }
+
+                uint32_t raw = 0;
+                switch (ones) {
+                    case 0: break;
+                    case 1: if (!in.read(7, raw)) return false;
+                            delta += static_cast<int64_t>(raw) - 63;
+                            break;
+                    case 2: if (!in.read(9, raw)) return false;
+                            delta += static_cast<int64_t>(raw) - 255;
+                            break;
+                    case 3: if (!in.read(12, raw)) return false;
+                            delta += static_cast<int64_t>(raw) - 2047;
+                            break;
+                    default: if (!in.read(32, raw)) return false;
+                            delta = raw;
+                }
+                datum.time = static_cast<timestamp_type>(datum.time + delta);
+
+                for (size_t w = 0; w < words; ++w) {
+                    uint32_t changed = 0, window = 0, value = 0;
+                    if (!in.read(1, changed)) {
+                        return false;
+                    }
+                    if (!changed) {
+                        continue;
+                    }
+
+                    /* Either a new window of meaningful bits, or the same
+                     * one as last time */
+                    if (!in.read(1, window)) {
+                        return false;
+                    }
+                    if (window) {
+                        uint32_t len = 0;
+                        if (!in.read(5, lead[w]) || !in.read(6, len) ||
+                            len == 0 || lead[w] + len > 32) {
+                            return false;
+                        }
+                        trail[w] = 32 - lead[w] - len;
+                    }
+                    if (!in.read(32 - lead[w] - trail[w], value)) {
+                        return false;
+                    }
+                    prev[w] ^= value << trail[w];
+                }
+                memcpy(&datum.value, prev, sizeof(value_type));
+                results.push_back(datum);
+            }
+            return true;
+        }
+    private:
+        /* Encode a single block of at most block_size points */
+        static void encode_block(const data_type* first, size_t count,
+            std::vector<char>& out) {
+            header h;
+            h.magic    = magic;
+            h.count    = count;
+            h.min_time = first[0].time;
+            h.max_time = first[count - 1].time;
+            h.bytes    = 0;
+
+            size_t start = out.size();
+            out.resize(start + sizeof(header));
+
+            bit_writer bits(out);
+            uint32_t   prev[words];
+            uint32_t   lead[words];
+            uint32_t   trail[words];
+            uint32_t   current[words];
+
+            /* The first point's value is stored as-is */
+            load(first[0].value, prev);
+            for (size_t w = 0; w < words; ++w) {
+                bits.write(prev[w], 32);
+                lead[w] = trail[w] = 32;
+            }
+
+            int64_t delta = 0;
+            for (size_t i = 1; i < count; ++i) {
+                int64_t d = static_cast<int64_t>(first[i].time) -
+                    static_cast<int64_t>(first[i - 1].time);
+                int64_t dod = d - delta;
+                delta = d;
+
+                if (dod == 0) {
+                    bits.write(0, 1);
+                } else if (dod >= -63 && dod <= 64) {
+                    bits.write(2, 2);
+                    bits.write(static_cast<uint32_t>(dod + 63), 7);
+                } else if (dod >= -255 && dod <= 256) {
+                    bits.write(6, 3);
+                    bits.write(static_cast<uint32_t>(dod + 255), 9);
+                } else if (dod >= -2047 && dod <= 2048) {
+                    bits.write(14, 4);
+                    bits.write(static_cast<uint32_t>(dod + 2047), 12);
+                } else {
+                    bits.write(15, 4);
+                    bits.write(static_cast<uint32_t>(d), 32);
+                }
+
+                load(first[i].value, current);
+                for (size_t w = 0; w < words; ++w) {
+                    uint32_t x = current[w] ^ prev[w];
+                    prev[w] = current[w];
+                    if (x == 0) {
+                        bits.write(0, 1);
+                        continue;
+                    }
+
+                    uint32_t l = __builtin_clz(x);
+                    uint32_t t = __builtin_ctz(x);
+                    if (lead[w] + trail[w] < 32 && l >= lead[w] &&
+                        t >= trail[w]) {
+                        /* Fits in the same window as last time */
+                        bits.write(2, 2);
+                        bits.write(x >> trail[w], 32 - lead[w] - trail[w]);
+                    } else {
+                        bits.write(3, 2);
+                        bits.write(l, 5);
+                        bits.write(32 - l - t, 6);
+                        bits.write(x >> t, 32 - l - t);
+                        lead[w]  = l;
+                        trail[w] = t;
+                    }
+                }
+            }
+            bits.finish();
+
+            h.bytes = out.size() - start - sizeof(header);
+            memcpy(&out[start], &h, sizeof(header));
+        }
+
+        /* Copy a value out into 32-bit words, padding with zeros */
+        static void load(const value_type& value, uint32_t* out) {
+            memset(out, 0, words * sizeof(uint32_t));
+            memcpy(out, &value, sizeof(value_type));
+        }
+    };
+}
+
+#endif
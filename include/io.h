@@ -0,0 +1,428 @@
+#ifndef MADB__IO_H
+#define MADB__IO_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+/* C includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MADB_HAVE_IO_URING 1
+#endif
+#endif
+
+namespace madb {
+    /* Backends for running many independent reads and writes at once.
+     *
+     * Dumps queue up an append for every slab they touch and run them all
+     * together, and cursors read the first chunk of every slab they span
+     * together. The portable backend just issues each one with pread(2) or
+     * pwrite(2). The io_uring backend hands them to the kernel in batches,
+     * with one system call per batch, so that a single thread can keep a
+     * fast disk's queue deep.
+     *
+     * Every thread gets a backend of its own, since an io_uring is not meant
+     * to be shared. Which kind is up to whoever asks for it */
+    namespace io {
+        /* A single read or write */
+        typedef struct op_ {
+            int     fd;      /* File to read or write */
+            char*   buf;     /* Where to read into or write from */
+            size_t  len;     /* How many bytes */
+            off_t   offset;  /* Where in the file */
+            bool    write;   /* Whether it's a write */
+            ssize_t result;  /* Bytes transferred, or -errno */
+        } op;
+
+        /* Make a read
+         *
+         * @param fd -- the file to read
+         * @param buf -- where to read into
+         * @param len -- how many bytes to read
+         * @param offset -- where in the file to read from */
+        inline op read(int fd, void* buf, size_t len, off_t offset) {
+            op o = {fd, static_cast<char*>(buf), len, offset, false, 0};
+            return o;
+        }
+
+        /* Make a write
+         *
+         * @param fd -- the file to write
+         * @param buf -- what to write
+         * @param len -- how many bytes to write
+         * @param offset -- where in the file to write to */
+        inline op write(int fd, const void* buf, size_t len, off_t offset) {
+            op o = {fd, static_cast<char*>(const_cast<void*>(buf)), len,
+                offset, true, 0};
+            return o;
+        }
+
+        /* Sync a file or directory out to disk by its path. Syncing a
+         * directory makes the files made, renamed or removed in it durable
+         *
+         * @param path -- the file or directory
+         * @returns 0 on success, else -1 */
+        inline int sync(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0 || fsync(fd) != 0) {
+                perror(("Failed to sync " + path).c_str());
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                return -1;
+            }
+            ::close(fd);
+            return 0;
+        }
+
+        /* Runs batches of operations */
+        class backend {
+        public:
+            virtual ~backend() {}
+
+            /* Run every operation, returning once they've all completed. A
+             * write that comes up short is finished before returning
+             *
+             * @param ops -- the operations, whose results are filled in
+             * @param count -- how many operations there are */
+            virtual void run(op* ops, size_t count) = 0;
+
+            /* Run a vector of operations */
+            void run(std::vector<op>& ops) {
+                if (!ops.empty()) {
+                    run(&ops[0], ops.size());
+                }
+            }
+
+            /* Which kind of backend this is */
+            virtual bool uses_uring() const = 0;
+        protected:
+            /* Write out whatever part of a write didn't make it */
+            static void finish(op& o) {
+                size_t done = (o.result > 0) ? o.result : 0;
+                while (o.write && o.result >= 0 && done < o.len) {
+                    ssize_t count = pwrite(o.fd, o.buf + done, o.len - done,
+                        o.offset + done);
+                    if (count <= 0) {
+                        o.result = (count < 0) ? -errno : o.result;
+                        break;
+                    }
+                    done += count;
+                    o.result = done;
+                }
+            }
+        };
+
+        /* Issues each operation with its own system call */
+        class portable: public backend {
+        public:
+            void run(op* ops, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    op& o(ops[i]);
+                    o.result = o.write ?
+                        pwrite(o.fd, o.buf, o.len, o.offset) :
+                        pread(o.fd, o.buf, o.len, o.offset);
+                    if (o.result < 0) {
+                        o.result = -errno;
+                    }
+                    finish(o);
+                }
+            }
+
+            bool uses_uring() const {
+                return false;
+            }
+        };
+
+#ifdef MADB_HAVE_IO_URING
+        /* Submits operations through an io_uring, up to a ring's worth per
+         * system call. This talks to the kernel directly, so it needs no
+         * library, just a kernel from 5.6 on */
+        class uring: public backend {
+        public:
+            /* How many operations may be in flight at once */
+            static const uint32_t depth = 256;
+
+            uring(): ring(-1), sq_map(NULL), cq_map(NULL), sqes(NULL),
+                sq_size(0), cq_size(0), sqes_size(0) {
+                struct io_uring_params p;
+                memset(&p, 0, sizeof(p));
+                ring = syscall(__NR_io_uring_setup, depth, &p);
+                if (ring < 0) {
+                    return;
+                }
+
+                sq_size   = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+                cq_size   = p.cq_off.cqes +
+                    p.cq_entries * sizeof(struct io_uring_cqe);
+                sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+                if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                    sq_size = cq_size = std::max(sq_size, cq_size);
+                }
+
+                sq_map = map(sq_size, IORING_OFF_SQ_RING);
+                cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_map :
+                    map(cq_size, IORING_OFF_CQ_RING);
+                void* s = map(sqes_size, IORING_OFF_SQES);
+                if (sq_map == NULL || cq_map == NULL || s == NULL) {
+                    close();
+                    return;
+                }
+                sqes = static_cast<struct io_uring_sqe*>(s);
+
+                char* sq = static_cast<char*>(sq_map);
+                sq_tail  = reinterpret_cast<uint32_t*>(sq + p.sq_off.tail);
+                sq_mask  = *reinterpret_cast<uint32_t*>(
+                    sq + p.sq_off.ring_mask);
+                sq_array = reinterpret_cast<uint32_t*>(sq + p.sq_off.array);
+                entries  = p.sq_entries;
+
+                char* cq = static_cast<char*>(cq_map);
+                cq_head  = reinterpret_cast<uint32_t*>(cq + p.cq_off.head);
+                cq_tail  = reinterpret_cast<uint32_t*>(cq + p.cq_off.tail);
+                cq_mask  = *reinterpret_cast<uint32_t*>(
+                    cq + p.cq_off.ring_mask);
+                cqes     = reinterpret_cast<struct io_uring_cqe*>(
+                    cq + p.cq_off.cqes);
+            }
+
+            ~uring() {
+                close();
+            }
+
+            /* Whether the ring was set up, which it may not be on older
+             * kernels, or where it's been disabled */
+            bool ok() const {
+                return sqes != NULL;
+            }
+
+            void run(op* ops, size_t count) {
+                if (!ok()) {
+                    portable().run(ops, count);
+                    return;
+                }
+                while (count) {
+                    uint32_t batch = (count < entries) ? count : entries;
+                    submit(ops, batch);
+                    for (uint32_t i = 0; i < batch; ++i) {
+                        finish(ops[i]);
+                    }
+                    ops   += batch;
+                    count -= batch;
+                }
+            }
+
+            bool uses_uring() const {
+                return true;
+            }
+        private:
+            /* Private, unimplemented to prevent use */
+            uring(const uring& other);
+            const uring& operator=(const uring& other);
+
+            /* Members */
+            int                    ring;       /* The io_uring itself */
+            void*                  sq_map;     /* Submission ring */
+            void*                  cq_map;     /* Completion ring */
+            struct io_uring_sqe*   sqes;       /* Submission entries */
+            size_t                 sq_size;    /* Bytes mapped for each */
+            size_t                 cq_size;
+            size_t                 sqes_size;
+            uint32_t*              sq_tail;
+            uint32_t               sq_mask;
+            uint32_t*              sq_array;
+            uint32_t               entries;    /* Size of the submission ring */
+            uint32_t*              cq_head;
+            uint32_t*              cq_tail;
+            uint32_t               cq_mask;
+            struct io_uring_cqe*   cqes;       /* Completion entries */
+
+            /* Map in part of the ring */
+            void* map(size_t size, off_t offset) {
+                void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, offset);
+                return (ptr == MAP_FAILED) ? NULL : ptr;
+            }
+
+            void close() {
+                if (sqes) {
+                    munmap(sqes, sqes_size);
+                    sqes = NULL;
+                }
+                if (cq_map && cq_map != sq_map) {
+                    munmap(cq_map, cq_size);
+                }
+                if (sq_map) {
+                    munmap(sq_map, sq_size);
+                }
+                sq_map = cq_map = NULL;
+                if (ring >= 0) {
+                    ::close(ring);
+                    ring = -1;
+                }
+            }
+
+            /* Submit a batch no bigger than the ring, and wait for all of it */
+            void submit(op* ops, uint32_t count) {
+                uint32_t tail = *sq_tail;
+                for (uint32_t i = 0; i < count; ++i) {
+                    uint32_t index = (tail + i) & sq_mask;
+                    struct io_uring_sqe* sqe = &sqes[index];
+                    memset(sqe, 0, sizeof(*sqe));
+                    sqe->opcode    = ops[i].write ? IORING_OP_WRITE :
+                        IORING_OP_READ;
+                    sqe->fd        = ops[i].fd;
+                    sqe->addr      = reinterpret_cast<uint64_t>(ops[i].buf);
+                    sqe->len       = ops[i].len;
+                    sqe->off       = ops[i].offset;
+                    sqe->user_data = i;
+                    sq_array[index] = index;
+                }
+                __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+
+                std::vector<bool> done(count, false);
+                uint32_t submitted = 0, completed = 0;
+                while (completed < count) {
+                    int result = syscall(__NR_io_uring_enter, ring,
+                        count - submitted, count - completed,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+                    if (result < 0 && errno != EINTR && errno != EAGAIN &&
+                        errno != EBUSY) {
+                        /* The ring's broken. What the kernel took may still
+                         * be writing into the callers' buffers, so wait for
+                         * all of it to complete before tearing the ring down,
+                         * and do only what it never took ourselves */
+                        completed += drain(ops, done, submitted - completed);
+                        close();
+                        for (uint32_t i = 0; i < count; ++i) {
+                            if (!done[i]) {
+                                portable().run(&ops[i], 1);
+                            }
+                        }
+                        return;
+                    } else if (result > 0) {
+                        submitted += result;
+                    }
+                    completed += reap(ops, done);
+                }
+            }
+
+            /* Wait for some operations already submitted to complete, when
+             * nothing more can be submitted. Completions are posted to the
+             * ring whether or not we're waiting in the kernel, so if even
+             * waiting fails, they're polled for instead
+             *
+             * @param pending -- how many are still in flight
+             * @returns how many operations completed */
+            uint32_t drain(op* ops, std::vector<bool>& done,
+                uint32_t pending) {
+                uint32_t completed = 0;
+                while (completed < pending) {
+                    int result = syscall(__NR_io_uring_enter, ring, 0,
+                        pending - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+                    uint32_t reaped = reap(ops, done);
+                    if (result < 0 && errno != EINTR && reaped == 0) {
+                        usleep(1000);
+                    }
+                    completed += reaped;
+                }
+                return completed;
+            }
+
+            /* Collect whatever's completed
+             *
+             * @returns how many operations completed */
+            uint32_t reap(op* ops, std::vector<bool>& done) {
+                uint32_t head = *cq_head;
+                uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                uint32_t count = 0;
+                for (; head != tail; ++head, ++count) {
+                    const struct io_uring_cqe& cqe(cqes[head & cq_mask]);
+                    ops[cqe.user_data].result = cqe.res;
+                    done[cqe.user_data] = true;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                return count;
+            }
+        };
+#endif
+
+        /* Make a backend, falling back on the portable one if need be
+         *
+         * @param batched -- whether to use io_uring where it's available */
+        inline backend* make(bool batched) {
+#ifdef MADB_HAVE_IO_URING
+            if (batched) {
+                io::uring* u = new io::uring();
+                if (u->ok()) {
+                    return u;
+                }
+                delete u;
+            }
+#else
+            (void)batched;
+#endif
+            return new portable();
+        }
+
+        /* A thread's backends, one of each kind, made as they're needed */
+        typedef struct holder_ {
+            backend* portable;
+            backend* uring;
+        } holder;
+
+        /* Frees a thread's backends when it exits */
+        inline void release(void* h) {
+            delete static_cast<holder*>(h)->portable;
+            delete static_cast<holder*>(h)->uring;
+            delete static_cast<holder*>(h);
+        }
+
+        /* The key that each thread's backends are kept under */
+        inline pthread_key_t key() {
+            static pthread_once_t once = PTHREAD_ONCE_INIT;
+            static pthread_key_t  k;
+            struct init {
+                static void run() {
+                    pthread_key_create(&k, release);
+                }
+            };
+            pthread_once(&once, init::run);
+            return k;
+        }
+
+        /* Get this thread's backend of some kind, making it if need be. Each
+         * database asks for the kind its options call for, so databases in
+         * the same process needn't agree
+         *
+         * @param uring -- whether to use io_uring where it's available */
+        inline backend& local(bool uring=false) {
+            holder* h = static_cast<holder*>(pthread_getspecific(key()));
+            if (h == NULL) {
+                h = new holder();
+                h->portable = NULL;
+                h->uring    = NULL;
+                pthread_setspecific(key(), h);
+            }
+            backend*& b(uring ? h->uring : h->portable);
+            if (b == NULL) {
+                b = make(uring);
+            }
+            return *b;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef MADB__NOTIFY_H
+#define MADB__NOTIFY_H
+
+#include <stdint.h>
+
+/* C includes */
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+namespace madb {
+    /* What subscriptions, stale metric watches and alarms have in common:
+     * a set of callbacks that inserts check with a single atomic load while
+     * it's empty, a generation that shards remember what they've matched
+     * against, and a background thread that hands things out to the
+     * callbacks, started the first time there are any.
+     *
+     * The thread wakes up whenever pending() says there's something queued,
+     * or every `period` milliseconds if there's a period. It then calls
+     * take() with our lock held, to take what's queued, and hand_out()
+     * without it, to invoke the callbacks. `delivering` is held throughout,
+     * so that callbacks can be removed knowing they won't be invoked again */
+    class notifier {
+    public:
+        /* Destructor. Subclasses must stop() in theirs, before the thread
+         * can see them half torn down */
+        virtual ~notifier() {
+            pthread_cond_destroy(&ready);
+            pthread_mutex_destroy(&delivering);
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Whether there are any callbacks at all. This is the only thing
+         * inserts check when there aren't */
+        bool any() const {
+            return __atomic_load_n(&active, __ATOMIC_RELAXED) != 0;
+        }
+
+        /* Changes whenever the callbacks do, so that what a metric matched
+         * can be remembered until then */
+        uint32_t generation() const {
+            return __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+        }
+
+        /* How many things were dropped, for lack of room to queue them */
+        uint64_t drops() {
+            pthread_mutex_lock(&lock);
+            uint64_t count = dropped;
+            pthread_mutex_unlock(&lock);
+            return count;
+        }
+
+        /* Wait until everything that's been queued has been handed out */
+        void drain() {
+            pthread_mutex_lock(&lock);
+            while (started && pending()) {
+                pthread_mutex_unlock(&lock);
+                pthread_mutex_lock(&delivering);
+                pthread_mutex_unlock(&delivering);
+                pthread_mutex_lock(&lock);
+            }
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_lock(&delivering);
+            pthread_mutex_unlock(&delivering);
+        }
+
+        /* Stop handing anything out, and drop whatever else is queued */
+        void stop() {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_signal(&ready);
+            bool join = started;
+            started = false;
+            pthread_mutex_unlock(&lock);
+            if (join) {
+                pthread_join(thread, NULL);
+            }
+        }
+    protected:
+        /* Constructor
+         *
+         * @param period -- milliseconds between waking up regardless, or 0
+         *      to only wake up when something's queued */
+        notifier(uint32_t period=0): period(period), active(0), version(1),
+            stopping(false), started(false), dropped(0) {
+            pthread_mutex_init(&lock, NULL);
+            pthread_mutex_init(&delivering, NULL);
+            pthread_cond_init(&ready, NULL);
+        }
+
+        /* Note that the callbacks changed, with our lock held, and start our
+         * thread if it hasn't been
+         *
+         * @param count -- how many callbacks inserts need to check now */
+        void changed(size_t count) {
+            __atomic_store_n(&active, static_cast<uint32_t>(count),
+                __ATOMIC_RELAXED);
+            __atomic_store_n(&version, version + 1, __ATOMIC_RELEASE);
+            if (!started && !stopping) {
+                started = (pthread_create(&thread, NULL, work, this) == 0);
+            }
+        }
+
+        /* Whether anything is queued, with our lock held */
+        virtual bool pending() const = 0;
+
+        /* Take what's queued, with our lock held */
+        virtual void take() = 0;
+
+        /* Invoke the callbacks for what was taken, without our lock */
+        virtual void hand_out() = 0;
+
+        /* Members */
+        uint32_t        period;      /* Milliseconds between wake ups */
+        uint32_t        active;      /* How many callbacks inserts check */
+        uint32_t        version;     /* Bumped when callbacks change */
+        bool            stopping;    /* Whether we're shutting down */
+        bool            started;     /* Whether our thread is running */
+        uint64_t        dropped;     /* What there wasn't room for */
+        pthread_t       thread;      /* Hands things out */
+        pthread_mutex_t lock;        /* Guards all of the above */
+        pthread_mutex_t delivering;  /* Held while invoking callbacks */
+        pthread_cond_t  ready;       /* Signaled when things are queued */
+    private:
+        /* Private, unimplemented to prevent use */
+        notifier(const notifier& other);
+        const notifier& operator=(const notifier& other);
+
+        /* When our next period is up */
+        struct timespec deadline() const {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            uint64_t usec = tv.tv_usec + static_cast<uint64_t>(period) * 1000;
+            struct timespec until;
+            until.tv_sec  = tv.tv_sec + usec / 1000000;
+            until.tv_nsec = (usec % 1000000) * 1000;
+            return until;
+        }
+
+        /* The body of our background thread */
+        static void* work(void* self) {
+            notifier* n = static_cast<notifier*>(self);
+            struct timespec until = n->deadline();
+            while (true) {
+                pthread_mutex_lock(&n->delivering);
+                pthread_mutex_lock(&n->lock);
+                int result = 0;
+                while (!n->pending() && !n->stopping && result != ETIMEDOUT) {
+                    pthread_mutex_unlock(&n->delivering);
+                    if (n->period) {
+                        result = pthread_cond_timedwait(&n->ready, &n->lock,
+                            &until);
+                    } else {
+                        pthread_cond_wait(&n->ready, &n->lock);
+                    }
+                    pthread_mutex_unlock(&n->lock);
+                    pthread_mutex_lock(&n->delivering);
+                    pthread_mutex_lock(&n->lock);
+                }
+                if (n->stopping) {
+                    pthread_mutex_unlock(&n->lock);
+                    pthread_mutex_unlock(&n->delivering);
+                    return NULL;
+                }
+                if (result == ETIMEDOUT) {
+                    until = n->deadline();
+                }
+
+                n->take();
+                pthread_mutex_unlock(&n->lock);
+                n->hand_out();
+                pthread_mutex_unlock(&n->delivering);
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef MADB__OPTIONS_H
+#define MADB__OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <typeinfo>
+#include <stdint.h>
+
+/* C includes */
+#include <unistd.h>
+
+/* Internal imports */
+#include "traits.h"
+
+namespace madb {
+    /* A coarser copy of a metric's data, with one aggregated data point for
+     * every `resolution` seconds */
+    struct tier {
+        uint32_t resolution;  /* Seconds covered by each data point */
+        uint32_t retention;   /* Seconds to keep them for, or 0 for ever */
+
+        tier(uint32_t resolution, uint32_t retention=0):
+            resolution(resolution), retention(retention) {}
+    };
+
+    /* The tiers that metrics whose names begin with `prefix` are rolled up
+     * into. A metric follows the policy with the longest matching prefix, so
+     * a policy with an empty prefix applies to everything else */
+    struct policy {
+        std::string       prefix;     /* Which metrics this applies to */
+        uint32_t          retention;  /* Seconds to keep the raw data points
+                                       * for, or 0 for ever */
+        std::vector<tier> tiers;      /* What they're rolled up into */
+
+        policy(const std::string& prefix, uint32_t retention=0):
+            prefix(prefix), retention(retention), tiers() {}
+    };
+
+    /* Find the policy with the longest prefix of a metric's name
+     *
+     * @param policies -- the policies to choose from
+     * @param name -- name of the metric
+     * @returns the policy, or NULL if none applies */
+    inline const policy* match(const std::vector<policy>& policies,
+        const std::string& name) {
+        const policy* best = NULL;
+        std::vector<policy>::const_iterator it(policies.begin());
+        for (; it != policies.end(); ++it) {
+            if (name.compare(0, it->prefix.length(), it->prefix) == 0 &&
+                (best == NULL || it->prefix.length() > best->prefix.length())) {
+                best = &(*it);
+            }
+        }
+        return best;
+    }
+
+    /* How inserts are made durable, by syncing the buffers they're in */
+    enum durability {
+        durability_none,      /* Left for the OS to write out in its time */
+        durability_periodic,  /* Synced every so often, without waiting */
+        durability_group      /* Each insert waits for the next sync */
+    };
+
+    /* Knobs for tuning a database. The defaults reproduce the behavior of a
+     * plain `db(path, num_files)` */
+    struct options {
+        /* How many background threads dump full buffers out to their slabs.
+         * With none, buffers are dumped inline on the inserting thread */
+        uint32_t flush_threads;
+
+        /* How many full buffers may be waiting on the flush threads before
+         * inserts that need to rotate block until one has been dumped */
+        uint32_t max_pending;
+
+        /* How many slabs each shard may hold open, so that dumps don't have
+         * to reopen the slabs of busy metrics. Mind the process's limit on
+         * open files, which this many times the number of shards may use */
+        uint32_t slab_cache_size;
+
+        /* Whether slabs are compressed as they're rotated out, with
+         * Gorilla-style delta-of-delta timestamps and XORed values. Best for
+         * regularly-sampled, slowly-changing series */
+        bool compress_slabs;
+
+        /* Which metrics are rolled up into coarser tiers as their slabs are
+         * rotated out, for reading long ranges at a lower resolution. With
+         * none, nothing is rolled up */
+        std::vector<policy> policies;
+
+        /* How the data points in each bucket are combined when rolling up,
+         * set with aggregate_with(), and the data type it's for. With none,
+         * a bucket keeps its latest data point */
+        void                  (* aggregate)();
+        const std::type_info* aggregate_for;
+
+        /* How many seconds to wait between background passes that remove
+         * slabs whose data points have all expired. With 0, slabs are only
+         * removed by calling `prune` */
+        uint32_t prune_interval;
+
+        /* The most slabs a background pass removes, and metrics' directories
+         * it looks through, each second, so that it doesn't crowd out the
+         * I/O of dumps */
+        uint32_t prune_rate;
+
+        /* Whether each dump is written out as one packed segment holding
+         * all of its metrics, instead of appending to a slab for each. This
+         * keeps the number of files small with millions of metrics, but
+         * compression and rollups only apply to slabs. Segments that are
+         * already there are read either way */
+        bool segments;
+
+        /* How many segments spanning the same number of dumps are merged
+         * into one in the background */
+        uint32_t segment_fanout;
+
+        /* Whether dumps and reads batch their file operations through
+         * io_uring, where the kernel supports it. Each database decides for
+         * itself, whatever others in the process do */
+        bool io_uring;
+
+        /* How many threads carry out asynchronous inserts and gets. With
+         * none, they're carried out inline, though their callbacks are still
+         * only invoked by dispatch(). Either way, nothing is started until
+         * the first asynchronous operation */
+        uint32_t async_threads;
+
+        /* How many asynchronous operations may be waiting on those threads
+         * before issuing another blocks */
+        uint32_t async_pending;
+
+        /* How many threads dump the buffers left behind by a crash when the
+         * database opens, each taking a different shard's. With none, they're
+         * dumped one after another on the opening thread. No more are started
+         * than there are processors or shards with leftovers */
+        uint32_t recovery_threads;
+
+        /* Whether the database opens before those buffers have been dumped,
+         * and dumps them in the background. Gets still see their points, and
+         * inserts are accepted right away */
+        bool background_recovery;
+
+        /* How inserts are made durable. With group commit, each insert
+         * returns only once its buffer has been synced, but one sync covers
+         * every insert that's waiting on it. Unless it's none, dumps are
+         * synced before their buffers are removed */
+        durability sync_mode;
+
+        /* Most milliseconds between syncs */
+        uint32_t sync_interval;
+
+        /* How many bytes may be inserted before a sync is due, even if the
+         * interval isn't up */
+        uint32_t sync_bytes;
+
+        /* How many of each metric's most recent data points are kept in
+         * memory, so that gets for only recent data never go to disk. With
+         * none, nothing is kept */
+        uint32_t recent_points;
+
+        /* Only keep recent data points within this many seconds of each
+         * metric's latest, or 0 for any of them */
+        uint32_t recent_seconds;
+
+        /* The most bytes to spend on all the metrics' recent data points.
+         * Metrics beyond that aren't kept in memory at all */
+        uint64_t recent_budget;
+
+        /* How many inserted data points and new names may be waiting to be
+         * handed to subscribers. Past that, more are dropped rather than
+         * holding up inserts */
+        uint32_t subscription_pending;
+
+        /* How many alarms going off or clearing may be waiting to be handed
+         * to their callbacks. Room for them is set aside when the first
+         * alarm is added, and past that, more are dropped */
+        uint32_t alarm_pending;
+
+        options(): flush_threads(0), max_pending(16), slab_cache_size(64),
+            compress_slabs(false), policies(), aggregate(NULL),
+            aggregate_for(NULL), prune_interval(60), prune_rate(100),
+            segments(false), segment_fanout(4),
+            io_uring(false), async_threads(0), async_pending(1024),
+            recovery_threads(sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+                sysconf(_SC_NPROCESSORS_ONLN) : 1),
+            background_recovery(false), sync_mode(durability_none),
+            sync_interval(10), sync_bytes(1024 * 1024), recent_points(0),
+            recent_seconds(0), recent_budget(64 * 1024 * 1024),
+            subscription_pending(65536), alarm_pending(4096) {}
+
+        /* Set how the data points in each bucket are combined when rolling
+         * up, so that it's in place before anything is rotated out, like
+         * `opts.aggregate_with<foo>(&average)`
+         *
+         * @param fn -- the aggregate, or NULL for the default */
+        template <typename D>
+        void aggregate_with(typename data_traits<D>::aggregate_type fn) {
+            aggregate     = reinterpret_cast<void (*)()>(fn);
+            aggregate_for = fn ? &typeid(D) : NULL;
+        }
+
+        /* The aggregate set for a data type
+         *
+         * @returns the aggregate, or NULL if none was set for this type */
+        template <typename D>
+        typename data_traits<D>::aggregate_type aggregate_of() const {
+            if (aggregate == NULL || *aggregate_for != typeid(D)) {
+                return NULL;
+            }
+            return reinterpret_cast<typename data_traits<D>::aggregate_type>(
+                aggregate);
+        }
+    };
+}
+
+#endif
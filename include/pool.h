@@ -0,0 +1,161 @@
+#ifndef MADB__POOL_H
+#define MADB__POOL_H
+
+#include <deque>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+/* C includes */
+#include <pthread.h>
+
+namespace madb {
+    /* A small, fixed-size pool of worker threads with a bounded queue of
+     * jobs. When the queue is full, submit() blocks until a worker frees up a
+     * spot, which is how we push back on producers that outpace the workers.
+     * A pool with no threads runs every job inline in submit() */
+    class pool {
+    public:
+        /* The type of job we run, along with its user data */
+        typedef void(* job_type)(void*);
+
+        /* Constructor
+         *
+         * @param num_threads -- how many worker threads to start
+         * @param queue_size -- how many jobs may be queued at once */
+        pool(uint32_t num_threads, uint32_t queue_size):
+            jobs(), threads(num_threads), max_pending(queue_size),
+            running(0), stopping(false) {
+            if (max_pending == 0) {
+                max_pending = 1;
+            }
+            pthread_mutex_init(&lock, NULL);
+            pthread_cond_init(&ready, NULL);
+            pthread_cond_init(&space, NULL);
+            pthread_cond_init(&idle, NULL);
+
+            for (uint32_t i = 0; i < threads.size(); ++i) {
+                pthread_create(&threads[i], NULL, work, this);
+            }
+        }
+
+        /* Destructor -- finishes all outstanding jobs */
+        ~pool() {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_broadcast(&ready);
+            pthread_mutex_unlock(&lock);
+
+            for (uint32_t i = 0; i < threads.size(); ++i) {
+                pthread_join(threads[i], NULL);
+            }
+
+            pthread_cond_destroy(&idle);
+            pthread_cond_destroy(&space);
+            pthread_cond_destroy(&ready);
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Queue up a job, blocking while the queue is full
+         *
+         * @param job -- function to run on a worker
+         * @param data -- user data to pass to the job */
+        void submit(job_type job, void* data) {
+            if (threads.empty()) {
+                job(data);
+                return;
+            }
+
+            pthread_mutex_lock(&lock);
+            while (jobs.size() >= max_pending) {
+                pthread_cond_wait(&space, &lock);
+            }
+            jobs.push_back(entry(job, data));
+            pthread_cond_signal(&ready);
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* Wait until every job queued so far has finished */
+        void drain() {
+            pthread_mutex_lock(&lock);
+            while (!jobs.empty() || running) {
+                pthread_cond_wait(&idle, &lock);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* Let the workers exit once every job queued so far has run,
+         * without waiting for them to. Nothing more may be queued */
+        void finish() {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_broadcast(&ready);
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* How many jobs are waiting to be run */
+        size_t pending() {
+            pthread_mutex_lock(&lock);
+            size_t count = jobs.size();
+            pthread_mutex_unlock(&lock);
+            return count;
+        }
+
+        /* How many worker threads we have */
+        size_t size() const {
+            return threads.size();
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        pool();
+        pool(const pool& other);
+        const pool& operator=(const pool& other);
+
+        /* A queued job and its user data */
+        typedef std::pair<job_type, void*> entry;
+
+        /* Members */
+        std::deque<entry>      jobs;         /* Jobs waiting to run */
+        std::vector<pthread_t> threads;      /* Our worker threads */
+        size_t                 max_pending;  /* Most jobs we'll queue */
+        uint32_t               running;      /* Jobs currently running */
+        bool                   stopping;     /* Whether we're shutting down */
+        pthread_mutex_t        lock;         /* Guards all of the above */
+        pthread_cond_t         ready;        /* Signaled when jobs arrive */
+        pthread_cond_t         space;        /* Signaled when jobs leave */
+        pthread_cond_t         idle;         /* Signaled when jobs finish */
+
+        /* The body of each of our worker threads */
+        static void* work(void* self) {
+            pool* p = static_cast<pool*>(self);
+
+            pthread_mutex_lock(&p->lock);
+            while (true) {
+                while (p->jobs.empty() && !p->stopping) {
+                    pthread_cond_wait(&p->ready, &p->lock);
+                }
+                if (p->jobs.empty()) {
+                    break;
+                }
+
+                entry job(p->jobs.front());
+                p->jobs.pop_front();
+                ++p->running;
+                pthread_cond_signal(&p->space);
+                pthread_mutex_unlock(&p->lock);
+
+                job.first(job.second);
+
+                pthread_mutex_lock(&p->lock);
+                --p->running;
+                if (p->jobs.empty() && !p->running) {
+                    pthread_cond_broadcast(&p->idle);
+                }
+            }
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+    };
+}
+
+#endif
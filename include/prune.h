@@ -0,0 +1,325 @@
+#ifndef MADB__PRUNE_H
+#define MADB__PRUNE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+/* C includes */
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Internal imports */
+#include "slab.h"
+#include "traits.h"
+#include "catalog.h"
+#include "options.h"
+#include "segment.h"
+
+#include <boost/filesystem.hpp>
+
+namespace madb {
+    /* Removes slabs whose data points have all expired.
+     *
+     * Everything in a rotated slab comes before its name, so once the name
+     * falls outside of a metric's retention, the whole file can be unlinked
+     * without ever being opened. The latest slab is never removed, and
+     * neither is any slab with a point still in retention. Segments, if
+     * there are any, are pruned after the slabs.
+     *
+     * Passes go through the metrics in the catalog a page at a time, rather
+     * than walking the directories. They run on a background thread every
+     * so often, and are rate-limited, counting each metric's directory that
+     * is looked through as well as each slab removed, so that neither a
+     * backlog of expired slabs nor millions of metrics stall the dumps. How
+     * far a background pass got is saved in `pruning`, so that the next one
+     * picks up from there even if the database was closed in between */
+    template <typename D>
+    class pruner {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::timestamp_type  timestamp_type;
+
+        /* How many metrics are listed from the catalog at once */
+        static const size_t page_size = 1024;
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param policies -- how long each metric's data is kept
+         * @param interval -- seconds between background passes, or 0 for no
+         *      background passes
+         * @param rate -- most slabs removed and directories looked through
+         *      each second in the background
+         * @param known -- catalog of the metrics whose slabs to prune
+         * @param store -- segments to prune as well, if any */
+        pruner(const std::string& base, const std::vector<policy>& policies,
+            uint32_t interval, uint32_t rate, catalog* known,
+            segments<D>* store=NULL):
+            base(base), policies(policies), interval(interval), rate(rate),
+            known(known), store(store), resume(), stopping(false),
+            started(false) {
+            pthread_mutex_init(&lock, NULL);
+            std::ifstream saved(progress().c_str());
+            std::getline(saved, resume);
+            pthread_cond_init(&wake, NULL);
+            if (interval && expires()) {
+                started = (pthread_create(&thread, NULL, work, this) == 0);
+            }
+        }
+
+        /* Destructor -- stops any pass that's underway */
+        ~pruner() {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&lock);
+            if (started) {
+                pthread_join(thread, NULL);
+            }
+
+            pthread_cond_destroy(&wake);
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Remove every slab that's expired as of a time, without any rate
+         * limit
+         *
+         * @param now -- the current time
+         * @returns how many slabs and segments were removed or rewritten */
+        size_t prune(timestamp_type now) {
+            std::string from;
+            return pass(now, 0, from);
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        pruner();
+        pruner(const pruner& other);
+        const pruner& operator=(const pruner& other);
+
+        /* Members */
+        std::string         base;      /* Base path of the database */
+        std::vector<policy> policies;  /* How long data is kept */
+        uint32_t            interval;  /* Seconds between passes */
+        uint32_t            rate;      /* Most removals per second */
+        catalog*            known;     /* Every metric */
+        segments<D>*        store;     /* Segments to prune, if any */
+        std::string         resume;    /* Last metric the background
+                                        * passes got through */
+        bool                stopping;  /* Whether we're shutting down */
+        bool                started;   /* Whether our thread is running */
+        pthread_t           thread;    /* Runs background passes */
+        pthread_mutex_t     lock;      /* Guards stopping */
+        pthread_cond_t      wake;      /* Signaled when stopping */
+
+        /* Whether any data expires at all */
+        bool expires() const {
+            std::vector<policy>::const_iterator it(policies.begin());
+            for (; it != policies.end(); ++it) {
+                if (it->retention) {
+                    return true;
+                }
+                std::vector<tier>::const_iterator t(it->tiers.begin());
+                for (; t != it->tiers.end(); ++t) {
+                    if (t->retention) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        /* The body of our background thread */
+        static void* work(void* self) {
+            pruner* p = static_cast<pruner*>(self);
+            while (!p->sleep(p->interval)) {
+                p->pass(time(NULL), p->rate, p->resume);
+            }
+            return NULL;
+        }
+
+        /* Wait for some seconds, or until we're stopped
+         *
+         * @returns whether we've been stopped */
+        bool sleep(uint32_t seconds) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            struct timespec until;
+            until.tv_sec  = tv.tv_sec + seconds;
+            until.tv_nsec = tv.tv_usec * 1000;
+
+            pthread_mutex_lock(&lock);
+            int result = 0;
+            while (!stopping && result != ETIMEDOUT) {
+                result = pthread_cond_timedwait(&wake, &lock, &until);
+            }
+            bool stopped = stopping;
+            pthread_mutex_unlock(&lock);
+            return stopped;
+        }
+
+        /* Where background passes save how far they got */
+        std::string progress() const {
+            return (boost::filesystem::path(base) / "pruning").string();
+        }
+
+        /* Go through every metric's raw data and tiers, removing expired
+         * slabs, and then the segments
+         *
+         * @param now -- the current time
+         * @param limit -- most removals and directories looked through per
+         *      second, or 0 for no limit
+         * @param from -- the last metric a previous pass got through, which
+         *      is kept up to date, and saved if there's a limit
+         * @returns how many slabs and segments were removed or rewritten */
+        size_t pass(timestamp_type now, uint32_t limit, std::string& from) {
+            removals r(limit);
+            std::vector<uint32_t> resolutions(tiers());
+            boost::filesystem::path root(base);
+            while (known && !r.stopped) {
+                catalog::names_type names(known->page(from, page_size));
+                catalog::names_type::iterator it(names.begin());
+                for (; it != names.end() && !r.stopped; ++it) {
+                    expire(root / "metrics" / *it, lookup(*it, 0), now, r);
+                    for (size_t i = 0; i < resolutions.size(); ++i) {
+                        std::stringstream ss;
+                        ss << resolutions[i];
+                        expire(root / "rollups" / ss.str() / "metrics" / *it,
+                            lookup(*it, resolutions[i]), now, r);
+                    }
+                    if (!r.stopped) {
+                        from = *it;
+                    }
+                }
+
+                if (names.size() < page_size && !r.stopped) {
+                    from.clear();
+                    if (limit) {
+                        boost::filesystem::remove(progress());
+                    }
+                    break;
+                } else if (limit) {
+                    std::ofstream saved(progress().c_str(),
+                        std::ios::trunc);
+                    saved << from;
+                }
+            }
+
+            if (store && !r.stopped) {
+                r.count += store->prune(now);
+            }
+            return r.count;
+        }
+
+        /* The resolution of every tier that's been rolled up into */
+        std::vector<uint32_t> tiers() const {
+            std::vector<uint32_t> resolutions;
+            boost::filesystem::path rollups(base);
+            rollups /= "rollups";
+            if (boost::filesystem::is_directory(rollups)) {
+                boost::filesystem::directory_iterator it(rollups);
+                boost::filesystem::directory_iterator it_end;
+                for (; it != it_end; ++it) {
+                    std::stringstream ss(it->path().filename().string());
+                    uint32_t resolution;
+                    if (ss >> resolution) {
+                        resolutions.push_back(resolution);
+                    }
+                }
+            }
+            return resolutions;
+        }
+
+        /* Keeps count of removals, and paces them along with the
+         * directories looked through */
+        typedef struct removals_ {
+            uint32_t limit;    /* Most of both per second, or 0 */
+            size_t   count;    /* Removals so far */
+            uint32_t batch;    /* Both in the current second */
+            time_t   second;   /* When the current second began */
+            bool     stopped;  /* Whether we've been stopped */
+
+            removals_(uint32_t limit): limit(limit), count(0), batch(0),
+                second(time(NULL)), stopped(false) {}
+        } removals;
+
+        /* Remove a metric's expired slabs. They're gathered up first, since
+         * directory iterators don't take kindly to their entries vanishing.
+         * Metrics that are kept for ever aren't looked at at all
+         *
+         * @param dir -- the metric's directory
+         * @param retention -- how long its data is kept, or 0 for ever
+         * @param now -- the current time
+         * @param r -- removals so far */
+        void expire(const boost::filesystem::path& dir, uint32_t retention,
+            timestamp_type now, removals& r) {
+            if (retention == 0 || retention > now) {
+                return;
+            }
+            pace(r);
+            if (r.stopped || !boost::filesystem::is_directory(dir)) {
+                return;
+            }
+
+            std::vector<boost::filesystem::path> expired;
+            boost::filesystem::directory_iterator it(dir);
+            boost::filesystem::directory_iterator it_end;
+            for (; it != it_end; ++it) {
+                std::stringstream ss(it->path().filename().string());
+                timestamp_type bound;
+                if ((ss >> bound) && bound <= now - retention &&
+                    boost::filesystem::is_regular_file(it->path())) {
+                    expired.push_back(it->path());
+                }
+            }
+
+            std::vector<boost::filesystem::path>::iterator e(expired.begin());
+            for (; e != expired.end() && !r.stopped; ++e) {
+                if (boost::filesystem::remove(*e)) {
+                    ++r.count;
+                    pace(r);
+                }
+            }
+        }
+
+        /* How long a metric's data is kept in a tier, or 0 for ever */
+        uint32_t lookup(const std::string& name, uint32_t resolution) const {
+            const policy* p = match(policies, name);
+            if (p == NULL) {
+                return 0;
+            } else if (resolution == 0) {
+                return p->retention;
+            }
+
+            std::vector<tier>::const_iterator it(p->tiers.begin());
+            for (; it != p->tiers.end(); ++it) {
+                if (it->resolution == resolution) {
+                    return it->retention;
+                }
+            }
+            return 0;
+        }
+
+        /* Wait a second if we've hit our limit within this one */
+        void pace(removals& r) {
+            if (r.limit == 0 || ++r.batch < r.limit) {
+                return;
+            }
+
+            time_t now = time(NULL);
+            if (now == r.second) {
+                r.stopped = sleep(1);
+            }
+            r.batch  = 0;
+            r.second = time(NULL);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef MADB__RECENT_H
+#define MADB__RECENT_H
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+/* Internal imports */
+#include "traits.h"
+
+namespace madb {
+    /* How many of the most recent data points to keep in memory for each
+     * metric, and how much memory all of them may take. This is shared by
+     * every shard of a database, and is thread-safe. Gets on every shard
+     * count their hits here, so it's all atomics rather than a lock */
+    class memtable {
+    public:
+        /* Constructor
+         *
+         * @param points -- most data points to keep for each metric
+         * @param seconds -- only keep those this close to the latest, or 0
+         *      for no limit
+         * @param budget -- most bytes to spend on all of them */
+        memtable(uint32_t points, uint32_t seconds, uint64_t budget):
+            points(points), seconds(seconds), budget(budget), used(0),
+            hits(0), misses(0) {}
+
+        /* Set aside memory for a metric's points, if it's within budget
+         *
+         * @param bytes -- how much is needed
+         * @returns whether it was set aside */
+        bool reserve(uint64_t bytes) {
+            uint64_t current = __atomic_load_n(&used, __ATOMIC_RELAXED);
+            do {
+                if (current + bytes > budget) {
+                    return false;
+                }
+            } while (!__atomic_compare_exchange_n(&used, &current,
+                current + bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            return true;
+        }
+
+        /* Give back memory that was set aside */
+        void release(uint64_t bytes) {
+            __atomic_fetch_sub(&used, bytes, __ATOMIC_RELAXED);
+        }
+
+        /* Count a get answered from memory, or not */
+        void count(bool hit) {
+            __atomic_fetch_add(hit ? &hits : &misses, 1, __ATOMIC_RELAXED);
+        }
+
+        /* Read out how much memory is in use, and how many gets have been
+         * answered from it */
+        void read(uint64_t& bytes, uint64_t& hit, uint64_t& missed) const {
+            bytes  = __atomic_load_n(&used, __ATOMIC_RELAXED);
+            hit    = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+            missed = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+        }
+
+        const uint32_t points;   /* Most data points for each metric */
+        const uint32_t seconds;  /* How far back from the latest, or 0 */
+        const uint64_t budget;   /* Most bytes for all of them */
+    private:
+        /* Private, unimplemented to prevent use */
+        memtable();
+        memtable(const memtable& other);
+        const memtable& operator=(const memtable& other);
+
+        /* Members */
+        uint64_t used;    /* Bytes set aside */
+        uint64_t hits;    /* Gets answered from memory */
+        uint64_t misses;  /* Gets that went to disk */
+    };
+
+    /* The most recent data points of one metric, in a ring that's written
+     * over oldest first.
+     *
+     * Every data point at or after `floor` that's been inserted is in the
+     * ring, so any range that begins there can be answered without going to
+     * disk. Whenever a point is written over, or falls out of the window of
+     * seconds, the floor moves up past it. Points from before the database
+     * was opened can't be accounted for, so a window isn't trusted until
+     * it's been checked against the disk once.
+     *
+     * This isn't thread-safe, and is guarded by its shard's lock */
+    template <typename D>
+    class window {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+
+        /* Constructor
+         *
+         * @param capacity -- most data points to keep, which may be 0 if
+         *      there was no room for them
+         * @param seconds -- only keep those this close to the latest, or 0 */
+        window(uint32_t capacity, uint32_t seconds): points(capacity),
+            seconds(seconds), head(0), count(0), floor(0), newest(0),
+            checked(false) {}
+
+        /* How much memory the ring takes */
+        uint64_t bytes() const {
+            return points.size() * sizeof(data_type);
+        }
+
+        /* Remember a data point */
+        void add(const data_type& datum) {
+            if (points.empty()) {
+                return;
+            }
+
+            if (count == 0) {
+                floor  = datum.time;
+                newest = datum.time;
+            } else if (count == points.size()) {
+                /* Write over the oldest */
+                raise(points[head].time + 1);
+            }
+            points[head] = datum;
+            head  = (head + 1) % points.size();
+            count = std::min<size_t>(count + 1, points.size());
+
+            if (datum.time > newest) {
+                newest = datum.time;
+            }
+            if (seconds && newest >= seconds) {
+                raise(newest - seconds + 1);
+            }
+        }
+
+        /* Whether every data point from a time on is here */
+        bool covers(timestamp_type start) const {
+            return checked && count && start >= floor;
+        }
+
+        /* Whether it's been checked against the disk */
+        bool trusted() const {
+            return checked || points.empty();
+        }
+
+        /* Check against the data points on disk and in buffers from the floor
+         * on. If there are more there than here, some came from before we were
+         * opened, and the floor moves up past all of them
+         *
+         * @param from -- the floor when those were read
+         * @param found -- those data points, sorted */
+        void check(timestamp_type from, const values_type& found) {
+            if (count == 0) {
+                return;
+            }
+
+            size_t here = 0;
+            for (size_t i = 0; i < count; ++i) {
+                here += (points[i].time >= from);
+            }
+            if (found.size() > here) {
+                raise(found.back().time + 1);
+            }
+            checked = true;
+        }
+
+        /* The floor, from which every data point is here */
+        timestamp_type bottom() const {
+            return floor;
+        }
+
+        /* Copy out the data points in a range, in the order inserted
+         *
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param results -- where to append them */
+        void get(timestamp_type start, timestamp_type end,
+            values_type& results) const {
+            size_t first = (count == points.size()) ? head : 0;
+            for (size_t i = 0; i < count; ++i) {
+                const data_type& datum(points[(first + i) % points.size()]);
+                if (datum.time >= start && datum.time <= end) {
+                    results.push_back(datum);
+                }
+            }
+        }
+    private:
+        /* Members */
+        std::vector<data_type> points;   /* The ring */
+        uint32_t               seconds;  /* How far back from newest, or 0 */
+        size_t                 head;     /* Where the next point goes */
+        size_t                 count;    /* How many points are in the ring */
+        timestamp_type         floor;    /* Every point from here on is kept */
+        timestamp_type         newest;   /* The latest time we've seen */
+        bool                   checked;  /* Whether it's been checked */
+
+        /* Move the floor up, never down */
+        void raise(timestamp_type to) {
+            if (to > floor) {
+                floor = to;
+            }
+        }
+    };
+}
+
+#endif
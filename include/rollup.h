@@ -0,0 +1,317 @@
+#ifndef MADB__ROLLUP_H
+#define MADB__ROLLUP_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+/* C includes */
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Internal imports */
+#include "pool.h"
+#include "slab.h"
+#include "traits.h"
+#include "options.h"
+
+#include <boost/filesystem.hpp>
+
+namespace madb {
+    /* Rolls metrics up into coarser tiers in the background.
+     *
+     * Every time one of a metric's slabs is rotated out, a job is queued to
+     * aggregate the points it covers into one point per bucket of each of the
+     * metric's tiers. A tier is stored just like the raw data, as slabs under
+     * `rollups/<resolution>/` in the database's directory, and each point is
+     * stamped with the beginning of its bucket.
+     *
+     * The last bucket a rotated slab reaches is held back, since the next
+     * slab may have more points for it, and it's rolled up along with that
+     * slab instead. Each tier keeps a high-water mark of the buckets it's
+     * rolled up, and every rollup starts from there, reading whatever raw
+     * points have turned up since in any slab. Points that arrive for a
+     * bucket below the mark aren't reflected in the tier */
+    template <typename D>
+    class rollups {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+        typedef typename traits::aggregate_type  aggregate_type;
+
+        /* How many rotated slabs may be waiting to be rolled up before the
+         * dumps that rotate them block */
+        static const uint32_t max_pending = 1024;
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param policies -- which metrics roll up into which tiers
+         * @param compress -- whether tier slabs compress as they're rotated */
+        rollups(const std::string& base, const std::vector<policy>& policies,
+            bool compress):
+            base(base), policies(policies), compress(compress),
+            aggregate(latest), workers(1, max_pending) {}
+
+        /* Set how the points in a bucket are combined. By default, a bucket
+         * keeps its latest point. This should be set before anything is
+         * inserted */
+        void aggregate_with(aggregate_type fn) {
+            aggregate = fn ? fn : latest;
+        }
+
+        /* Wait until every rotated slab so far has been rolled up */
+        void drain() {
+            workers.drain();
+        }
+
+        /* Find the coarsest of a metric's tiers that's at least as fine as a
+         * resolution
+         *
+         * @param name -- name of the metric
+         * @param resolution -- the coarsest acceptable resolution, in seconds
+         * @returns the tier, or NULL if the raw data must be used */
+        const tier* coarsest(const key_type& name, uint32_t resolution) const {
+            const policy* p = find(name);
+            const tier*   best = NULL;
+            if (p == NULL) {
+                return best;
+            }
+
+            std::vector<tier>::const_iterator it(p->tiers.begin());
+            for (; it != p->tiers.end(); ++it) {
+                if (it->resolution > 1 && it->resolution <= resolution &&
+                    (best == NULL || it->resolution > best->resolution)) {
+                    best = &(*it);
+                }
+            }
+            return best;
+        }
+
+        /* Get a metric's rolled-up data points in a range
+         *
+         * @param name -- name of the metric
+         * @param t -- the tier to read
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive */
+        values_type get(const key_type& name, const tier& t,
+            timestamp_type start, timestamp_type end) const {
+            return slab<D>(directory(t), name, true).get(start, end);
+        }
+
+        /* Get the base path that a tier's slabs are kept under */
+        std::string directory(const tier& t) const {
+            boost::filesystem::path p(base);
+            std::stringstream ss;
+            ss << t.resolution;
+            p /= "rollups";
+            p /= ss.str();
+            return p.string();
+        }
+
+        /* Aggregate sorted data points into one per bucket
+         *
+         * @param first -- the first data point
+         * @param last -- one past the last data point
+         * @param resolution -- how many seconds each bucket covers
+         * @param results -- where to append the aggregated data points */
+        void downsample(const data_type* first, const data_type* last,
+            uint32_t resolution, values_type& results) const {
+            while (first != last) {
+                timestamp_type bucket = floor(first->time, resolution);
+                const data_type* next(first);
+                while (next != last &&
+                    floor(next->time, resolution) == bucket) {
+                    ++next;
+                }
+
+                data_type datum;
+                datum.time  = bucket;
+                datum.value = aggregate(first, next);
+                results.push_back(datum);
+                first = next;
+            }
+        }
+
+        /* The beginning of the bucket that a timestamp falls in */
+        static timestamp_type floor(timestamp_type time, uint32_t resolution) {
+            return time - (time % resolution);
+        }
+
+        /* Queue up a rotated slab to be rolled up. Suitable for passing to
+         * slab<D>::notify, with the rollups as user data */
+        static void rotated(const key_type& name, timestamp_type bound,
+            void* self) {
+            rollups* r = static_cast<rollups*>(self);
+            const policy* p = r->find(name);
+            if (p == NULL || p->tiers.empty()) {
+                return;
+            }
+            r->workers.submit(run, new job(r, p, name, bound));
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        rollups();
+        rollups(const rollups& other);
+        const rollups& operator=(const rollups& other);
+
+        /* A rotated slab waiting to be rolled up */
+        typedef struct job_ {
+            rollups*       self;
+            const policy*  p;      /* The metric's policy */
+            key_type       name;   /* Name of the metric */
+            timestamp_type bound;  /* Name of the rotated slab */
+
+            job_(rollups* self, const policy* p, const key_type& name,
+                timestamp_type bound):
+                self(self), p(p), name(name), bound(bound) {}
+        } job;
+
+        /* Members */
+        std::string         base;        /* Base path of the database */
+        std::vector<policy> policies;    /* Which metrics roll up where */
+        bool                compress;    /* Whether tier slabs compress */
+        aggregate_type      aggregate;   /* Combines a bucket's points */
+        pool                workers;     /* Where rollups are done */
+
+        /* The default aggregate: a bucket's latest point */
+        static value_type latest(const data_type* first,
+            const data_type* last) {
+            return (last - 1)->value;
+        }
+
+        /* Find the policy for a metric */
+        const policy* find(const key_type& name) const {
+            return match(policies, name);
+        }
+
+        /* Roll up one rotated slab into each of its metric's tiers */
+        static void run(void* data) {
+            job* j = static_cast<job*>(data);
+            j->self->roll(*j);
+            delete j;
+        }
+
+        /* Roll up one rotated slab. Each tier remembers how far it's been
+         * rolled up, in a `rolled` file next to its slabs, and picks up from
+         * there, so slabs rotating out of order, or a job that's run twice,
+         * neither skip nor repeat buckets */
+        void roll(const job& j) {
+            std::vector<tier> tiers;
+            std::vector<timestamp_type> marks;
+            timestamp_type earliest = j.bound;
+            std::vector<tier>::const_iterator t(j.p->tiers.begin());
+            for (; t != j.p->tiers.end(); ++t) {
+                if (t->resolution > 1) {
+                    tiers.push_back(*t);
+                    marks.push_back(mark(*t, j.name));
+                    earliest = std::min(earliest, marks.back());
+                }
+            }
+            if (tiers.empty() || earliest >= j.bound) {
+                return;
+            }
+
+            values_type points(slab<D>(base, j.name, true).get(earliest,
+                j.bound - 1));
+            for (size_t i = 0; i < tiers.size(); ++i) {
+                /* Everything from where the tier left off, up to the bucket
+                 * this slab's last point is in, which is held back */
+                const tier& t(tiers[i]);
+                timestamp_type from  = marks[i];
+                timestamp_type until = floor(j.bound - 1, t.resolution);
+                if (until <= from) {
+                    continue;
+                }
+
+                slab<D> rolled(directory(t), j.name, false, compress);
+                typename values_type::iterator first(std::lower_bound(
+                    points.begin(), points.end(), from, before()));
+                typename values_type::iterator last(std::lower_bound(
+                    points.begin(), points.end(), until, before()));
+                if (first != last) {
+                    values_type buckets;
+                    downsample(&(*first), &(*first) + (last - first),
+                        t.resolution, buckets);
+
+                    /* Buckets that made it into the tier before the mark
+                     * did, if we were interrupted in between */
+                    values_type there(rolled.get(from, until - 1));
+                    typename values_type::iterator fresh(buckets.begin());
+                    if (!there.empty()) {
+                        fresh = std::upper_bound(buckets.begin(),
+                            buckets.end(), there.back().time, after());
+                    }
+                    if (fresh != buckets.end() &&
+                        rolled.insert(fresh, buckets.end()) != 0) {
+                        continue;
+                    }
+                }
+
+                /* Only once the buckets are written out */
+                if (rolled.flush() == 0) {
+                    remember(rolled, until);
+                }
+            }
+        }
+
+        /* How far a metric's tier has been rolled up: the beginning of the
+         * first bucket that hasn't been, or 0 if none have */
+        timestamp_type mark(const tier& t, const key_type& name) const {
+            slab<D> rolled(directory(t), name, true);
+            std::string path(rolled.directory() + "/rolled");
+            timestamp_type until = 0;
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return until;
+            }
+            if (::read(fd, &until, sizeof(until)) != sizeof(until)) {
+                until = 0;
+            }
+            ::close(fd);
+            return until;
+        }
+
+        /* Record how far a metric's tier has been rolled up. It's written
+         * alongside first and renamed into place, so it's never torn */
+        void remember(const slab<D>& rolled, timestamp_type until) const {
+            std::string path(rolled.directory() + "/rolled");
+            std::string temp(path + ".tmp");
+            int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                return;
+            }
+            bool written =
+                ::write(fd, &until, sizeof(until)) == sizeof(until);
+            ::close(fd);
+            if (!written || ::rename(temp.c_str(), path.c_str()) != 0) {
+                ::unlink(temp.c_str());
+            }
+        }
+
+        /* For finding the first point at or after a time */
+        struct before {
+            bool operator()(const data_type& d, timestamp_type time) const {
+                return d.time < time;
+            }
+        };
+
+        /* For finding the first point after a time */
+        struct after {
+            bool operator()(timestamp_type time, const data_type& d) const {
+                return time < d.time;
+            }
+        };
+    };
+}
+
+#endif
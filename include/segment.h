@@ -0,0 +1,947 @@
+#ifndef MADB__SEGMENT_H
+#define MADB__SEGMENT_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+/* C includes */
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Internal imports */
+#include "io.h"
+#include "pool.h"
+#include "cursor.h"
+#include "traits.h"
+#include "varint.h"
+#include "catalog.h"
+#include "options.h"
+
+#include <boost/filesystem.hpp>
+
+namespace madb {
+    /* A Bloom filter over metric names, with k probes derived from two
+     * halves of a 64-bit FNV-1a hash */
+    class bloom {
+    public:
+        /* Bits set per name */
+        static const uint32_t probes = 7;
+
+        /* Bits per name, for about a 1% false positive rate */
+        static const uint32_t bits_per_name = 10;
+
+        /* Constructor
+         *
+         * @param names -- how many names will be added */
+        bloom(size_t names): words((names * bits_per_name + 63) / 64 + 1, 0) {}
+
+        /* Constructor, from words that were written out */
+        bloom(const std::vector<uint64_t>& words): words(words) {}
+
+        /* Add a name */
+        void add(const std::string& name) {
+            uint64_t h = hash(name);
+            for (uint32_t i = 0; i < probes; ++i) {
+                uint64_t bit = probe(h, i);
+                words[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+            }
+        }
+
+        /* Whether a name might have been added */
+        bool contains(const std::string& name) const {
+            if (words.empty()) {
+                return true;
+            }
+            uint64_t h = hash(name);
+            for (uint32_t i = 0; i < probes; ++i) {
+                uint64_t bit = probe(h, i);
+                uint64_t mask = static_cast<uint64_t>(1) << (bit % 64);
+                if (!(words[bit / 64] & mask)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /* The underlying bits */
+        const std::vector<uint64_t>& bits() const {
+            return words;
+        }
+    private:
+        std::vector<uint64_t> words;  /* The bits, 64 at a time */
+
+        /* 64-bit FNV-1a */
+        static uint64_t hash(const std::string& name) {
+            uint64_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < name.length(); ++i) {
+                h ^= static_cast<uint8_t>(name[i]);
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        /* Which bit the i-th probe for a hash sets */
+        uint64_t probe(uint64_t h, uint32_t i) const {
+            uint32_t a = static_cast<uint32_t>(h);
+            uint32_t b = static_cast<uint32_t>(h >> 32) | 1;
+            return (a + static_cast<uint64_t>(i) * b) % (words.size() * 64);
+        }
+    };
+
+    /* An immutable, sorted file holding the data points of many metrics.
+     *
+     * Each metric's points are contiguous and sorted by time, and the
+     * metrics are sorted by name. After the points comes an index of where
+     * each metric's points are, and then a Bloom filter over the names, so
+     * that lookups for metrics that aren't in a segment rarely touch it.
+     *
+     * Segments are named for the range of dumps they hold, `first-last`, so
+     * a fresh dump is `n-n` and merging segments gives one spanning them.
+     * Each is kept open from when it's loaded, so that it can be read even
+     * once it's been renamed over or removed */
+    template <typename D>
+    class segment {
+    public:
+        /* Identifies a segment */
+        static const uint32_t magic = 0x6d736567;
+
+        /* Which version of the format we write */
+        static const uint32_t version = 1;
+
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+
+        /* Begins every segment */
+        typedef struct header_ {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t metrics;       /* How many metrics there are */
+            uint32_t bloom_words;   /* How many words of Bloom filter */
+            uint64_t index_offset;  /* Where the index begins */
+            uint64_t bloom_offset;  /* Where the Bloom filter begins */
+        } header;
+
+        /* Where one metric's points are */
+        typedef struct entry_ {
+            key_type       name;
+            uint64_t       offset;    /* Where its first point is */
+            uint32_t       count;     /* How many points it has */
+            timestamp_type min_time;  /* Its earliest point */
+            timestamp_type max_time;  /* Its latest point */
+        } entry;
+
+        /* Writes out a new segment, one metric at a time in order of name.
+         * It's written alongside first and renamed into place once it's
+         * complete, so a crash never leaves a partial segment behind */
+        class writer {
+        public:
+            /* Constructor
+             *
+             * @param path -- where the segment should end up
+             * @param durable -- whether to sync it before it's moved into
+             *      place, and its directory after */
+            writer(const std::string& path, bool durable=false):
+                path(path), temp(path + ".tmp"), fd(-1),
+                offset(sizeof(header)), entries(), ok(true),
+                durable(durable) {
+                fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    perror("Failed to open segment");
+                }
+            }
+
+            ~writer() {
+                if (fd >= 0) {
+                    ::close(fd);
+                    boost::filesystem::remove(temp);
+                }
+            }
+
+            /* Add a metric's sorted points, after any metric already added */
+            void add(const key_type& name, const values_type& points) {
+                if (points.empty()) {
+                    return;
+                }
+
+                entry e;
+                e.name     = name;
+                e.offset   = offset;
+                e.count    = points.size();
+                e.min_time = points.front().time;
+                e.max_time = points.back().time;
+                entries.push_back(e);
+
+                write(&points[0], points.size() * sizeof(data_type));
+            }
+
+            /* Write out the index and Bloom filter, and move the segment into
+             * place
+             *
+             * @returns 0 on success, else -1 */
+            int finish() {
+                if (fd < 0) {
+                    return -1;
+                }
+
+                header h;
+                h.magic        = magic;
+                h.version      = version;
+                h.metrics      = entries.size();
+                h.index_offset = offset;
+
+                bloom filter(entries.size());
+                std::vector<char> index;
+                typename std::vector<entry>::iterator it(entries.begin());
+                for (; it != entries.end(); ++it) {
+                    filter.add(it->name);
+                    size_t size = index.size();
+                    index.resize(size + varint::max_size + it->name.length() +
+                        sizeof(uint64_t) + 3 * sizeof(uint32_t));
+                    char* ptr = varint::encode(it->name.length(), &index[size]);
+                    ptr += it->name.copy(ptr, it->name.length());
+                    memcpy(ptr, &it->offset, sizeof(uint64_t));
+                    ptr += sizeof(uint64_t);
+                    memcpy(ptr, &it->count, sizeof(uint32_t));
+                    ptr += sizeof(uint32_t);
+                    memcpy(ptr, &it->min_time, sizeof(uint32_t));
+                    ptr += sizeof(uint32_t);
+                    memcpy(ptr, &it->max_time, sizeof(uint32_t));
+                    ptr += sizeof(uint32_t);
+                    index.resize(ptr - &index[0]);
+                }
+                if (!index.empty()) {
+                    write(&index[0], index.size());
+                }
+
+                h.bloom_offset = offset;
+                h.bloom_words  = filter.bits().size();
+                write(&filter.bits()[0], h.bloom_words * sizeof(uint64_t));
+
+                if (pwrite(fd, &h, sizeof(header), 0) != sizeof(header)) {
+                    ok = false;
+                }
+                if (ok && durable && fdatasync(fd) != 0) {
+                    ok = false;
+                }
+                ::close(fd);
+                fd = -1;
+
+                if (!ok) {
+                    perror("Failed to write segment");
+                    boost::filesystem::remove(temp);
+                    return -1;
+                }
+                boost::filesystem::rename(temp, path);
+                if (durable) {
+                    return io::sync(boost::filesystem::path(
+                        path).parent_path().string());
+                }
+                return 0;
+            }
+        private:
+            std::string        path;     /* Where it ends up */
+            std::string        temp;     /* Where it's written */
+            int                fd;       /* Open on temp */
+            uint64_t           offset;   /* How much has been written */
+            std::vector<entry> entries;  /* Every metric written so far */
+            bool               ok;       /* Whether every write succeeded */
+            bool               durable;  /* Whether to sync it */
+
+            /* Write out the next part of the segment */
+            void write(const void* data, size_t size) {
+                if (pwrite(fd, data, size, offset) !=
+                    static_cast<ssize_t>(size)) {
+                    ok = false;
+                }
+                offset += size;
+            }
+        };
+
+        /* Open an existing segment, reading in its index
+         *
+         * @param path -- path of the segment
+         * @param first -- the first dump in it
+         * @param last -- the last dump in it */
+        segment(const std::string& path, uint64_t first, uint64_t last):
+            path(path), first(first), last(last), size(0), min_time(0),
+            max_time(0), entries(), filter(0), fd(-1) {
+            load();
+        }
+
+        ~segment() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        /* Whether the segment was read in properly */
+        bool valid() const {
+            return size != 0;
+        }
+
+        /* Find a metric's entry
+         *
+         * @returns the entry, or NULL if the metric isn't here */
+        const entry* find(const key_type& name) const {
+            if (!filter.contains(name)) {
+                return NULL;
+            }
+            typename std::vector<entry>::const_iterator it(std::lower_bound(
+                entries.begin(), entries.end(), name, by_name()));
+            return (it != entries.end() && it->name == name) ? &(*it) : NULL;
+        }
+
+        /* Read all of a metric's points
+         *
+         * @param e -- the metric's entry
+         * @param results -- where to append the points */
+        void read(const entry& e, values_type& results) const {
+            if (fd < 0) {
+                return;
+            }
+            size_t start = results.size();
+            results.resize(start + e.count);
+            ssize_t count = pread(fd, &results[start],
+                e.count * sizeof(data_type), e.offset);
+            results.resize(start + ((count > 0) ?
+                count / sizeof(data_type) : 0));
+        }
+
+        /* Get a metric's points in a range. Only the points in the range
+         * are read, once binary searches have found where they are
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param results -- where to append the points */
+        void get(const key_type& name, timestamp_type start,
+            timestamp_type end, values_type& results) const {
+            const entry* e = overlapping(name, start, end);
+            if (e == NULL) {
+                return;
+            }
+
+            off_t from  = seek(*e, start, false);
+            off_t until = seek(*e, end, true);
+            size_t begin = results.size();
+            results.resize(begin + (until - from) / sizeof(data_type));
+            ssize_t count = (until == from) ? 0 : pread(fd, &results[begin],
+                until - from, from);
+            results.resize(begin + ((count > 0) ?
+                count / sizeof(data_type) : 0));
+        }
+
+        /* Add a metric's points in a range to a cursor, which reads them a
+         * chunk at a time as it reaches them
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param c -- the cursor to add them to */
+        void scan(const key_type& name, timestamp_type start,
+            timestamp_type end, cursor<D>& c) const {
+            const entry* e = overlapping(name, start, end);
+            if (e != NULL) {
+                c.add(fd, seek(*e, start, false),
+                    e->offset + e->count * sizeof(data_type));
+            }
+        }
+
+        /* Every metric in this segment, sorted by name */
+        const std::vector<entry>& metrics() const {
+            return entries;
+        }
+
+        /* Members */
+        std::string        path;      /* Path of the segment */
+        uint64_t           first;     /* First dump in the segment */
+        uint64_t           last;      /* Last dump in the segment */
+        uint64_t           size;      /* How many bytes the segment has */
+        timestamp_type     min_time;  /* Its earliest point */
+        timestamp_type     max_time;  /* Its latest point */
+    private:
+        /* Private, unimplemented to prevent use */
+        segment(const segment& other);
+        const segment& operator=(const segment& other);
+
+        std::vector<entry> entries;   /* Index of metrics, by name */
+        bloom              filter;    /* Which names might be here */
+        int                fd;        /* Open on the segment */
+
+        /* Find a metric's entry, if it has any points in a range
+         *
+         * @returns the entry, or NULL */
+        const entry* overlapping(const key_type& name, timestamp_type start,
+            timestamp_type end) const {
+            if (fd < 0 || max_time < start || min_time > end) {
+                return NULL;
+            }
+            const entry* e = find(name);
+            if (e == NULL || e->max_time < start || e->min_time > end) {
+                return NULL;
+            }
+            return e;
+        }
+
+        /* Find where a time falls in a metric's points, by binary searching
+         * them with positioned reads
+         *
+         * @param e -- the metric's entry
+         * @param time -- the time to look for
+         * @param past -- whether to find the first point after the time,
+         *      rather than at or after it
+         * @returns the byte offset of that point, or of the end of the
+         *      metric's points */
+        off_t seek(const entry& e, timestamp_type time, bool past) const {
+            data_type datum;
+            uint32_t lo = 0;
+            uint32_t hi = e.count;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (pread(fd, &datum, sizeof(data_type),
+                    e.offset + static_cast<uint64_t>(mid) * sizeof(data_type))
+                    != sizeof(data_type)) {
+                    break;
+                }
+                if (datum.time < time || (past && datum.time == time)) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return e.offset + static_cast<uint64_t>(lo) * sizeof(data_type);
+        }
+
+        /* Read in the header, index, and Bloom filter */
+        void load() {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+
+            struct stat st;
+            header h;
+            if (fstat(fd, &st) != 0 ||
+                pread(fd, &h, sizeof(header), 0) != sizeof(header) ||
+                h.magic != magic || h.version != version ||
+                h.bloom_offset < h.index_offset ||
+                h.bloom_offset + h.bloom_words * sizeof(uint64_t) !=
+                    static_cast<uint64_t>(st.st_size)) {
+                ::close(fd);
+                fd = -1;
+                return;
+            }
+
+            std::vector<char> index(h.bloom_offset - h.index_offset + 1);
+            std::vector<uint64_t> words(h.bloom_words);
+            bool ok = (pread(fd, &index[0], index.size() - 1, h.index_offset)
+                == static_cast<ssize_t>(index.size() - 1)) && (pread(fd,
+                    &words[0], words.size() * sizeof(uint64_t),
+                    h.bloom_offset) ==
+                    static_cast<ssize_t>(words.size() * sizeof(uint64_t)));
+            if (!ok) {
+                ::close(fd);
+                fd = -1;
+                return;
+            }
+
+            const char* ptr = &index[0];
+            const char* end = ptr + index.size() - 1;
+            entries.resize(h.metrics);
+            for (uint32_t i = 0; i < h.metrics; ++i) {
+                uint32_t length = 0;
+                ptr = varint::decode(ptr, end, length);
+                if (ptr == NULL || static_cast<size_t>(end - ptr) < length +
+                    sizeof(uint64_t) + 3 * sizeof(uint32_t)) {
+                    entries.clear();
+                    ::close(fd);
+                    fd = -1;
+                    return;
+                }
+                entry& e(entries[i]);
+                e.name.assign(ptr, length);
+                ptr += length;
+                memcpy(&e.offset, ptr, sizeof(uint64_t));
+                ptr += sizeof(uint64_t);
+                memcpy(&e.count, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                memcpy(&e.min_time, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                memcpy(&e.max_time, ptr, sizeof(uint32_t));
+                ptr += sizeof(uint32_t);
+                min_time = (i == 0) ? e.min_time : std::min(min_time,
+                    e.min_time);
+                max_time = std::max(max_time, e.max_time);
+            }
+
+            filter = bloom(words);
+            size   = st.st_size;
+        }
+
+        /* For binary searching the index */
+        struct by_name {
+            bool operator()(const entry& e, const key_type& name) const {
+                return e.name < name;
+            }
+        };
+    };
+
+    /* Storage that packs each dump into a single segment, instead of
+     * appending to a slab for every metric in it.
+     *
+     * Every dump is one sequential write of a new segment. In the background,
+     * runs of `fanout` segments that span the same number of dumps are merged
+     * into one, so there are only ever a few segments for each power of
+     * `fanout`, and any one data point is rewritten only a handful of times.
+     * Merges go by dump rather than by time, so that a merge cut short can
+     * be told apart from the segments it was merging.
+     *
+     * Data points expire the same way they do in slabs. Pruning removes
+     * segments whose points have all expired, and rewrites those where most
+     * of the points have, and merges leave out whatever pruning last found
+     * to have expired.
+     *
+     * This is thread-safe */
+    template <typename D>
+    class segments {
+    public:
+        /* Segments are only merged up to this size */
+        static const uint64_t max_merge = 256 * 1024 * 1024;
+
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+        typedef typename traits::values_map_type values_map_type;
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param fanout -- how many segments are merged at once
+         * @param known -- catalog to add new metrics to, if any
+         * @param durable -- whether segments are synced as they're written
+         * @param policies -- how long each metric's data is kept */
+        segments(const std::string& base, uint32_t fanout,
+            catalog* known=NULL, bool durable=false,
+            const std::vector<policy>& policies=std::vector<policy>()):
+            directory(), fanout(fanout < 2 ? 2 : fanout), known(known),
+            durable(durable), policies(policies), open(), next(0),
+            horizon(0), scheduled(false), compactor(1, 1) {
+            pthread_rwlock_init(&lock, NULL);
+            pthread_mutex_init(&rewriting, NULL);
+
+            boost::filesystem::path p(base);
+            p /= "segments";
+            directory = p.string();
+            boost::filesystem::create_directories(p);
+            load();
+        }
+
+        /* Destructor -- waits for any merge that's underway */
+        ~segments() {
+            compactor.drain();
+            typename std::vector<segment<D>*>::iterator it(open.begin());
+            for (; it != open.end(); ++it) {
+                delete *it;
+            }
+            pthread_mutex_destroy(&rewriting);
+            pthread_rwlock_destroy(&lock);
+        }
+
+        /* Write out a dump as a new segment
+         *
+         * @param data -- the points of each metric, in the order they were
+         *      inserted
+         * @returns 0 on success, else -1 */
+        int write(values_map_type& data) {
+            std::vector<key_type> names;
+            typename values_map_type::iterator it(data.begin());
+            for (; it != data.end(); ++it) {
+                if (!it->second.empty()) {
+                    names.push_back(it->first);
+                }
+            }
+            if (names.empty()) {
+                return 0;
+            }
+            std::sort(names.begin(), names.end());
+
+            pthread_rwlock_wrlock(&lock);
+            uint64_t seq = next++;
+            pthread_rwlock_unlock(&lock);
+
+            typename segment<D>::writer out(path(seq, seq), durable);
+            typename std::vector<key_type>::iterator name(names.begin());
+            for (; name != names.end(); ++name) {
+                values_type& points(data[*name]);
+                std::stable_sort(points.begin(), points.end());
+                out.add(*name, points);
+                if (known) {
+                    known->add(*name);
+                }
+            }
+            if (out.finish() != 0) {
+                return -1;
+            }
+
+            add(new segment<D>(path(seq, seq), seq, seq));
+            schedule();
+            return 0;
+        }
+
+        /* Add everything in a range to a cursor
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param c -- the cursor to add sources to */
+        void scan(const key_type& name, timestamp_type start,
+            timestamp_type end, cursor<D>& c) {
+            pthread_rwlock_rdlock(&lock);
+            typename std::vector<segment<D>*>::iterator it(open.begin());
+            for (; it != open.end(); ++it) {
+                (*it)->scan(name, start, end, c);
+            }
+            pthread_rwlock_unlock(&lock);
+        }
+
+        /* How many segments there are */
+        size_t size() {
+            pthread_rwlock_rdlock(&lock);
+            size_t count = open.size();
+            pthread_rwlock_unlock(&lock);
+            return count;
+        }
+
+        /* Wait for any merges that have been scheduled */
+        void drain() {
+            compactor.drain();
+        }
+
+        /* Remove the segments whose data points have all expired as of a
+         * time, and rewrite those where most of them have
+         *
+         * @param now -- the current time
+         * @returns how many segments were removed or rewritten */
+        size_t prune(timestamp_type now) {
+            pthread_mutex_lock(&rewriting);
+            pthread_rwlock_wrlock(&lock);
+            horizon = std::max(horizon, now);
+            std::vector<segment<D>*> current(open);
+            pthread_rwlock_unlock(&lock);
+
+            size_t pruned = 0;
+            typename std::vector<segment<D>*>::iterator it(current.begin());
+            for (; it != current.end(); ++it) {
+                pruned += expire(*it, now) ? 1 : 0;
+            }
+            pthread_mutex_unlock(&rewriting);
+            return pruned;
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        segments();
+        segments(const segments& other);
+        const segments& operator=(const segments& other);
+
+        /* Members */
+        std::string               directory;  /* Where segments are kept */
+        uint32_t                  fanout;     /* How many to merge at once */
+        catalog*                  known;      /* Where new metrics go */
+        bool                      durable;    /* Whether to sync segments */
+        std::vector<policy>       policies;   /* How long data is kept */
+        std::vector<segment<D>*>  open;       /* Oldest first */
+        uint64_t                  next;       /* Next dump's number */
+        timestamp_type            horizon;    /* When we last pruned */
+        bool                      scheduled;  /* Whether a merge is queued */
+        pool                      compactor;  /* Where merges happen */
+        pthread_rwlock_t          lock;       /* Guards all of the above */
+        pthread_mutex_t           rewriting;  /* Held to remove segments */
+
+        /* The path of a segment holding a range of dumps */
+        std::string path(uint64_t first, uint64_t last) const {
+            std::stringstream ss;
+            ss << directory << "/" << first << "-" << last;
+            return ss.str();
+        }
+
+        /* Orders segments by the dumps they hold */
+        static bool older(const segment<D>* a, const segment<D>* b) {
+            return a->last < b->last;
+        }
+
+        /* Add a segment that's been written, in order */
+        void add(segment<D>* s) {
+            pthread_rwlock_wrlock(&lock);
+            open.insert(std::upper_bound(open.begin(), open.end(), s, older),
+                s);
+            pthread_rwlock_unlock(&lock);
+        }
+
+        /* Open up every existing segment. A merge that was cut short can
+         * leave behind segments that are also in the merged one, and those
+         * are removed */
+        void load() {
+            boost::filesystem::directory_iterator it(directory);
+            boost::filesystem::directory_iterator it_end;
+            for (; it != it_end; ++it) {
+                std::stringstream ss(it->path().filename().string());
+                uint64_t first, last;
+                char dash;
+                if (!(ss >> first >> dash >> last) || dash != '-' ||
+                    !ss.eof()) {
+                    /* Partially-written segments */
+                    boost::filesystem::remove(it->path());
+                    continue;
+                }
+
+                segment<D>* s = new segment<D>(it->path().string(), first,
+                    last);
+                if (!s->valid()) {
+                    delete s;
+                    continue;
+                }
+                open.push_back(s);
+                next = std::max(next, last + 1);
+            }
+
+            /* Widest first, so that covered segments come after */
+            std::sort(open.begin(), open.end(), wider);
+            std::vector<segment<D>*> kept;
+            typename std::vector<segment<D>*>::iterator s(open.begin());
+            for (; s != open.end(); ++s) {
+                bool covered = false;
+                typename std::vector<segment<D>*>::iterator k(kept.begin());
+                for (; k != kept.end() && !covered; ++k) {
+                    covered = (*k)->first <= (*s)->first &&
+                        (*s)->last <= (*k)->last;
+                }
+                if (covered) {
+                    boost::filesystem::remove((*s)->path);
+                    delete *s;
+                } else {
+                    kept.push_back(*s);
+                }
+            }
+            std::sort(kept.begin(), kept.end(), older);
+            open.swap(kept);
+        }
+
+        /* Orders segments by how many dumps they hold, most first */
+        static bool wider(const segment<D>* a, const segment<D>* b) {
+            return (a->last - a->first) > (b->last - b->first);
+        }
+
+        /* Queue up a merge, unless one already is */
+        void schedule() {
+            pthread_rwlock_wrlock(&lock);
+            bool queue = !scheduled;
+            scheduled = true;
+            pthread_rwlock_unlock(&lock);
+            if (queue) {
+                compactor.submit(compact, this);
+            }
+        }
+
+        /* Merge runs of segments until there are none left to merge */
+        static void compact(void* self) {
+            segments* s = static_cast<segments*>(self);
+            while (true) {
+                pthread_mutex_lock(&s->rewriting);
+                pthread_rwlock_wrlock(&s->lock);
+                std::vector<segment<D>*> run(s->pick());
+                timestamp_type now = s->horizon;
+                if (run.empty()) {
+                    s->scheduled = false;
+                }
+                pthread_rwlock_unlock(&s->lock);
+
+                bool merged = !run.empty() && s->merge(run, now);
+                pthread_mutex_unlock(&s->rewriting);
+                if (run.empty()) {
+                    break;
+                } else if (!merged) {
+                    /* Leave them be until the next dump tries again */
+                    pthread_rwlock_wrlock(&s->lock);
+                    s->scheduled = false;
+                    pthread_rwlock_unlock(&s->lock);
+                    break;
+                }
+            }
+        }
+
+        /* The earliest time a metric's data points are kept from, as of a
+         * time, or 0 if they're all kept */
+        timestamp_type cutoff(const key_type& name, timestamp_type now) const {
+            const policy* p = match(policies, name);
+            if (p == NULL || p->retention == 0 || p->retention > now) {
+                return 0;
+            }
+            return now - p->retention;
+        }
+
+        /* Remove a segment if all of its data points have expired, or
+         * rewrite it without them if most of them have. Called with
+         * `rewriting` held
+         *
+         * @returns whether it was removed or rewritten */
+        bool expire(segment<D>* s, timestamp_type now) {
+            typedef typename segment<D>::entry entry;
+            const std::vector<entry>& m(s->metrics());
+            uint64_t total = 0, expired = 0;
+            typename std::vector<entry>::const_iterator e(m.begin());
+            for (; e != m.end(); ++e) {
+                total += e->count;
+                expired += (e->max_time < cutoff(e->name, now)) ? e->count : 0;
+            }
+            if (expired == 0 || expired * 2 < total) {
+                return false;
+            }
+
+            segment<D>* kept = NULL;
+            if (expired < total) {
+                typename segment<D>::writer out(s->path, durable);
+                for (e = m.begin(); e != m.end(); ++e) {
+                    values_type points;
+                    s->read(*e, points);
+                    trim(e->name, now, points);
+                    out.add(e->name, points);
+                }
+                if (out.finish() != 0) {
+                    return false;
+                }
+                kept = new segment<D>(s->path, s->first, s->last);
+            } else {
+                boost::filesystem::remove(s->path);
+            }
+
+            pthread_rwlock_wrlock(&lock);
+            typename std::vector<segment<D>*>::iterator it(std::find(
+                open.begin(), open.end(), s));
+            if (kept) {
+                *it = kept;
+            } else {
+                open.erase(it);
+            }
+            pthread_rwlock_unlock(&lock);
+            delete s;
+            return true;
+        }
+
+        /* Leave out a metric's sorted points that have expired as of a time */
+        void trim(const key_type& name, timestamp_type now,
+            values_type& points) const {
+            timestamp_type from = cutoff(name, now);
+            typename values_type::iterator it(points.begin());
+            for (; it != points.end() && it->time < from; ++it) {}
+            points.erase(points.begin(), it);
+        }
+
+        /* Find the oldest run of `fanout` adjacent segments that each span
+         * as many dumps, and aren't too big to merge. Called with the lock
+         * held */
+        std::vector<segment<D>*> pick() const {
+            std::vector<segment<D>*> run;
+            for (size_t i = 0; i + fanout <= open.size(); ++i) {
+                uint64_t span  = open[i]->last - open[i]->first;
+                uint64_t bytes = 0;
+                size_t   j     = i;
+                for (; j < i + fanout; ++j) {
+                    bytes += open[j]->size;
+                    if (open[j]->last - open[j]->first != span ||
+                        (j > i && open[j]->first != open[j - 1]->last + 1)) {
+                        break;
+                    }
+                }
+                if (j == i + fanout && bytes <= max_merge) {
+                    run.assign(open.begin() + i, open.begin() + i + fanout);
+                    break;
+                }
+            }
+            return run;
+        }
+
+        /* Merge a run of adjacent segments into one, leaving out what's
+         * expired. They're only read here, and `rewriting` keeps anything
+         * else from removing them, so the lock needn't be held until it's
+         * time to swap in the merged segment
+         *
+         * @param run -- the segments to merge
+         * @param now -- the time to expire data points as of
+         * @returns whether the merge succeeded */
+        bool merge(const std::vector<segment<D>*>& run, timestamp_type now) {
+            uint64_t first = run.front()->first;
+            uint64_t last  = run.back()->last;
+            typename segment<D>::writer out(path(first, last), durable);
+
+            /* Walk every segment's index at once, in order of name */
+            typedef typename segment<D>::entry entry;
+            std::vector<size_t> positions(run.size(), 0);
+            while (true) {
+                const key_type* name = NULL;
+                for (size_t i = 0; i < run.size(); ++i) {
+                    const std::vector<entry>& m(run[i]->metrics());
+                    if (positions[i] < m.size() &&
+                        (name == NULL || m[positions[i]].name < *name)) {
+                        name = &m[positions[i]].name;
+                    }
+                }
+                if (name == NULL) {
+                    break;
+                }
+
+                /* Older segments first, so that points with the same
+                 * timestamp stay in the order they were inserted */
+                key_type current(*name);
+                values_type points;
+                for (size_t i = 0; i < run.size(); ++i) {
+                    const std::vector<entry>& m(run[i]->metrics());
+                    if (positions[i] < m.size() &&
+                        m[positions[i]].name == current) {
+                        run[i]->read(m[positions[i]++], points);
+                    }
+                }
+                std::stable_sort(points.begin(), points.end());
+                trim(current, now, points);
+                out.add(current, points);
+            }
+            if (out.finish() != 0) {
+                return false;
+            }
+
+            segment<D>* merged = new segment<D>(path(first, last), first,
+                last);
+            pthread_rwlock_wrlock(&lock);
+            typename std::vector<segment<D>*>::iterator it(std::find(
+                open.begin(), open.end(), run.front()));
+            it = open.erase(it, it + run.size());
+            open.insert(it, merged);
+            pthread_rwlock_unlock(&lock);
+
+            typename std::vector<segment<D>*>::const_iterator s(run.begin());
+            for (; s != run.end(); ++s) {
+                boost::filesystem::remove((*s)->path);
+                delete *s;
+            }
+            return true;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,742 @@
+#ifndef MADB__SHARD_H
+#define MADB__SHARD_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+/* C includes */
+#include <time.h>
+#include <pthread.h>
+
+/* Internal imports */
+#include "pool.h"
+#include "slab.h"
+#include "cache.h"
+#include "cursor.h"
+#include "buffer.h"
+#include "recent.h"
+#include "traits.h"
+#include "alarm.h"
+#include "stale.h"
+#include "subscribe.h"
+#include "segment.h"
+
+namespace madb {
+    /* A shard is everything that a hashed metric name maps to: the buffer
+     * that's currently accepting inserts, and any full buffers that have been
+     * sealed off and are waiting to be dumped out to their slabs.
+     *
+     * Rotating only swaps in a fresh buffer, and the full one is handed off
+     * to the flush pool. Until it's been dumped, gets continue to read from
+     * it. Dumps of a shard are serialized with one another (they write to the
+     * same slabs), and exclude gets for that shard so that a get never sees a
+     * buffer's points both in the buffer and in the slabs. */
+    template <typename D>
+    class shard {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+        typedef typename traits::values_map_type values_map_type;
+        typedef typename traits::record_type     record_type;
+
+        /* Told about each slab that's rotated out */
+        typedef typename slab<D>::rotate_cb_type rotate_cb_type;
+
+        /* Maps each metric name this shard has resolved to its id */
+        typedef std::tr1::unordered_map<key_type, uint32_t> ids_type;
+
+        /* The id of a name that can't be resolved */
+        static const uint32_t unresolved = 0xFFFFFFFF;
+
+        /* Seconds to wait before trying a failed dump again, if nothing
+         * rotates before then */
+        static const uint32_t retry_seconds = 1;
+
+        /* Constructor
+         *
+         * @param base -- base path of the database
+         * @param index -- which of the database's shards this is
+         * @param count -- how many shards the database has
+         * @param flushers -- pool to dump full buffers on
+         * @param cache_size -- how many slabs to keep open for dumps
+         * @param compress -- whether slabs compress as they're rotated
+         * @param on_rotate -- callback for each slab rotated out, if any
+         * @param data -- user data to pass to the callback
+         * @param known -- catalog to add new metrics to, if any
+         * @param store -- segments to read from as well as slabs, if any
+         * @param hot -- how many recent points to keep in memory, if any
+         * @param watchers -- subscriptions to tell about inserts, if any
+         * @param stale -- timers for metrics going stale, if any
+         * @param alerts -- alarms to check inserts against, if any
+         * @param durable -- whether new buffers and dumps are synced
+         * @param uring -- whether dumps and reads go through io_uring, if
+         *      it's available
+         * @param packed -- whether dumps go to the segments instead of
+         *      slabs */
+        shard(const std::string& base, uint32_t index, uint32_t count,
+            pool* flushers, size_t cache_size, bool compress,
+            rotate_cb_type on_rotate=NULL, void* data=NULL,
+            catalog* known=NULL, segments<D>* store=NULL,
+            memtable* hot=NULL, subscriptions<D>* watchers=NULL,
+            staleness<D>* stale=NULL, alarms<D>* alerts=NULL,
+            bool durable=false, bool uring=false, bool packed=false):
+            base(base), index(index), count(count), durable(durable),
+            uring(uring), packed(packed && store), flushers(flushers),
+            active(new buffer<D>()), sealed(), retries(0), retry_at(0),
+            cache(base, cache_size, compress, on_rotate, data, known,
+                durable, uring),
+            store(store), hot(hot), windows(), watchers(watchers), marks(),
+            stale(stale), timers(), alerts(alerts), armed(), ids(), names() {
+            pthread_mutex_init(&lock, NULL);
+
+            /* Dumps must not be starved by a steady stream of gets */
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr,
+                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            pthread_rwlock_init(&dumping, &attr);
+            pthread_rwlockattr_destroy(&attr);
+
+            active->mktemp(base, index, count, durable);
+        }
+
+        /* Destructor
+         *
+         * The flush pool must have been drained first. Our active buffer is
+         * left on disk, to be recovered the next time the database opens */
+        ~shard() {
+            typename std::deque<buffer<D>*>::iterator it(sealed.begin());
+            for (; it != sealed.end(); ++it) {
+                delete *it;
+            }
+            delete active;
+
+            typename std::vector<window<D>*>::iterator w(windows.begin());
+            for (; w != windows.end(); ++w) {
+                if (*w) {
+                    hot->release((*w)->bytes());
+                    delete *w;
+                }
+            }
+
+            pthread_rwlock_destroy(&dumping);
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Take on a buffer that this shard left behind, ahead of any that
+         * are sealed from now on. Gets read from it until it's been dumped,
+         * by one call to flush() for each buffer recovered
+         *
+         * @param path -- path of the buffer file */
+        void recover(const std::string& path) {
+            buffer<D>* leftover = new buffer<D>(path, base);
+            pthread_mutex_lock(&lock);
+            sealed.push_back(leftover);
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* Dump the oldest sealed buffer of a shard. One of these is submitted
+         * for every buffer that's sealed or recovered, and they always dump
+         * in order */
+        static void flush(void* self) {
+            shard* s = static_cast<shard*>(self);
+
+            pthread_rwlock_wrlock(&s->dumping);
+            while (true) {
+                pthread_mutex_lock(&s->lock);
+                buffer<D>* full = s->sealed.front();
+                pthread_mutex_unlock(&s->lock);
+
+                int result = s->packed ? full->dump(*s->store) :
+                    full->dump(s->cache);
+
+                /* A buffer that couldn't be dumped stays where it is, for
+                 * gets to read, and the next flush tries it again before the
+                 * one it was called for. If nothing rotates in the meantime,
+                 * the next insert after `retry_seconds` submits one */
+                pthread_mutex_lock(&s->lock);
+                bool again = false;
+                if (result != 0) {
+                    ++s->retries;
+                    s->retry_at = time(NULL) + retry_seconds;
+                } else {
+                    s->sealed.pop_front();
+                    again = (s->retries > 0);
+                    s->retries -= again ? 1 : 0;
+                }
+                pthread_mutex_unlock(&s->lock);
+
+                if (result == 0) {
+                    delete full;
+                }
+                if (!again) {
+                    break;
+                }
+            }
+            pthread_rwlock_unlock(&s->dumping);
+        }
+
+        /* Insert a data point, rotating out the active buffer if need be
+         *
+         * @param name -- name of the metric
+         * @param time -- timestamp for the data point
+         * @param value -- data point to insert
+         * @returns 0 on success, else -1 */
+        int insert(const key_type& name, timestamp_type time,
+            const value_type& value) {
+            if (!buffer<D>::fits(name)) {
+                return -1;
+            }
+
+            pthread_mutex_lock(&lock);
+            retry();
+            while (active->full(name)) {
+                if (rotate() != 0) {
+                    pthread_mutex_unlock(&lock);
+                    return -1;
+                }
+            }
+            int result = 0;
+            if (tracking()) {
+                uint32_t id = intern(name);
+                result = active->insert(id, name, time, value);
+                observe(id, time, value);
+            } else {
+                result = active->insert(name, time, value);
+            }
+            pthread_mutex_unlock(&lock);
+            return result;
+        }
+
+        /* Insert a data point for a metric that's been resolved
+         *
+         * @param id -- id of the metric within this shard
+         * @returns 0 on success, else -1 if the id isn't one of ours */
+        int insert(uint32_t id, timestamp_type time, const value_type& value) {
+            pthread_mutex_lock(&lock);
+            if (id >= names.size()) {
+                pthread_mutex_unlock(&lock);
+                return -1;
+            }
+            retry();
+            const key_type& name(names[id]);
+            while (active->full(name)) {
+                if (rotate() != 0) {
+                    pthread_mutex_unlock(&lock);
+                    return -1;
+                }
+            }
+            int result = active->insert(id, name, time, value);
+            observe(id, time, value);
+            pthread_mutex_unlock(&lock);
+            return result;
+        }
+
+        /* Get the id for a metric name, assigning it one if need be. Ids are
+         * good for as long as the shard is around
+         *
+         * @param name -- name of the metric
+         * @returns the metric's id within this shard, or `unresolved` if its
+         *      name is too long to ever insert */
+        uint32_t resolve(const key_type& name) {
+            if (!buffer<D>::fits(name)) {
+                return unresolved;
+            }
+            pthread_mutex_lock(&lock);
+            uint32_t id = intern(name);
+            pthread_mutex_unlock(&lock);
+            return id;
+        }
+
+        /* Insert a batch of data points, taking our lock just once and only
+         * checking whether to rotate when the active buffer fills up
+         *
+         * @param first -- the first of the records to insert
+         * @param last -- one past the last of the records to insert
+         * @returns 0 on success, else -1 if some records were too large, or
+         *      a new buffer couldn't be made for the rest */
+        int insert(const record_type* const* first,
+            const record_type* const* last) {
+            int result = 0;
+            if (first == last) {
+                return result;
+            }
+
+            pthread_mutex_lock(&lock);
+            retry();
+            std::vector<uint32_t> interned;
+            if (tracking()) {
+                interned.resize(last - first);
+                for (size_t i = 0; i < interned.size(); ++i) {
+                    interned[i] = intern(first[i]->name);
+                }
+            }
+
+            const uint32_t* id = interned.empty() ? NULL : &interned[0];
+            while (first != last) {
+                size_t written = active->insert(first, last, id);
+                for (size_t i = 0; id && i < written; ++i) {
+                    observe(id[i], first[i]->time, first[i]->value);
+                }
+                first += written;
+                id    += id ? written : 0;
+                if (first == last) {
+                    break;
+                }
+
+                /* Whatever's next didn't fit. Either it never will, or we
+                 * need a fresh buffer */
+                if (!buffer<D>::fits((*first)->name)) {
+                    result = -1;
+                    ++first;
+                    id += id ? 1 : 0;
+                } else if (rotate() != 0) {
+                    result = -1;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&lock);
+            return result;
+        }
+
+        /* Wait until everything inserted so far is on disk in its buffer.
+         * Dumps wait for this, so that no buffer is removed out from under it
+         *
+         * @returns 0 on success, else -1 */
+        int sync() {
+            pthread_rwlock_rdlock(&dumping);
+            pthread_mutex_lock(&lock);
+            std::vector<buffer<D>*> pending(sealed.begin(), sealed.end());
+            pending.push_back(active);
+            pthread_mutex_unlock(&lock);
+
+            /* Inserts carry on into the active buffer while we sync it, since
+             * it's only replaced, never deleted, without a dump */
+            int result = 0;
+            typename std::vector<buffer<D>*>::iterator it(pending.begin());
+            for (; it != pending.end(); ++it) {
+                if ((*it)->sync() != 0) {
+                    result = -1;
+                }
+            }
+            pthread_rwlock_unlock(&dumping);
+            return result;
+        }
+
+        /* Get data synchronously
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive */
+        values_type get(const key_type& name, timestamp_type start,
+            timestamp_type end) {
+            values_type results;
+            scan(name, start, end).drain(results);
+            return results;
+        }
+
+        /* Get a cursor over data in a range
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive */
+        cursor<D> scan(const key_type& name, timestamp_type start,
+            timestamp_type end) {
+            cursor<D> c(start, end, uring);
+            if (hot) {
+                bool hit = recall(name, start, end, c);
+                hot->count(hit);
+                if (hit) {
+                    return c;
+                }
+            }
+
+            pthread_rwlock_rdlock(&dumping);
+
+            /* Everything that's already been dumped */
+            if (store) {
+                store->scan(name, start, end, c);
+            }
+            slab<D>(base, name, true).scan(start, end, c);
+
+            /* And everything that's in flight */
+            values_type flight;
+            pthread_mutex_lock(&lock);
+            typename std::deque<buffer<D>*>::iterator it(sealed.begin());
+            for (; it != sealed.end(); ++it) {
+                (*it)->points(name, start, end, flight);
+            }
+            active->points(name, start, end, flight);
+            pthread_mutex_unlock(&lock);
+
+            pthread_rwlock_unlock(&dumping);
+
+            std::stable_sort(flight.begin(), flight.end());
+            c.add(flight);
+            return c;
+        }
+
+        /* Summarize one field of a metric's data points in a range, from
+         * the same places that scan() reads them
+         *
+         * @param name -- name of the metric
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param s -- what to add the data points to */
+        template <typename F>
+        void summarize(const key_type& name, timestamp_type start,
+            timestamp_type end, summarizer<D, F>& s) {
+            if (hot) {
+                cursor<D> c(start, end, uring);
+                bool hit = recall(name, start, end, c);
+                hot->count(hit);
+                if (hit) {
+                    values_type points;
+                    c.drain(points);
+                    s.sorted(points.empty() ? NULL : &points[0],
+                        points.size());
+                    return;
+                }
+            }
+
+            pthread_rwlock_rdlock(&dumping);
+
+            /* Everything that's already been dumped */
+            if (store) {
+                values_type points;
+                cursor<D> c(start, end, uring);
+                store->scan(name, start, end, c);
+                c.drain(points);
+                s.sorted(points.empty() ? NULL : &points[0], points.size());
+            }
+            slab<D>(base, name, true).summarize(start, end, s);
+
+            /* And everything that's in flight */
+            values_type flight;
+            pthread_mutex_lock(&lock);
+            typename std::deque<buffer<D>*>::iterator it(sealed.begin());
+            for (; it != sealed.end(); ++it) {
+                (*it)->points(name, start, end, flight);
+            }
+            active->points(name, start, end, flight);
+            pthread_mutex_unlock(&lock);
+
+            pthread_rwlock_unlock(&dumping);
+
+            if (!flight.empty()) {
+                s.points(&flight[0], flight.size(), start, end);
+            }
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        shard();
+        shard(const shard& other);
+        const shard& operator=(const shard& other);
+
+        /* A metric's alarms */
+        typedef typename alarms<D>::rules_type rules_type;
+
+        /* The generation of alarms a metric's rule set was compiled for, the
+         * rule set (or NULL if none apply), and which of them are going off */
+        typedef struct armed_type_ {
+            uint32_t          generation;
+            const rules_type* set;
+            uint64_t          firing;
+
+            armed_type_(): generation(0), set(NULL), firing(0) {}
+        } armed_type;
+
+        /* Members */
+        std::string              base;      /* Base path of the database */
+        uint32_t                 index;     /* Which shard this is */
+        uint32_t                 count;     /* How many shards there are */
+        bool                     durable;   /* Whether to sync buffers made
+                                             * and dumps written */
+        bool                     uring;     /* Whether to use io_uring */
+        bool                     packed;    /* Whether to dump to store */
+        pool*                    flushers;  /* Where buffers get dumped */
+        buffer<D>*               active;    /* Buffer accepting inserts */
+        std::deque<buffer<D>*>   sealed;    /* Full buffers, oldest first */
+        size_t                   retries;   /* How many of them are left
+                                             * from failed dumps */
+        time_t                   retry_at;  /* When to submit a flush for
+                                             * them, without a rotation */
+        slab_cache<D>            cache;     /* Open slabs, for dumps */
+        segments<D>*             store;     /* Segments, if any */
+        memtable*                hot;       /* Recent points' budget */
+        std::vector<window<D>*>  windows;   /* Recent points, by id */
+        subscriptions<D>*        watchers;  /* Told about inserts */
+        std::vector<uint64_t>    marks;     /* For each id, the generation
+                                             * of subscriptions it was last
+                                             * matched against, shifted up,
+                                             * and whether it matched */
+        staleness<D>*            stale;     /* Timers for going stale */
+        std::vector<uint64_t>    timers;    /* For each id, the generation
+                                             * of watches it was last
+                                             * tracked for, shifted up, and
+                                             * its first timer */
+        alarms<D>*               alerts;    /* Checked against inserts */
+        std::vector<armed_type>  armed;     /* Each id's rule set */
+        pthread_mutex_t          lock;      /* Guards active and sealed */
+        pthread_rwlock_t         dumping;   /* Held exclusively by dumps */
+        ids_type                 ids;       /* Id of each metric name */
+        std::deque<key_type>     names;     /* Metric name for each id. A
+                                             * deque, so that references
+                                             * survive our lock being dropped
+                                             * in rotate() */
+
+        /* Whether inserts need their metric's id, for anything that keeps
+         * track of each metric. If not, names needn't be interned, and those
+         * only ever inserted by name never are */
+        bool tracking() const {
+            return hot || (watchers && watchers->any()) ||
+                (stale && stale->any()) || (alerts && alerts->any());
+        }
+
+        /* Get the id for a metric name, with our lock held */
+        uint32_t intern(const key_type& name) {
+            std::pair<typename ids_type::iterator, bool> found(
+                ids.insert(std::make_pair(name, names.size())));
+            if (found.second) {
+                names.push_back(name);
+            }
+            return found.first->second;
+        }
+
+        /* Note a data point that's been inserted, with our lock held */
+        void observe(uint32_t id, timestamp_type time,
+            const value_type& value) {
+            remember(id, time, value);
+            publish(id, time, value);
+            touch(id);
+            alert(id, time, value);
+        }
+
+        /* Keep a data point in its metric's window, with our lock held */
+        void remember(uint32_t id, timestamp_type time,
+            const value_type& value) {
+            if (hot == NULL) {
+                return;
+            }
+
+            if (id >= windows.size()) {
+                windows.resize(id + 1, NULL);
+            }
+            if (windows[id] == NULL) {
+                /* A metric there's no room for gets an empty window */
+                uint64_t bytes = static_cast<uint64_t>(hot->points) *
+                    sizeof(data_type);
+                windows[id] = new window<D>(hot->reserve(bytes) ?
+                    hot->points : 0, hot->seconds);
+            }
+
+            data_type datum;
+            datum.time  = time;
+            datum.value = value;
+            windows[id]->add(datum);
+        }
+
+        /* Tell any subscriptions about a data point, with our lock held */
+        void publish(uint32_t id, timestamp_type time,
+            const value_type& value) {
+            if (watchers == NULL || !watchers->any()) {
+                return;
+            }
+
+            uint64_t generation = watchers->generation();
+            if (id >= marks.size()) {
+                marks.resize(id + 1, 0);
+            }
+            if ((marks[id] >> 1) != generation) {
+                marks[id] = (generation << 1) | watchers->matches(names[id]);
+            }
+            if (marks[id] & 1) {
+                data_type datum;
+                datum.time  = time;
+                datum.value = value;
+                watchers->updated(names[id], datum);
+            }
+        }
+
+        /* Note that a metric's fresh, for any watches on it going stale, with
+         * our lock held */
+        void touch(uint32_t id) {
+            if (stale == NULL || !stale->any()) {
+                return;
+            }
+
+            uint64_t generation = stale->generation();
+            if (id >= timers.size()) {
+                timers.resize(id + 1, staleness<D>::none);
+            }
+            if ((timers[id] >> 32) != generation) {
+                timers[id] = (generation << 32) | stale->track(names[id],
+                    static_cast<uint32_t>(timers[id]));
+            }
+            if (static_cast<uint32_t>(timers[id]) != staleness<D>::none) {
+                stale->touch(static_cast<uint32_t>(timers[id]));
+            }
+        }
+
+        /* Check a data point against its metric's alarms, with our lock
+         * held. This doesn't allocate, except the first time the metric's
+         * inserted into after the alarms change */
+        void alert(uint32_t id, timestamp_type time, const value_type& value) {
+            if (alerts == NULL || !alerts->any()) {
+                return;
+            }
+
+            uint32_t generation = alerts->generation();
+            if (id >= armed.size()) {
+                armed.resize(id + 1);
+            }
+            armed_type& a(armed[id]);
+            if (a.generation != generation) {
+                /* Alarms that were already going off stay that way */
+                const rules_type* set = alerts->compile(names[id]);
+                uint64_t firing = 0;
+                for (size_t i = 0; set && a.set && i < set->size(); ++i) {
+                    for (size_t j = 0; j < a.set->size(); ++j) {
+                        if ((*a.set)[j].id == (*set)[i].id &&
+                            (a.firing >> j & 1)) {
+                            firing |= static_cast<uint64_t>(1) << i;
+                        }
+                    }
+                }
+                if (a.set) {
+                    alerts->release(a.set);
+                }
+                a.generation = generation;
+                a.set        = set;
+                a.firing     = firing;
+            }
+            if (a.set) {
+                data_type datum;
+                datum.time  = time;
+                datum.value = value;
+                alerts->check(*a.set, &names[id], datum, a.firing);
+            }
+        }
+
+        /* Answer a get from a metric's window, if it covers the range
+         *
+         * @returns whether it did */
+        bool recall(const key_type& name, timestamp_type start,
+            timestamp_type end, cursor<D>& c) {
+            pthread_mutex_lock(&lock);
+            typename ids_type::const_iterator found(ids.find(name));
+            window<D>* w = (found == ids.end() ||
+                found->second >= windows.size()) ? NULL :
+                windows[found->second];
+            if (w && !w->trusted() && start >= w->bottom()) {
+                pthread_mutex_unlock(&lock);
+                check(name, w);
+                pthread_mutex_lock(&lock);
+            }
+
+            bool hit = (w && w->covers(start));
+            values_type points;
+            if (hit) {
+                w->get(start, end, points);
+            }
+            pthread_mutex_unlock(&lock);
+
+            if (hit) {
+                std::stable_sort(points.begin(), points.end());
+                c.add(points);
+            }
+            return hit;
+        }
+
+        /* Check a window against everything on disk and in our buffers from
+         * its floor on. This only happens once for each window */
+        void check(const key_type& name, window<D>* w) {
+            pthread_mutex_lock(&lock);
+            timestamp_type from = w->bottom();
+            pthread_mutex_unlock(&lock);
+
+            timestamp_type until = std::numeric_limits<timestamp_type>::max();
+            cursor<D> c(from, until, uring);
+            pthread_rwlock_rdlock(&dumping);
+            if (store) {
+                store->scan(name, from, until, c);
+            }
+            slab<D>(base, name, true).scan(from, until, c);
+
+            values_type found;
+            c.drain(found);
+            pthread_mutex_lock(&lock);
+            typename std::deque<buffer<D>*>::iterator it(sealed.begin());
+            for (; it != sealed.end(); ++it) {
+                (*it)->points(name, from, until, found);
+            }
+            active->points(name, from, until, found);
+            std::sort(found.begin(), found.end());
+            w->check(from, found);
+            pthread_mutex_unlock(&lock);
+            pthread_rwlock_unlock(&dumping);
+        }
+
+        /* Seal off the active buffer and hand it to the flush pool. Called
+         * with our lock held, which is dropped while handing off so that a
+         * full flush queue doesn't keep the flush workers out of the shard.
+         * If a new buffer can't be made, the active one stays as it is
+         *
+         * @returns 0 on success, else -1 */
+        int rotate() {
+            buffer<D>* fresh = new buffer<D>();
+            if (fresh->mktemp(base, index, count, durable) != 0) {
+                delete fresh;
+                return -1;
+            }
+
+            /* One that never opened has nothing to dump */
+            if (!active->is_open()) {
+                delete active;
+                active = fresh;
+                return 0;
+            }
+            sealed.push_back(active);
+            active = fresh;
+
+            pthread_mutex_unlock(&lock);
+            flushers->submit(flush, this);
+            pthread_mutex_lock(&lock);
+            return 0;
+        }
+
+        /* Hand a dump that failed back to the flush pool once it's waited
+         * long enough, rather than leaving it until the next rotation. Called
+         * with our lock held, which is dropped while handing off */
+        void retry() {
+            if (retries == 0 || time(NULL) < retry_at) {
+                return;
+            }
+
+            /* The flush takes over the failed one's turn */
+            --retries;
+            retry_at = time(NULL) + retry_seconds;
+            pthread_mutex_unlock(&lock);
+            flushers->submit(flush, this);
+            pthread_mutex_lock(&lock);
+        }
+    };
+
+    template <typename D>
+    const uint32_t shard<D>::unresolved;
+
+    template <typename D>
+    const uint32_t shard<D>::retry_seconds;
+}
+
+#endif
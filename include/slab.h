@@ -1,13 +1,27 @@
 #ifndef MADB__SLAB_H
 #define MADB__SLAB_H
 
+#include <map>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <algorithm>
 
+/* C includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /* Internal imports */
+#include "io.h"
+#include "cursor.h"
 #include "traits.h"
+#include "columns.h"
+#include "gorilla.h"
+#include "summary.h"
 
 /* I am somewhat loathe to do this, but alas, I must */
 #include <boost/filesystem.hpp>
@@ -19,13 +33,15 @@ namespace madb {
         /* Each slab should only grow to this size before it's rotated out */
         static const int32_t max_size = 1 * 1024 * 1024;
 
-        /* To mode with which we open files */
-        static const typename std::fstream::openmode open_mode =
-            static_cast<std::fstream::openmode>(
-                static_cast<int>(std::fstream::binary) |
-                static_cast<int>(std::fstream::out)    |
-                static_cast<int>(std::fstream::app)    |
-                static_cast<int>(std::fstream::in));
+        /* Rotated slabs that have been compressed have this suffix */
+        static const char* compressed_suffix() {
+            return ".g";
+        }
+
+        /* Rotated slabs that are stored by column have this suffix */
+        static const char* columnar_suffix() {
+            return ".c";
+        }
 
         /* Our traits */
         typedef data_traits<D> traits;
@@ -43,6 +59,18 @@ namespace madb {
         typedef typename traits::read_cb_type    read_cb_type;
         typedef typename traits::get_cb_type     get_cb_type;
 
+        /* Called with the metric's name and the new slab's timestamp each
+         * time a slab is rotated out */
+        typedef void(* rotate_cb_type)(const key_type&, timestamp_type, void*);
+
+        /* Rotated slabs, by the timestamp they're named for, with paths */
+        typedef std::vector<std::pair<timestamp_type, std::string> >
+            files_type;
+
+        /* The earliest data point in each rotated slab, by the timestamp the
+         * slab is named for */
+        typedef std::map<timestamp_type, timestamp_type> ranges_type;
+
         /* This is a one-off functor for filtering results */
         struct range_filter {
             timestamp_type start;
@@ -62,29 +90,69 @@ namespace madb {
          * @param base -- base path for storing the database
          * @param name -- name of the metric */
         slab(const std::string& base, const std::string& name):
-            base(base), name(name), stream() {
+            base(base), name(name), fd(-1), pending(), written(0),
+            compress(false), durable(false), unsynced(false), uring(false),
+            on_rotate(NULL), on_rotate_data(NULL) {
             /* First, we have to make sure that directory we're going to be
              * writing to exists, and then open a stream to it for reading and
              * writing */
             boost::filesystem::create_directories(directory());
-            stream.open(latest_path().c_str(), open_mode);
+        }
+
+        /* Constructor
+         *
+         * @param base -- base path for storing the database
+         * @param name -- name of the metric
+         * @param exists -- whether the metric's directory is known to exist
+         *      already (or we only mean to read), in which case we needn't
+         *      check
+         * @param compress -- whether to compress slabs as they're rotated
+         * @param durable -- whether what's written must be synced to disk
+         *      before it's destroyed, and rotated slabs synced before they're
+         *      moved into place
+         * @param uring -- whether writes go through io_uring, if it's
+         *      available */
+        slab(const std::string& base, const std::string& name, bool exists,
+            bool compress=false, bool durable=false, bool uring=false):
+            base(base), name(name), fd(-1), pending(), written(0),
+            compress(compress), durable(durable), unsynced(false),
+            uring(uring), on_rotate(NULL), on_rotate_data(NULL) {
+            if (!exists) {
+                boost::filesystem::create_directories(directory());
+            }
         }
 
         ~slab() {
-            stream.close();
+            flush();
+            if (durable) {
+                sync();
+            }
+            close();
         }
 
         /* Write a data point to the file
          *
          * @param datum -- piece of data to write out */
         int insert(const data_type& datum) {
-            stream.write(reinterpret_cast<char*>(const_cast<data_type*>(&datum)), sizeof(data_type));
+            /* The latest slab is only opened once we write to it, and writes
+             * to it are held until we're flushed */
+            if (fd < 0) {
+                open();
+            }
+            pending.push_back(datum);
             /* Increment written, check if we need to rotate to new slab */
             written += sizeof(data_type);
             if (written < max_size) {
                 return 0;
             }
-            return rotate();
+
+            /* Once it's written out, a slab that can't be rotated out keeps
+             * its points as the latest, and the next insert tries again */
+            if (flush() != 0) {
+                return -1;
+            }
+            rotate();
+            return 0;
         }
 
         /* Write a data point to the file
@@ -103,42 +171,208 @@ namespace madb {
         /* Insert a whole range of values into the slab
          *
          * @param start -- beginning of range
-         * @param end -- end of range */
+         * @param end -- end of range
+         * @returns 0 on success, else -1 if a rotation's write failed, which
+         *      drops whatever hadn't been written yet */
         int insert(typename values_type::iterator start,
             typename values_type::iterator end) {
             typename values_type::iterator it(start);
             for (; it != end; ++it) {
-                insert(*it);
+                if (insert(*it) != 0) {
+                    return -1;
+                }
             }
             return 0;
         }
 
+        /* Push anything we've buffered out to the latest slab, so that
+         * other readers can see it
+         *
+         * @returns 0 on success, else -1 */
+        int flush() {
+            std::vector<io::op> ops;
+            if (flush(ops)) {
+                io::local(uring).run(ops);
+                return flushed(ops.front());
+            }
+            return 0;
+        }
+
+        /* Queue up a write of anything we've buffered, so that it can be run
+         * along with other slabs' writes. Nothing more may be inserted until
+         * it's been run and passed to flushed()
+         *
+         * @param ops -- where to add the write
+         * @returns whether there was anything to write */
+        bool flush(std::vector<io::op>& ops) {
+            if (pending.empty()) {
+                return false;
+            }
+            size_t size = pending.size() * sizeof(data_type);
+            ops.push_back(io::write(fd, &pending[0], size, written - size));
+            return true;
+        }
+
+        /* Finish up after a write queued by flush(ops) has been run. If it
+         * failed or came up short, what was pending is dropped, and the
+         * latest slab is cut back to what it held before
+         *
+         * @param o -- the write
+         * @returns 0 on success, else -1 */
+        int flushed(const io::op& o) {
+            int result = 0;
+            if (o.result < 0 || static_cast<size_t>(o.result) != o.len) {
+                errno = (o.result < 0) ? -o.result : EIO;
+                perror("Failed to write slab");
+                written -= o.len;
+                if (ftruncate(fd, written) != 0) {
+                    perror("Failed to truncate slab");
+                }
+                result = -1;
+            }
+            values_type().swap(pending);
+            unsynced = true;
+            return result;
+        }
+
+        /* Sync everything written since the last sync out to disk: the
+         * latest slab, and the directory that slabs are made and renamed in
+         *
+         * @returns 0 on success, else -1 */
+        int sync() {
+            if (!unsynced) {
+                return 0;
+            }
+            int result = 0;
+            if (fd >= 0 && fdatasync(fd) != 0) {
+                perror("Failed to sync slab");
+                result = -1;
+            }
+            if (io::sync(directory()) != 0) {
+                result = -1;
+            }
+            unsynced = (result != 0);
+            return result;
+        }
+
+        /* Have a callback invoked every time this slab rotates
+         *
+         * @param cb -- the callback, or NULL for none
+         * @param data -- user data to pass to the callback */
+        void notify(rotate_cb_type cb, void* data) {
+            on_rotate      = cb;
+            on_rotate_data = data;
+        }
+
         /* Get data synchronously
          *
          * @param start -- beginning of the range, inclusive
          * @param end -- end of the range, inclusive */
         values_type get(timestamp_type start, timestamp_type end) {
+            values_type results;
+            cursor<D> c(start, end);
+            scan(start, end, c);
+            c.drain(results);
+            return results;
+        }
+
+        /* Add everything in a range to a cursor
+         *
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param c -- the cursor to add sources to */
+        void scan(timestamp_type start, timestamp_type end, cursor<D>& c) {
             /* First thing we have to do is to iterate through the directory
              * to try to find all the slabs within it, and read any that fit
              * in the time range */
-            std::vector<timestamp_type> slabs_(slabs());
+            files_type files_(files());
+
+            /* Each of the slabs. Everything in a slab comes before its name,
+             * so any slab named for `start` or earlier can be skipped without
+             * even opening it, and so can those named after `end` that begin
+             * after it. In the rest, we find where the range begins, or for
+             * compressed slabs, let the cursor skip blocks. Columnar slabs
+             * only have their timestamps searched */
+            ranges_type earliest;
+            bool        loaded = false;
+            typename files_type::iterator it(files_.begin());
+            for (; it != files_.end(); ++it) {
+                if (it->first <= start ||
+                    beyond(it->first, end, earliest, loaded)) {
+                    continue;
+                } else if (compressed(it->second)) {
+                    c.add(it->second, 0, true);
+                } else if (columnar(it->second)) {
+                    c.add_columns(it->second,
+                        columns<D>::seek(it->second, start));
+                } else {
+                    c.add(it->second, seek(it->second, start));
+                }
+            }
 
-            /* Aggregate all of our results */
-            values_type results(read());
+            /* And then the latest slab, which may be in any order */
+            values_type latest;
+            read(latest_path(), latest);
+            latest.erase(std::remove_if(latest.begin(), latest.end(),
+                range_filter(start, end)), latest.end());
+            std::stable_sort(latest.begin(), latest.end());
+            c.add(latest);
+        }
 
-            /* And now each of the slabs */
-            typename std::vector<timestamp_type>::iterator it(slabs_.begin());
-            for (; it != slabs_.end(); ++it) {
-                values_type tmp(read(timestamp_path(*it)));
-                results.insert(results.end(), tmp.begin(), tmp.end());
+        /* Summarize one field of the data points in a range, straight from
+         * slabs mapped into memory, without putting the points together.
+         * Slabs are skipped just as scan() skips them. Columnar slabs only
+         * have their timestamps and that field's column read, with vector
+         * kernels, and those that the range covers entirely, neither. The
+         * fast path needs the columnar layout: plain slabs are read a data
+         * point at a time, and compressed slabs are decoded, since neither
+         * keeps totals of its own
+         *
+         * @param start -- beginning of the range, inclusive
+         * @param end -- end of the range, inclusive
+         * @param s -- what to add the data points to */
+        template <typename F>
+        void summarize(timestamp_type start, timestamp_type end,
+            summarizer<D, F>& s) {
+            files_type  files_(files());
+            ranges_type earliest;
+            bool        loaded = false;
+            typename files_type::iterator it(files_.begin());
+            for (; it != files_.end(); ++it) {
+                if (it->first <= start ||
+                    beyond(it->first, end, earliest, loaded)) {
+                    continue;
+                } else if (compressed(it->second)) {
+                    values_type points;
+                    cursor<D> c(start, end);
+                    c.add(it->second, 0, true);
+                    c.drain(points);
+                    s.sorted(points.empty() ? NULL : &points[0],
+                        points.size());
+                } else if (columnar(it->second)) {
+                    summarize_columns(it->second, start, end, s);
+                } else {
+                    mapping m(it->second);
+                    const data_type* first =
+                        reinterpret_cast<const data_type*>(m.data);
+                    const data_type* last = first +
+                        m.size / sizeof(data_type);
+                    data_type probe;
+                    memset(&probe, 0, sizeof(data_type));
+                    probe.time = start;
+                    first = std::lower_bound(first, last, probe);
+                    probe.time = end;
+                    last = std::upper_bound(first, last, probe);
+                    s.sorted(first, last - first);
+                }
             }
 
-            std::remove_if(
-                results.begin(), results.end(), range_filter(start, end));
-
-            std::sort(results.begin(), results.end());
-            
-            return results;
+            /* And then the latest slab, which may be in any order */
+            values_type latest;
+            read(latest_path(), latest);
+            if (!latest.empty()) {
+                s.points(&latest[0], latest.size(), start, end);
+            }
         }
 
         /* Get data asynchronously
@@ -149,7 +383,7 @@ namespace madb {
          * @param data -- user data to pass to the callback */
         void get(timestamp_type start, timestamp_type end, get_cb_type cb,
             void* data) {
-            cb(get(name, start, end), data);
+            cb(get(start, end), data);
         }
 
         /* Get the path associated with this metric */
@@ -167,6 +401,44 @@ namespace madb {
             return p.string();
         }
 
+        /* Get the path to the record of where each rotated slab begins */
+        std::string ranges_path() const {
+            boost::filesystem::path p(directory());
+            p /= "ranges";
+            return p.string();
+        }
+
+        /* Read where each rotated slab begins. Slabs rotated out before
+         * this was recorded, or whose record was lost in a crash, aren't
+         * there. If a slab's name was used more than once, the earliest of
+         * them is kept */
+        ranges_type ranges() const {
+            ranges_type results;
+            int fd = ::open(ranges_path().c_str(), O_RDONLY);
+            if (fd < 0) {
+                return results;
+            }
+
+            std::vector<timestamp_type> pairs;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                pairs.resize(st.st_size / sizeof(timestamp_type));
+                ssize_t count = pread(fd, &pairs[0],
+                    pairs.size() * sizeof(timestamp_type), 0);
+                pairs.resize((count > 0) ? count / sizeof(timestamp_type) : 0);
+            }
+            ::close(fd);
+
+            for (size_t i = 0; i + 1 < pairs.size(); i += 2) {
+                std::pair<typename ranges_type::iterator, bool> added(
+                    results.insert(std::make_pair(pairs[i], pairs[i + 1])));
+                if (!added.second && pairs[i + 1] < added.first->second) {
+                    added.first->second = pairs[i + 1];
+                }
+            }
+            return results;
+        }
+
         /* Get the path for a particular timestamp */
         std::string timestamp_path(timestamp_type time) const {
             boost::filesystem::path p(directory());
@@ -179,6 +451,17 @@ namespace madb {
         /* Get a sorted vector of the slabs inside this */
         std::vector<timestamp_type> slabs() const {
             std::vector<timestamp_type> results;
+            files_type files_(files());
+            typename files_type::iterator it(files_.begin());
+            for (; it != files_.end(); ++it) {
+                results.push_back(it->first);
+            }
+            return results;
+        }
+
+        /* Get the rotated slabs inside this, sorted by timestamp */
+        files_type files() const {
+            files_type results;
 
             boost::filesystem::path dir(directory());
             if (!boost::filesystem::is_directory(dir)) {
@@ -199,12 +482,66 @@ namespace madb {
                 /* If it's a real file... */
                 std::stringstream ss(it->path().filename().string());
                 timestamp_type time;
-                ss >> time;
-                results.push_back(time);
+                if (ss >> time) {
+                    results.push_back(std::make_pair(time,
+                        it->path().string()));
+                }
             }
 
+            std::sort(results.begin(), results.end());
             return results;
         }
+
+        /* Rename the rotated slabs from when they were named for their
+         * latest data point, rather than one past it. Only plain slabs are
+         * that old. Each is checked against its data points, and those
+         * already named one past them are left alone, so this can be run
+         * again if it's interrupted
+         *
+         * @returns how many were renamed */
+        size_t renumber() const {
+            size_t renamed = 0;
+            files_type files_(files());
+            typename files_type::reverse_iterator it(files_.rbegin());
+            for (; it != files_.rend(); ++it) {
+                if (compressed(it->second) || columnar(it->second)) {
+                    continue;
+                }
+
+                values_type all;
+                read(it->second, all);
+                if (all.empty()) {
+                    continue;
+                }
+
+                /* Going from the latest down, the name one past it has
+                 * already been moved out of the way, if it was taken */
+                timestamp_type latest(
+                    std::max_element(all.begin(), all.end())->time);
+                if (it->first != latest || latest + 1 < latest) {
+                    continue;
+                }
+                std::string target(timestamp_path(latest + 1));
+                if (boost::filesystem::exists(target) ||
+                    ::rename(it->second.c_str(), target.c_str()) != 0) {
+                    std::cout << "Failed to rename slab " << it->second
+                              << std::endl;
+                    continue;
+                }
+                ++renamed;
+            }
+            return renamed;
+        }
+
+        /* Whether a rotated slab's path is that of a compressed slab */
+        static bool compressed(const std::string& path) {
+            return suffixed(path, compressed_suffix());
+        }
+
+        /* Whether a rotated slab's path is that of a columnar slab */
+        static bool columnar(const std::string& path) {
+            return suffixed(path, columnar_suffix());
+        }
     private:
         /* Private, unimplemented to avoid use */
         slab();
@@ -214,53 +551,314 @@ namespace madb {
         /* Members */
         std::string  base;      /* Base of the database */
         std::string  name;      /* Name of the metric */
-        std::fstream stream;    /* Stream to the latest slice */
+        int          fd;        /* Open on the latest slab, if need be */
+        values_type  pending;   /* Inserted, but not yet written out */
         int          written;   /* How many bytes have been written to the
-                                 * latest slab */
+                                 * latest slab, including those pending */
+        bool         compress;  /* Whether to compress rotated slabs */
+        bool         durable;   /* Whether to sync what's written */
+        bool         unsynced;  /* Whether anything's been written or
+                                 * rotated since the last sync */
+        bool         uring;     /* Whether to write through io_uring */
+        rotate_cb_type on_rotate;       /* Told about every rotation */
+        void*          on_rotate_data;  /* User data for on_rotate */
+
+        /* A file mapped into memory for reading, for as long as this is
+         * around. Files that can't be mapped look empty */
+        struct mapping {
+            const char* data;  /* The file's contents */
+            size_t      size;  /* How many bytes there are */
+
+            mapping(const std::string& path): data(NULL), size(0) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0) {
+                    return;
+                } else if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                        fd, 0);
+                    if (map != MAP_FAILED) {
+                        madvise(map, st.st_size, MADV_SEQUENTIAL);
+                        data = static_cast<const char*>(map);
+                        size = st.st_size;
+                    }
+                }
+                ::close(fd);
+            }
 
-        /* Read all the values in from the current slice */
-        values_type read() {
-            /* Storage, and a return type */
-            data_type datum;
-            values_type results;
+            ~mapping() {
+                if (data) {
+                    munmap(const_cast<char*>(data), size);
+                }
+            }
+        };
 
-            /* Seek to the beginning and prepare to read */
-            stream.seekg(0, std::fstream::beg);
+        /* Summarize one field of the data points in a range of a columnar
+         * slab. The field's totals are used if the range covers the whole
+         * slab, and otherwise its column is read, if it has one */
+        template <typename F>
+        void summarize_columns(const std::string& path, timestamp_type start,
+            timestamp_type end, summarizer<D, F>& s) {
+            typedef typename columns<D>::header header;
+            typedef typename columns<D>::totals totals;
+
+            mapping m(path);
+            header h;
+            if (!m.data || !columns<D>::open(m.data, m.size, h) || !h.count) {
+                return;
+            }
 
-            /* Lastly, read in the stream for the latest data points */
-            while (true) {
-                stream.read(reinterpret_cast<char*>(&datum), sizeof(datum));
-                if (!stream.eof()) {
-                    results.push_back(datum);
-                } else {
-                    break;
+            /* Where the range begins and ends */
+            const timestamp_type* times =
+                reinterpret_cast<const timestamp_type*>(
+                    m.data + columns<D>::where(h, 0));
+            size_t lo = std::lower_bound(times, times + h.count, start) -
+                times;
+            size_t hi = std::upper_bound(times + lo, times + h.count, end) -
+                times;
+            if (lo >= hi) {
+                return;
+            }
+
+            data_type first, last;
+            columns<D>::row(m.data, h, lo, first);
+            columns<D>::row(m.data, h, hi - 1, last);
+            size_t field = columns<D>::find(s.which());
+            if (field == columns<D>::fields().size()) {
+                /* Not one of the columns, so it has to be put together */
+                values_type points(hi - lo);
+                for (size_t i = lo; i < hi; ++i) {
+                    columns<D>::row(m.data, h, i, points[i - lo]);
                 }
+                s.sorted(&points[0], points.size());
+                return;
             }
 
-            return results;
+            const totals* t = columns<D>::summary(m.data, h, field);
+            if (t && lo == 0 && hi == h.count) {
+                s.summarized(h.count, t->sum, t->min, t->max, first, last);
+            } else {
+                const F* column = reinterpret_cast<const F*>(
+                    m.data + columns<D>::where(h, field + 1));
+                s.packed(column + lo, hi - lo, first, last);
+            }
         }
 
-        /* Read all the values from a provided path */
-        values_type read(const std::string& path) {
-            /* Storage, and a return type */
-            data_type datum;
-            values_type results;
-            std::fstream stream_(path.c_str(), open_mode);
+        /* Whether a rotated slab can be skipped for a range ending at `end`,
+         * because it's named after it and known to begin after it, too.
+         * Where slabs begin is only read the first time it's needed
+         *
+         * @param bound -- the timestamp the slab is named for
+         * @param end -- end of the range, inclusive
+         * @param earliest -- where each slab begins, once loaded
+         * @param loaded -- whether it's been loaded */
+        bool beyond(timestamp_type bound, timestamp_type end,
+            ranges_type& earliest, bool& loaded) const {
+            if (bound <= end) {
+                return false;
+            }
+            if (!loaded) {
+                earliest = ranges();
+                loaded   = true;
+            }
+            typename ranges_type::const_iterator found(earliest.find(bound));
+            return found != earliest.end() && found->second > end;
+        }
+
+        /* Record where a slab that's just been rotated out begins. Once
+         * there are many more records than slabs, from slabs that have been
+         * pruned since, only those of the slabs still around are kept
+         *
+         * @param bound -- the timestamp the slab is named for
+         * @param first -- its earliest data point */
+        void record(timestamp_type bound, timestamp_type first) {
+            timestamp_type pair[2] = {bound, first};
+            int out = ::open(ranges_path().c_str(),
+                O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (out < 0) {
+                perror("Failed to open slab ranges");
+                return;
+            }
+            struct stat st;
+            bool ok = ::write(out, pair, sizeof(pair)) == sizeof(pair) &&
+                (!durable || fdatasync(out) == 0) && fstat(out, &st) == 0;
+            ::close(out);
+            if (!ok) {
+                perror("Failed to record slab range");
+                return;
+            }
+
+            size_t records = st.st_size / sizeof(pair);
+            if (records < 64) {
+                return;
+            }
+            files_type files_(files());
+            if (records < 2 * files_.size() + 64) {
+                return;
+            }
+
+            ranges_type earliest(ranges());
+            std::vector<timestamp_type> kept;
+            typename files_type::iterator it(files_.begin());
+            for (; it != files_.end(); ++it) {
+                typename ranges_type::iterator found(earliest.find(it->first));
+                if (found != earliest.end()) {
+                    kept.push_back(found->first);
+                    kept.push_back(found->second);
+                }
+            }
+
+            std::string temp(ranges_path() + ".tmp");
+            out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0) {
+                return;
+            }
+            size_t size = kept.size() * sizeof(timestamp_type);
+            ok = (size == 0 || ::write(out, &kept[0], size) ==
+                static_cast<ssize_t>(size)) &&
+                (!durable || fdatasync(out) == 0);
+            ::close(out);
+            if (!ok || ::rename(temp.c_str(), ranges_path().c_str()) != 0) {
+                ::unlink(temp.c_str());
+            }
+        }
+
+        /* Whether a path ends with a suffix */
+        static bool suffixed(const std::string& path, const char* ending) {
+            std::string suffix(ending);
+            return path.length() > suffix.length() && path.compare(
+                path.length() - suffix.length(), suffix.length(), suffix) == 0;
+        }
+
+        /* Open up the latest slab, and pick up how much is already in it */
+        void open() {
+            fd = ::open(latest_path().c_str(), O_RDWR | O_CREAT, 0644);
+            struct stat st;
+            if (fd < 0) {
+                perror("Failed to open slab");
+                written = 0;
+            } else if (fstat(fd, &st) == 0) {
+                written = static_cast<int>(st.st_size -
+                    st.st_size % sizeof(data_type));
+            }
+        }
+
+        /* Close the latest slab */
+        void close() {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
 
-            /* Seek to the beginning and prepare to read */
-            stream_.seekg(0, std::fstream::beg);
+        /* Read all the values from a provided path, without creating it
+         *
+         * @param path -- path of the slab
+         * @param results -- where to append the data points */
+        void read(const std::string& path, values_type& results) const {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                size_t points = st.st_size / sizeof(data_type);
+                size_t size   = results.size();
+                results.resize(size + points);
+                ssize_t count = (points == 0) ? 0 : pread(fd, &results[size],
+                    points * sizeof(data_type), 0);
+                results.resize(size + ((count > 0) ?
+                    count / sizeof(data_type) : 0));
+            }
+            ::close(fd);
+        }
+
+        /* Find where a range begins in a rotated slab, which is sorted, by
+         * binary searching for the first data point at or after the start
+         *
+         * @param path -- path of the slab
+         * @param start -- beginning of the range, inclusive
+         * @returns the byte offset of the first data point in the range */
+        off_t seek(const std::string& path, timestamp_type start) const {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return 0;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                ::close(fd);
+                return 0;
+            }
 
-            /* Lastly, read in the stream for the latest data points */
-            while (true) {
-                stream_.read(reinterpret_cast<char*>(&datum), sizeof(datum));
-                if (!stream_.eof()) {
-                    results.push_back(datum);
+            /* Find the first data point at or after the start */
+            data_type datum;
+            off_t lo = 0;
+            off_t hi = st.st_size / sizeof(data_type);
+            while (lo < hi) {
+                off_t mid = lo + (hi - lo) / 2;
+                if (pread(fd, &datum, sizeof(data_type),
+                    mid * sizeof(data_type)) != sizeof(data_type)) {
+                    hi = mid;
+                } else if (datum.time < start) {
+                    lo = mid + 1;
                 } else {
-                    break;
+                    hi = mid;
                 }
             }
 
-            return results;
+            ::close(fd);
+            return lo * sizeof(data_type);
+        }
+
+        /* Write out a rotated slab in place of the latest one. It's written
+         * alongside first and then renamed, so a crash never leaves a
+         * partial slab behind. If anything fails, the latest slab is kept
+         *
+         * @param data -- contents of the rotated slab
+         * @param size -- how many bytes of contents there are
+         * @param target -- path of the rotated slab
+         * @returns 0 on success, else -1 */
+        int replace(const char* data, size_t size,
+            const std::string& target) {
+            boost::filesystem::path rotating(directory());
+            rotating /= ".rotating";
+            int out = ::open(rotating.string().c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0) {
+                perror("Failed to open rotating slab");
+                return -1;
+            }
+
+            bool ok = pwrite(out, data, size, 0) ==
+                static_cast<ssize_t>(size);
+            if (!ok) {
+                perror("Failed to write rotating slab");
+            } else if (durable && fdatasync(out) != 0) {
+                perror("Failed to sync rotating slab");
+                ok = false;
+            }
+            if (::close(out) != 0) {
+                perror("Failed to close rotating slab");
+                ok = false;
+            }
+            if (!ok || ::rename(rotating.string().c_str(),
+                target.c_str()) != 0) {
+                if (ok) {
+                    perror("Failed to rename rotating slab");
+                }
+                ::unlink(rotating.string().c_str());
+                return -1;
+            }
+
+            boost::system::error_code ec;
+            boost::filesystem::remove(latest_path(), ec);
+            if (ec) {
+                std::cout << "Failed to remove " << latest_path() << ": "
+                    << ec.message() << std::endl;
+            }
+            return 0;
         }
 
         /* Rotate out the current buffer file for a new one
@@ -270,20 +868,68 @@ namespace madb {
             /* For the full implementation, we actually need to see what the
              * latest slab's max timestamp was, and anything that should be in
              * another slab should be moved to the appropriate one. */
-            values_type all(read());
+            if (flush() != 0) {
+                return -1;
+            }
+            values_type all;
+            read(latest_path(), all);
             data_type maximum(*std::max_element(all.begin(), all.end()));
 
-            stream.flush();
-            stream.close();
+            /* Slabs are named for the first timestamp after all of their data
+             * points, so everything in them comes before their name */
+            timestamp_type bound = maximum.time + 1;
+            if (bound < maximum.time) {
+                bound = maximum.time;
+            }
 
-            boost::filesystem::rename(
-                latest_path(), timestamp_path(maximum.time));
-            std::cout << "Rotating slab to " << timestamp_path(maximum.time) << std::endl;
+            if (durable && fdatasync(fd) != 0) {
+                perror("Failed to sync slab");
+                return -1;
+            }
+            close();
+            unsynced = true;
+
+            /* Rotated slabs are sorted, so that reads can binary search. The
+             * data points almost always arrive in order anyway, and then this
+             * is just a rename, unless they're compressed or stored by column
+             * (compression wins, if both) */
+            bool sorted = std::is_sorted(all.begin(), all.end());
+            if (!sorted) {
+                std::stable_sort(all.begin(), all.end());
+            }
 
-            stream.open(latest_path().c_str(), open_mode);
+            std::string target(timestamp_path(bound));
+            int result = 0;
+            if (compress) {
+                std::vector<char> blocks;
+                gorilla<D>::encode(&all[0], all.size(), blocks);
+                target += compressed_suffix();
+                result = replace(&blocks[0], blocks.size(), target);
+            } else if (columns<D>::enabled()) {
+                std::vector<char> columnar;
+                columns<D>::encode(&all[0], all.size(), columnar);
+                target += columnar_suffix();
+                result = replace(&columnar[0], columnar.size(), target);
+            } else if (!sorted) {
+                result = replace(reinterpret_cast<const char*>(&all[0]),
+                    all.size() * sizeof(data_type), target);
+            } else if (::rename(latest_path().c_str(), target.c_str()) != 0) {
+                perror("Failed to rename slab");
+                result = -1;
+            }
 
-            written = 0;
-            
+            /* A slab that couldn't be rotated out is still the latest, and
+             * the next insert tries again */
+            open();
+            if (result != 0) {
+                return result;
+            }
+            std::cout << "Rotating slab to " << target << std::endl;
+            record(bound, all.front().time);
+
+            if (on_rotate) {
+                on_rotate(name, bound, on_rotate_data);
+            }
             return 0;
         }
     };
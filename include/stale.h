@@ -0,0 +1,474 @@
+#ifndef MADB__STALE_H
+#define MADB__STALE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <tr1/unordered_map>
+
+/* C includes */
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Internal imports */
+#include "notify.h"
+#include "traits.h"
+
+namespace madb {
+    /* Tells when metrics go without a new data point for some number of
+     * seconds, for as many metrics as there are.
+     *
+     * Each metric that a watch's pattern matches gets a timer, the first
+     * time it's inserted into. Timers live in a hierarchical timer wheel
+     * (256 one-second slots, and then three levels of 64 slots, each slot
+     * as long as the whole level below it), which a background thread turns
+     * once a second. Inserts never touch the wheel: they only note the time
+     * in each of their metric's timers. When a timer comes due, the wheel
+     * checks that time, and either moves the timer to when it's now due, or
+     * tells the watch that the metric's gone stale and takes the timer off
+     * the wheel until the metric's next insert puts it back.
+     *
+     * Each timer takes 32 bytes, and each metric with any timers has its
+     * name kept once, with a hash table entry. Timeouts may be at most about
+     * two years. This is thread-safe, but a metric's timers must only be
+     * touched with its shard's lock held */
+    template <typename D>
+    class staleness: public notifier {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type       key_type;
+        typedef typename traits::stale_cb_type  stale_cb_type;
+
+        /* Means "no timer" */
+        static const uint32_t none = 0xFFFFFFFF;
+
+        /* Constructor */
+        staleness(): notifier(1000), watches(), next_watch(1), metrics(),
+            names(), chunk_count(0), free(none), current(0), now(0), due(),
+            batches() {
+            for (uint32_t i = 0; i < slot_count; ++i) {
+                slots[i] = none;
+            }
+            gettimeofday(&epoch, NULL);
+        }
+
+        /* Destructor */
+        ~staleness() {
+            stop();
+            for (uint32_t i = 0; i < chunk_count; ++i) {
+                delete[] chunks[i];
+            }
+        }
+
+        /* Watch for matching metrics going stale
+         *
+         * @param pattern -- which metrics, as with fnmatch(3)
+         * @param seconds -- how long without a data point makes them stale
+         * @param cb -- invoked with batches of names of stale metrics
+         * @param data -- user data to pass to the callback
+         * @returns an id for unwatching */
+        uint32_t watch(const key_type& pattern, uint32_t seconds,
+            stale_cb_type cb, void* data) {
+            pthread_mutex_lock(&lock);
+            uint32_t id = next_watch++;
+            watcher& w(watches[id]);
+            w.pattern = pattern;
+            w.seconds = std::max<uint32_t>(1,
+                std::min<uint32_t>(seconds, longest));
+            w.cb      = cb;
+            w.data    = data;
+            changed(watches.size());
+            pthread_mutex_unlock(&lock);
+            return id;
+        }
+
+        /* Stop watching. Once this returns, the callback won't be invoked
+         * again, so it mustn't be called from a callback
+         *
+         * @param id -- from watch() */
+        void unwatch(uint32_t id) {
+            pthread_mutex_lock(&delivering);
+            pthread_mutex_lock(&lock);
+            watches.erase(id);
+            changed(watches.size());
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_unlock(&delivering);
+        }
+
+        /* Give a metric a timer for each watch that matches it, dropping
+         * those for watches that are gone
+         *
+         * @param name -- name of the metric
+         * @param first -- its first timer, or none
+         * @returns its first timer now, or none */
+        uint32_t track(const key_type& name, uint32_t first) {
+            pthread_mutex_lock(&lock);
+
+            /* Keep the timers whose watches are still around */
+            std::vector<uint32_t> kept;
+            for (uint32_t t = first; t != none; ) {
+                uint32_t sibling = at(t).sibling;
+                if (watches.count(at(t).watch)) {
+                    kept.push_back(t);
+                } else {
+                    release(t);
+                }
+                t = sibling;
+            }
+
+            /* And add any for new watches */
+            typename watch_map::const_iterator w(watches.begin());
+            for (; w != watches.end(); ++w) {
+                bool found = false;
+                for (size_t i = 0; i < kept.size() && !found; ++i) {
+                    found = (at(kept[i]).watch == w->first);
+                }
+                if (!found && w->second.matches(name)) {
+                    uint32_t t = acquire(intern(name), w->first,
+                        w->second.seconds);
+                    if (t != none) {
+                        kept.push_back(t);
+                    }
+                }
+            }
+
+            uint32_t head = none;
+            for (size_t i = kept.size(); i > 0; --i) {
+                at(kept[i - 1]).sibling = head;
+                head = kept[i - 1];
+            }
+            pthread_mutex_unlock(&lock);
+            return head;
+        }
+
+        /* Note that a metric's just had a data point, putting any of its
+         * timers that went off back on the wheel
+         *
+         * @param first -- its first timer */
+        void touch(uint32_t first) {
+            uint32_t seen = __atomic_load_n(&now, __ATOMIC_RELAXED);
+            for (uint32_t t = first; t != none; t = at(t).sibling) {
+                timer& tm(at(t));
+                if (__atomic_load_n(&tm.seen, __ATOMIC_RELAXED) != seen) {
+                    __atomic_store_n(&tm.seen, seen, __ATOMIC_SEQ_CST);
+                }
+                if (__atomic_load_n(&tm.idle, __ATOMIC_SEQ_CST)) {
+                    pthread_mutex_lock(&lock);
+                    rearm(t);
+                    pthread_mutex_unlock(&lock);
+                }
+            }
+        }
+
+        /* Turn the wheel forward to some number of seconds after it was
+         * made, telling the watches about any metrics that went stale. This
+         * is what our thread does every second
+         *
+         * @param until -- seconds since the wheel was made */
+        void advance(uint32_t until) {
+            pthread_mutex_lock(&delivering);
+            pthread_mutex_lock(&lock);
+            turn(until);
+            pthread_mutex_unlock(&lock);
+            hand_out();
+            pthread_mutex_unlock(&delivering);
+        }
+
+        /* Seconds since the wheel was made, by the wheel's clock */
+        uint32_t seconds() const {
+            return __atomic_load_n(&now, __ATOMIC_RELAXED);
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        staleness(const staleness& other);
+        const staleness& operator=(const staleness& other);
+
+        /* The wheel: 256 slots of one second, then three levels of 64 */
+        static const uint32_t inner_bits = 8;
+        static const uint32_t outer_bits = 6;
+        static const uint32_t levels     = 4;
+        static const uint32_t slot_count = (1 << inner_bits) +
+            (levels - 1) * (1 << outer_bits);
+
+        /* The longest timeout, which fits within the outermost level */
+        static const uint32_t longest = (1U << (inner_bits +
+            (levels - 1) * outer_bits)) - 1;
+
+        /* Timers are allocated in chunks that never move, so inserts can
+         * find them without our lock. That's room for 2^28 of them */
+        static const uint32_t chunk_bits = 16;
+        static const uint32_t chunk_size = 1 << chunk_bits;
+        static const uint32_t max_chunks = 4096;
+
+        /* A pattern, how long is too long for it, and who to tell */
+        typedef struct watcher_ {
+            key_type      pattern;
+            uint32_t      seconds;
+            stale_cb_type cb;
+            void*         data;
+
+            bool matches(const key_type& name) const {
+                return fnmatch(pattern.c_str(), name.c_str(), 0) == 0;
+            }
+        } watcher;
+
+        typedef std::map<uint32_t, watcher> watch_map;
+
+        /* The metrics that went stale for each watch */
+        typedef std::map<uint32_t, std::vector<key_type> > stale_map;
+
+        /* Each watch to tell, and what about */
+        typedef std::vector<std::pair<watcher, std::vector<key_type>*> >
+            batch_list;
+
+        /* One metric's timer for one watch */
+        typedef struct timer_ {
+            uint32_t next;      /* Next in the slot, or in the free list */
+            uint32_t prev;      /* Previous in the slot, or none */
+            uint32_t sibling;   /* The metric's next timer */
+            uint32_t seen;      /* When the metric last had a data point */
+            uint32_t deadline;  /* When the timer's due */
+            uint32_t watch;     /* Which watch it's for */
+            uint32_t metric;    /* Which metric it's for */
+            uint16_t slot;      /* Which slot it's in */
+            uint8_t  idle;      /* Whether it's off the wheel */
+            uint8_t  unused;
+        } timer;
+
+        /* Members */
+        watch_map                watches;     /* Everything being watched */
+        uint32_t                 next_watch;  /* Next watch's id */
+        std::tr1::unordered_map<key_type, uint32_t> metrics;  /* Metric ids */
+        std::vector<const key_type*> names;   /* Each metric's name */
+        timer*                   chunks[max_chunks];  /* Where timers are */
+        uint32_t                 chunk_count; /* How many are allocated */
+        uint32_t                 free;        /* Timers to reuse */
+        uint32_t                 slots[slot_count];  /* Each slot's first */
+        uint32_t                 current;     /* What the wheel's turned to */
+        uint32_t                 now;         /* The same, for inserts */
+        struct timeval           epoch;       /* When the wheel was made */
+        stale_map                due;         /* What's gone stale */
+        batch_list               batches;     /* Who to tell about it */
+
+        /* Find a timer */
+        timer& at(uint32_t t) const {
+            return chunks[t >> chunk_bits][t & (chunk_size - 1)];
+        }
+
+        /* Get the id for a metric's name, with our lock held */
+        uint32_t intern(const key_type& name) {
+            std::pair<typename std::tr1::unordered_map<key_type,
+                uint32_t>::iterator, bool> found(metrics.insert(
+                    std::make_pair(name, names.size())));
+            if (found.second) {
+                names.push_back(&found.first->first);
+            }
+            return found.first->second;
+        }
+
+        /* Make a new timer, and put it on the wheel
+         *
+         * @returns the timer, or none if there's no room */
+        uint32_t acquire(uint32_t metric, uint32_t watch, uint32_t seconds) {
+            uint32_t t = free;
+            if (t == none && chunk_count == max_chunks) {
+                return none;
+            } else if (t == none) {
+                t = chunk_count << chunk_bits;
+                chunks[chunk_count++] = new timer[chunk_size];
+                for (uint32_t i = chunk_size - 1; i > 0; --i) {
+                    at(t + i).next = free;
+                    free = t + i;
+                }
+            } else {
+                free = at(t).next;
+            }
+
+            timer& tm(at(t));
+            tm.sibling = none;
+            tm.seen    = current;
+            tm.watch   = watch;
+            tm.metric  = metric;
+            tm.idle    = 0;
+            schedule(t, current + seconds);
+            return t;
+        }
+
+        /* Take a timer off the wheel and free it */
+        void release(uint32_t t) {
+            if (!at(t).idle) {
+                unlink(t);
+            }
+            at(t).next = free;
+            free = t;
+        }
+
+        /* Put a timer that went off back on the wheel, if it hasn't been */
+        void rearm(uint32_t t) {
+            timer& tm(at(t));
+            typename watch_map::const_iterator w(watches.find(tm.watch));
+            if (tm.idle && w != watches.end()) {
+                tm.idle = 0;
+                schedule(t, tm.seen + w->second.seconds);
+            }
+        }
+
+        /* Put a timer in the slot for its deadline. Only timers cascading
+         * down may be due this very second, and they go in the slot that's
+         * about to be handled */
+        void schedule(uint32_t t, uint32_t deadline) {
+            timer& tm(at(t));
+            tm.deadline = deadline;
+            if (deadline < current) {
+                deadline = current;
+            }
+            uint32_t delta = deadline - current;
+
+            uint32_t slot;
+            if (delta < (1U << inner_bits)) {
+                slot = deadline & ((1 << inner_bits) - 1);
+            } else {
+                uint32_t level = 1;
+                while (level < levels - 1 && delta >=
+                    (1U << (inner_bits + level * outer_bits))) {
+                    ++level;
+                }
+                uint32_t shift = inner_bits + (level - 1) * outer_bits;
+                slot = (1 << inner_bits) + (level - 1) * (1 << outer_bits) +
+                    ((deadline >> shift) & ((1 << outer_bits) - 1));
+            }
+
+            tm.slot = slot;
+            tm.prev = none;
+            tm.next = slots[slot];
+            if (tm.next != none) {
+                at(tm.next).prev = t;
+            }
+            slots[slot] = t;
+        }
+
+        /* Take a timer out of its slot */
+        void unlink(uint32_t t) {
+            timer& tm(at(t));
+            if (tm.prev == none) {
+                slots[tm.slot] = tm.next;
+            } else {
+                at(tm.prev).next = tm.next;
+            }
+            if (tm.next != none) {
+                at(tm.next).prev = tm.prev;
+            }
+        }
+
+        /* Turn the wheel a second, cascading timers down from the outer
+         * levels as their slots come around, and handling those now due */
+        void tick(stale_map& stale) {
+            ++current;
+            uint32_t mask = (1 << inner_bits) - 1;
+            for (uint32_t level = 1; level < levels &&
+                (current & mask) == 0; ++level) {
+                uint32_t shift = inner_bits + (level - 1) * outer_bits;
+                uint32_t slot = (1 << inner_bits) +
+                    (level - 1) * (1 << outer_bits) +
+                    ((current >> shift) & ((1 << outer_bits) - 1));
+                cascade(slot);
+                mask = (1 << (shift + outer_bits)) - 1;
+            }
+
+            uint32_t t = slots[current & ((1 << inner_bits) - 1)];
+            slots[current & ((1 << inner_bits) - 1)] = none;
+            while (t != none) {
+                uint32_t next = at(t).next;
+                expire(t, stale);
+                t = next;
+            }
+        }
+
+        /* Move every timer in an outer slot to where it belongs now */
+        void cascade(uint32_t slot) {
+            uint32_t t = slots[slot];
+            slots[slot] = none;
+            while (t != none) {
+                uint32_t next = at(t).next;
+                schedule(t, at(t).deadline);
+                t = next;
+            }
+        }
+
+        /* A timer's come due. If its metric's had a data point since, it's
+         * due again later, and otherwise its metric is stale */
+        void expire(uint32_t t, stale_map& stale) {
+            timer& tm(at(t));
+            typename watch_map::const_iterator w(watches.find(tm.watch));
+            if (w == watches.end()) {
+                tm.idle = 1;
+                return;
+            }
+
+            uint32_t seen = __atomic_load_n(&tm.seen, __ATOMIC_SEQ_CST);
+            if (seen + w->second.seconds > current) {
+                schedule(t, seen + w->second.seconds);
+                return;
+            }
+
+            /* An insert that comes in now either sees that we're idle and
+             * puts us back, or we see what it noted, and do it ourselves */
+            __atomic_store_n(&tm.idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&tm.seen, __ATOMIC_SEQ_CST) != seen) {
+                rearm(t);
+                return;
+            }
+            stale[tm.watch].push_back(*names[tm.metric]);
+        }
+
+        /* Turn the wheel forward, with our lock held, and gather which
+         * watches to tell about what, for hand_out()
+         *
+         * @param until -- seconds since the wheel was made */
+        void turn(uint32_t until) {
+            due.clear();
+            while (current < until) {
+                tick(due);
+            }
+            __atomic_store_n(&now, current, __ATOMIC_RELAXED);
+
+            batches.clear();
+            typename stale_map::iterator it(due.begin());
+            for (; it != due.end(); ++it) {
+                typename watch_map::const_iterator w(watches.find(it->first));
+                if (w != watches.end()) {
+                    batches.push_back(std::make_pair(w->second, &it->second));
+                }
+            }
+        }
+
+        /* Nothing's ever queued: our thread turns the wheel every second */
+        bool pending() const {
+            return false;
+        }
+
+        /* Turn the wheel to now */
+        void take() {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            turn(tv.tv_sec - epoch.tv_sec - (tv.tv_usec < epoch.tv_usec ?
+                1 : 0));
+        }
+
+        /* Tell the watches what turn() found */
+        void hand_out() {
+            for (size_t i = 0; i < batches.size(); ++i) {
+                batches[i].first.cb(*batches[i].second,
+                    batches[i].first.data);
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef MADB__SUBSCRIBE_H
+#define MADB__SUBSCRIBE_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+/* C includes */
+#include <fnmatch.h>
+#include <pthread.h>
+
+/* Internal imports */
+#include "notify.h"
+#include "traits.h"
+
+namespace madb {
+    /* Callbacks for new data points in metrics, and for new metric names,
+     * each for the metrics whose names match a shell-style pattern.
+     *
+     * Inserts only ever check whether there are any subscriptions to updates
+     * at all, and then whether their metric's been matched against the
+     * current ones. Each shard remembers that for each of its metrics, so the
+     * patterns are only matched again when the subscriptions change. Matched
+     * data points are queued, and a background thread hands them out in
+     * batches, one for each metric. If the queue fills up because callbacks
+     * can't keep up, more are dropped and counted rather than holding up
+     * inserts.
+     *
+     * This is thread-safe */
+    template <typename D>
+    class subscriptions: public notifier {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::key_type        key_type;
+        typedef typename traits::data_type       data_type;
+        typedef typename traits::values_type     values_type;
+        typedef typename traits::update_cb_type  update_cb_type;
+        typedef typename traits::name_cb_type    name_cb_type;
+
+        /* Constructor
+         *
+         * @param queue_size -- most data points and names that may be
+         *      waiting to be handed out */
+        subscriptions(uint32_t queue_size): notifier(),
+            queue_size(queue_size), updates(), names(), queue(), next(1),
+            batch(), batch_updates(), batch_names() {}
+
+        /* Destructor */
+        ~subscriptions() {
+            stop();
+        }
+
+        /* Subscribe to the data points inserted into matching metrics
+         *
+         * @param pattern -- which metrics, as with fnmatch(3)
+         * @param cb -- invoked with batches of a metric's new data points
+         * @param data -- user data to pass to the callback
+         * @returns an id for unsubscribing */
+        uint32_t subscribe(const key_type& pattern, update_cb_type cb,
+            void* data) {
+            pthread_mutex_lock(&lock);
+            uint32_t id = next++;
+            updates[id] = subscriber<update_cb_type>(pattern, cb, data);
+            changed(updates.size());
+            pthread_mutex_unlock(&lock);
+            return id;
+        }
+
+        /* Subscribe to the names of new metrics
+         *
+         * @param pattern -- which metrics, as with fnmatch(3)
+         * @param cb -- invoked with each new metric's name
+         * @param data -- user data to pass to the callback
+         * @returns an id for unsubscribing */
+        uint32_t subscribe(const key_type& pattern, name_cb_type cb,
+            void* data) {
+            pthread_mutex_lock(&lock);
+            uint32_t id = next++;
+            names[id] = subscriber<name_cb_type>(pattern, cb, data);
+            changed(updates.size());
+            pthread_mutex_unlock(&lock);
+            return id;
+        }
+
+        /* Unsubscribe. Once this returns, the callback won't be invoked
+         * again, so it mustn't be called from a callback
+         *
+         * @param id -- from subscribe() */
+        void unsubscribe(uint32_t id) {
+            pthread_mutex_lock(&delivering);
+            pthread_mutex_lock(&lock);
+            updates.erase(id);
+            names.erase(id);
+            changed(updates.size());
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_unlock(&delivering);
+        }
+
+        /* Whether any subscription to updates matches a metric */
+        bool matches(const key_type& name) {
+            pthread_mutex_lock(&lock);
+            bool matched = false;
+            typename update_map::const_iterator it(updates.begin());
+            for (; it != updates.end() && !matched; ++it) {
+                matched = it->second.matches(name);
+            }
+            pthread_mutex_unlock(&lock);
+            return matched;
+        }
+
+        /* Queue up a data point inserted into a matching metric */
+        void updated(const key_type& name, const data_type& datum) {
+            event e;
+            e.name    = name;
+            e.created = false;
+            e.datum   = datum;
+            push(e);
+        }
+
+        /* Queue up the name of a new metric. This has the signature of a
+         * catalog's callback, for a catalog to call directly */
+        static void created(const std::string& name, void* self) {
+            subscriptions* s = static_cast<subscriptions*>(self);
+            if (s->names_empty()) {
+                return;
+            }
+
+            event e;
+            e.name    = name;
+            e.created = true;
+            s->push(e);
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        subscriptions();
+        subscriptions(const subscriptions& other);
+        const subscriptions& operator=(const subscriptions& other);
+
+        /* A pattern, and what to tell about the metrics that match it */
+        template <typename C>
+        struct subscriber {
+            key_type pattern;
+            C        cb;
+            void*    data;
+
+            subscriber(): pattern(), cb(NULL), data(NULL) {}
+            subscriber(const key_type& pattern, C cb, void* data):
+                pattern(pattern), cb(cb), data(data) {}
+
+            bool matches(const key_type& name) const {
+                return fnmatch(pattern.c_str(), name.c_str(), 0) == 0;
+            }
+        };
+
+        typedef std::map<uint32_t, subscriber<update_cb_type> > update_map;
+        typedef std::map<uint32_t, subscriber<name_cb_type> >   name_map;
+
+        /* A queued data point, or a new name */
+        typedef struct event_ {
+            key_type  name;
+            bool      created;
+            data_type datum;
+        } event;
+
+        /* Members */
+        uint32_t          queue_size;     /* Most events that may be queued */
+        update_map        updates;        /* Subscriptions to data points */
+        name_map          names;          /* Subscriptions to new names */
+        std::deque<event> queue;          /* Waiting to be handed out */
+        uint32_t          next;           /* Next subscription's id */
+        std::deque<event> batch;          /* Being handed out */
+        update_map        batch_updates;  /* Who to hand them to */
+        name_map          batch_names;    /* Likewise, for new names */
+
+        /* Whether there are no subscriptions to names */
+        bool names_empty() {
+            pthread_mutex_lock(&lock);
+            bool empty = names.empty();
+            pthread_mutex_unlock(&lock);
+            return empty;
+        }
+
+        /* Queue up an event, unless there's no room or no one to tell */
+        void push(const event& e) {
+            pthread_mutex_lock(&lock);
+            if (!started) {
+                /* Nothing will hand it out */
+            } else if (queue.size() >= queue_size) {
+                ++dropped;
+            } else {
+                queue.push_back(e);
+                if (queue.size() == 1) {
+                    pthread_cond_signal(&ready);
+                }
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        /* Whether any events are queued, with our lock held */
+        bool pending() const {
+            return !queue.empty();
+        }
+
+        /* Take the queued events, and who to hand them to */
+        void take() {
+            batch.clear();
+            batch.swap(queue);
+            batch_updates = updates;
+            batch_names   = names;
+        }
+
+        /* Hand out what take() took */
+        void hand_out() {
+            deliver(batch, batch_updates, batch_names);
+        }
+
+        /* Hand out a batch of events: each metric's data points together,
+         * in the order they were inserted, to each matching subscription */
+        void deliver(const std::deque<event>& batch, const update_map& updates,
+            const name_map& names) {
+            std::vector<key_type> order;
+            std::map<key_type, values_type> points;
+            typename std::deque<event>::const_iterator it(batch.begin());
+            for (; it != batch.end(); ++it) {
+                if (it->created) {
+                    typename name_map::const_iterator n(names.begin());
+                    for (; n != names.end(); ++n) {
+                        if (n->second.matches(it->name)) {
+                            n->second.cb(it->name, n->second.data);
+                        }
+                    }
+                    continue;
+                }
+
+                values_type& values(points[it->name]);
+                if (values.empty()) {
+                    order.push_back(it->name);
+                }
+                values.push_back(it->datum);
+            }
+
+            typename std::vector<key_type>::const_iterator name(order.begin());
+            for (; name != order.end(); ++name) {
+                const values_type& values(points[*name]);
+                typename update_map::const_iterator u(updates.begin());
+                for (; u != updates.end(); ++u) {
+                    if (u->second.matches(*name)) {
+                        u->second.cb(*name, values, u->second.data);
+                    }
+                }
+            }
+        }
+    };
+}
+
+#endif
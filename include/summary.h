@@ -0,0 +1,379 @@
+#ifndef MADB__SUMMARY_H
+#define MADB__SUMMARY_H
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Internal imports */
+#include "traits.h"
+#include "columns.h"
+
+namespace madb {
+    /* Which parts of a summary are wanted. The count and the first and last
+     * data points come along with any of them, but the sum, minimum and
+     * maximum need every value in the range to be read */
+    enum summary_op {
+        summary_count = 1,
+        summary_sum   = 2,
+        summary_min   = 4,
+        summary_max   = 8,
+        summary_first = 16,
+        summary_last  = 32,
+        summary_all   = 63
+    };
+
+    /* One field of a metric's data points, summarized over a range */
+    template <typename D>
+    struct summary {
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::data_type data_type;
+
+        uint64_t  count;  /* How many data points there were */
+        double    sum;    /* Of the field */
+        double    min;    /* Of the field, or HUGE_VAL with none */
+        double    max;    /* Of the field, or -HUGE_VAL with none */
+        data_type first;  /* The earliest data point, whole */
+        data_type last;   /* The latest data point, whole */
+
+        summary(): count(0), sum(0), min(HUGE_VAL), max(-HUGE_VAL) {
+            memset(&first, 0, sizeof(data_type));
+            memset(&last, 0, sizeof(data_type));
+        }
+
+        /* The field's average, or 0 with no data points */
+        double mean() const {
+            return count ? sum / count : 0;
+        }
+    };
+
+    /* Sums, minimums and maximums of runs of values. Runs of floats and
+     * doubles that are packed together, like the columns of columnar slabs,
+     * are read with SSE2, or AVX2 where the processor has it. Everything
+     * else is read a value at a time */
+    namespace kernels {
+        /* What a run of values comes to */
+        typedef struct totals_ {
+            double sum;
+            double min;
+            double max;
+
+            totals_(): sum(0), min(HUGE_VAL), max(-HUGE_VAL) {}
+        } totals;
+
+        /* Values of any type, any distance apart
+         *
+         * @param ptr -- the first value
+         * @param stride -- bytes from one value to the next
+         * @param count -- how many values there are
+         * @param t -- what to add them to */
+        template <typename F>
+        inline void strided(const char* ptr, size_t stride, size_t count,
+            totals& t) {
+            for (size_t i = 0; i < count; ++i, ptr += stride) {
+                F raw;
+                memcpy(&raw, ptr, sizeof(F));
+                double value = static_cast<double>(raw);
+                t.sum += value;
+                t.min  = (value < t.min) ? value : t.min;
+                t.max  = (value > t.max) ? value : t.max;
+            }
+        }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MADB_HAVE_VECTOR_KERNELS 1
+        /* Fold the lanes of vector registers into totals */
+        inline void fold(const double* sums, size_t lanes, const float* mins,
+            const float* maxes, size_t width, totals& t) {
+            for (size_t i = 0; i < lanes; ++i) {
+                t.sum += sums[i];
+            }
+            for (size_t i = 0; i < width; ++i) {
+                t.min = (mins[i] < t.min) ? mins[i] : t.min;
+                t.max = (maxes[i] > t.max) ? maxes[i] : t.max;
+            }
+        }
+
+        /* Four floats at a time. Sums are kept as doubles */
+        inline void sse2(const float* values, size_t count, totals& t) {
+            __m128  lo = _mm_set1_ps(HUGE_VALF);
+            __m128  hi = _mm_set1_ps(-HUGE_VALF);
+            __m128d s0 = _mm_setzero_pd();
+            __m128d s1 = _mm_setzero_pd();
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m128 v = _mm_loadu_ps(values + i);
+                lo = _mm_min_ps(lo, v);
+                hi = _mm_max_ps(hi, v);
+                s0 = _mm_add_pd(s0, _mm_cvtps_pd(v));
+                s1 = _mm_add_pd(s1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+            }
+
+            float  mins[4], maxes[4];
+            double sums[4];
+            _mm_storeu_ps(mins, lo);
+            _mm_storeu_ps(maxes, hi);
+            _mm_storeu_pd(sums, s0);
+            _mm_storeu_pd(sums + 2, s1);
+            fold(sums, 4, mins, maxes, 4, t);
+            strided<float>(reinterpret_cast<const char*>(values + i),
+                sizeof(float), count - i, t);
+        }
+
+        /* Eight floats at a time */
+        __attribute__((target("avx2")))
+        inline void avx2(const float* values, size_t count, totals& t) {
+            __m256  lo = _mm256_set1_ps(HUGE_VALF);
+            __m256  hi = _mm256_set1_ps(-HUGE_VALF);
+            __m256d s0 = _mm256_setzero_pd();
+            __m256d s1 = _mm256_setzero_pd();
+            size_t i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256 v = _mm256_loadu_ps(values + i);
+                lo = _mm256_min_ps(lo, v);
+                hi = _mm256_max_ps(hi, v);
+                s0 = _mm256_add_pd(s0,
+                    _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+                s1 = _mm256_add_pd(s1,
+                    _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+            }
+
+            float  mins[8], maxes[8];
+            double sums[8];
+            _mm256_storeu_ps(mins, lo);
+            _mm256_storeu_ps(maxes, hi);
+            _mm256_storeu_pd(sums, s0);
+            _mm256_storeu_pd(sums + 4, s1);
+            fold(sums, 8, mins, maxes, 8, t);
+            strided<float>(reinterpret_cast<const char*>(values + i),
+                sizeof(float), count - i, t);
+        }
+
+        /* Two doubles at a time */
+        inline void sse2(const double* values, size_t count, totals& t) {
+            __m128d lo = _mm_set1_pd(HUGE_VAL);
+            __m128d hi = _mm_set1_pd(-HUGE_VAL);
+            __m128d s  = _mm_setzero_pd();
+            size_t i = 0;
+            for (; i + 2 <= count; i += 2) {
+                __m128d v = _mm_loadu_pd(values + i);
+                lo = _mm_min_pd(lo, v);
+                hi = _mm_max_pd(hi, v);
+                s  = _mm_add_pd(s, v);
+            }
+
+            double mins[2], maxes[2], sums[2];
+            _mm_storeu_pd(mins, lo);
+            _mm_storeu_pd(maxes, hi);
+            _mm_storeu_pd(sums, s);
+            for (size_t lane = 0; lane < 2; ++lane) {
+                t.sum += sums[lane];
+                t.min  = (mins[lane] < t.min) ? mins[lane] : t.min;
+                t.max  = (maxes[lane] > t.max) ? maxes[lane] : t.max;
+            }
+            strided<double>(reinterpret_cast<const char*>(values + i),
+                sizeof(double), count - i, t);
+        }
+
+        /* Four doubles at a time */
+        __attribute__((target("avx2")))
+        inline void avx2(const double* values, size_t count, totals& t) {
+            __m256d lo = _mm256_set1_pd(HUGE_VAL);
+            __m256d hi = _mm256_set1_pd(-HUGE_VAL);
+            __m256d s  = _mm256_setzero_pd();
+            size_t i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m256d v = _mm256_loadu_pd(values + i);
+                lo = _mm256_min_pd(lo, v);
+                hi = _mm256_max_pd(hi, v);
+                s  = _mm256_add_pd(s, v);
+            }
+
+            double mins[4], maxes[4], sums[4];
+            _mm256_storeu_pd(mins, lo);
+            _mm256_storeu_pd(maxes, hi);
+            _mm256_storeu_pd(sums, s);
+            for (size_t lane = 0; lane < 4; ++lane) {
+                t.sum += sums[lane];
+                t.min  = (mins[lane] < t.min) ? mins[lane] : t.min;
+                t.max  = (maxes[lane] > t.max) ? maxes[lane] : t.max;
+            }
+            strided<double>(reinterpret_cast<const char*>(values + i),
+                sizeof(double), count - i, t);
+        }
+#endif
+
+        /* Values packed one after another
+         *
+         * @param values -- the first value
+         * @param count -- how many values there are
+         * @param t -- what to add them to */
+        template <typename F>
+        inline void packed(const F* values, size_t count, totals& t) {
+            strided<F>(reinterpret_cast<const char*>(values), sizeof(F),
+                count, t);
+        }
+
+#ifdef MADB_HAVE_VECTOR_KERNELS
+        template <>
+        inline void packed<float>(const float* values, size_t count,
+            totals& t) {
+            static const bool wide = __builtin_cpu_supports("avx2");
+            if (wide) {
+                avx2(values, count, t);
+            } else {
+                sse2(values, count, t);
+            }
+        }
+
+        template <>
+        inline void packed<double>(const double* values, size_t count,
+            totals& t) {
+            static const bool wide = __builtin_cpu_supports("avx2");
+            if (wide) {
+                avx2(values, count, t);
+            } else {
+                sse2(values, count, t);
+            }
+        }
+#endif
+    }
+
+    /* Builds up a summary of one field of a metric's data points, from
+     * each of the places they're kept in turn: slab files, segments, and
+     * buffers. Those that are added first win ties for the first data point,
+     * and those added last win ties for the last, just as with a cursor */
+    template <typename D, typename F>
+    class summarizer {
+    public:
+        /* Our traits */
+        typedef data_traits<D> traits;
+
+        /* "Inherited" traits */
+        typedef typename traits::timestamp_type  timestamp_type;
+        typedef typename traits::data_type       data_type;
+
+        /* Constructor
+         *
+         * @param field -- which field of the value to summarize
+         * @param ops -- which parts of the summary are wanted
+         * @param result -- where to build up the summary */
+        summarizer(F D::* field, int ops, summary<D>& result):
+            field(column::of(field)),
+            values(ops & (summary_sum | summary_min | summary_max)),
+            result(result) {}
+
+        /* Add data points in any order, only some of which may be in the
+         * range */
+        void points(const data_type* first, size_t count, timestamp_type start,
+            timestamp_type end) {
+            kernels::totals t;
+            size_t found = 0;
+            const data_type* earliest = NULL;
+            const data_type* latest   = NULL;
+            for (size_t i = 0; i < count; ++i) {
+                const data_type& datum(first[i]);
+                if (datum.time < start || datum.time > end) {
+                    continue;
+                }
+                ++found;
+                if (!earliest || datum.time < earliest->time) {
+                    earliest = &datum;
+                }
+                if (!latest || datum.time >= latest->time) {
+                    latest = &datum;
+                }
+                if (values) {
+                    kernels::strided<F>(value(datum), 0, 1, t);
+                }
+            }
+            if (found) {
+                merge(found, t, *earliest, *latest);
+            }
+        }
+
+        /* Add sorted data points, all of which are in the range */
+        void sorted(const data_type* first, size_t count) {
+            if (count == 0) {
+                return;
+            }
+            kernels::totals t;
+            if (values) {
+                kernels::strided<F>(value(*first), sizeof(data_type), count, t);
+            }
+            merge(count, t, first[0], first[count - 1]);
+        }
+
+        /* Add a column of the field's values, from sorted data points that
+         * are all in the range
+         *
+         * @param column -- the values
+         * @param count -- how many there are
+         * @param first -- the earliest of the data points
+         * @param last -- the latest of them */
+        void packed(const F* column, size_t count, const data_type& first,
+            const data_type& last) {
+            kernels::totals t;
+            if (values) {
+                kernels::packed<F>(column, count, t);
+            }
+            merge(count, t, first, last);
+        }
+
+        /* Add data points that have already been summarized */
+        void summarized(size_t count, double sum, double min, double max,
+            const data_type& first, const data_type& last) {
+            kernels::totals t;
+            if (values) {
+                t.sum = sum;
+                t.min = min;
+                t.max = max;
+            }
+            merge(count, t, first, last);
+        }
+
+        /* Which field is being summarized */
+        const column& which() const {
+            return field;
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        summarizer();
+        summarizer(const summarizer& other);
+        const summarizer& operator=(const summarizer& other);
+
+        /* Members */
+        column       field;   /* Which field */
+        bool         values;  /* Whether the field's values are needed */
+        summary<D>&  result;  /* What it's all added to */
+
+        /* Where the field is in a data point */
+        const char* value(const data_type& datum) const {
+            return reinterpret_cast<const char*>(&datum.value) + field.offset;
+        }
+
+        /* Add some data points' totals to the result */
+        void merge(size_t count, const kernels::totals& t,
+            const data_type& first, const data_type& last) {
+            if (result.count == 0 || first.time < result.first.time) {
+                result.first = first;
+            }
+            if (result.count == 0 || last.time >= result.last.time) {
+                result.last = last;
+            }
+            result.count += count;
+            result.sum   += t.sum;
+            result.min    = (t.min < result.min) ? t.min : result.min;
+            result.max    = (t.max > result.max) ? t.max : result.max;
+        }
+    };
+}
+
+#endif
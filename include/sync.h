@@ -0,0 +1,163 @@
+#ifndef MADB__SYNC_H
+#define MADB__SYNC_H
+
+#include <stdint.h>
+
+/* C includes */
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Internal imports */
+#include "options.h"
+
+namespace madb {
+    /* Gets inserts onto disk in batches, by syncing every buffer from a
+     * background thread every so often.
+     *
+     * Inserts only note how much they've appended. With group commit, they
+     * then wait for the next sync to begin and end, which happens once the
+     * interval is up or enough has been appended since the last one, so a
+     * single sync makes every insert that came before it durable at once.
+     * With periodic syncs, inserts never wait, and a crash loses at most the
+     * last interval's worth. Either way, inserts are told when the sync that
+     * should have covered them failed */
+    class syncer {
+    public:
+        /* Syncs everything, returning 0 on success */
+        typedef int(* sync_type)(void*);
+
+        /* Constructor
+         *
+         * @param mode -- whether inserts wait for their sync
+         * @param interval -- most milliseconds between syncs
+         * @param bytes -- how much may be appended before a sync is due early
+         * @param fn -- syncs everything
+         * @param data -- user data to pass to fn */
+        syncer(durability mode, uint32_t interval, uint32_t bytes,
+            sync_type fn, void* data): mode(mode), interval(interval),
+            bytes(bytes), fn(fn), data(data), pending(0), generation(0),
+            done(0), durable(0), stopping(false), started(false) {
+            pthread_mutex_init(&lock, NULL);
+            pthread_cond_init(&wake, NULL);
+            pthread_cond_init(&synced, NULL);
+            started = (pthread_create(&thread, NULL, work, this) == 0);
+        }
+
+        /* Destructor -- syncs whatever's been appended since the last sync */
+        ~syncer() {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&lock);
+            if (started) {
+                pthread_join(thread, NULL);
+            }
+
+            pthread_cond_destroy(&synced);
+            pthread_cond_destroy(&wake);
+            pthread_mutex_destroy(&lock);
+        }
+
+        /* Note that something's been appended to a buffer. With group commit,
+         * wait until it's on disk
+         *
+         * @param count -- about how many bytes were appended
+         * @returns 0 on success, else -1 if, with group commit, no sync since
+         *      made it durable, or with periodic syncs, the last one failed */
+        int commit(size_t count) {
+            pthread_mutex_lock(&lock);
+            pending += count;
+            uint64_t ticket = generation;
+            if (pending >= bytes) {
+                pthread_cond_signal(&wake);
+            }
+            int result = 0;
+            if (mode == durability_group) {
+                while (done <= ticket && started) {
+                    pthread_cond_wait(&synced, &lock);
+                }
+                result = (durable > ticket) ? 0 : -1;
+            } else if (durable != done) {
+                result = -1;
+            }
+            pthread_mutex_unlock(&lock);
+            return result;
+        }
+
+        /* How many syncs there have been */
+        uint64_t syncs() {
+            pthread_mutex_lock(&lock);
+            uint64_t count = done;
+            pthread_mutex_unlock(&lock);
+            return count;
+        }
+    private:
+        /* Private, unimplemented to prevent use */
+        syncer();
+        syncer(const syncer& other);
+        const syncer& operator=(const syncer& other);
+
+        /* Members */
+        durability      mode;        /* Whether inserts wait */
+        uint32_t        interval;    /* Most milliseconds between syncs */
+        uint32_t        bytes;       /* Appended bytes that bring a sync on */
+        sync_type       fn;          /* Syncs everything */
+        void*           data;        /* User data for fn */
+        uint64_t        pending;     /* Bytes appended since the last sync */
+        uint64_t        generation;  /* Syncs begun */
+        uint64_t        done;        /* Syncs finished */
+        uint64_t        durable;     /* The last sync that succeeded */
+        bool            stopping;    /* Whether we're shutting down */
+        bool            started;     /* Whether our thread is running */
+        pthread_t       thread;      /* Runs the syncs */
+        pthread_mutex_t lock;        /* Guards all of the above */
+        pthread_cond_t  wake;        /* Signaled when a sync is due early */
+        pthread_cond_t  synced;      /* Broadcast when a sync finishes */
+
+        /* The body of our background thread */
+        static void* work(void* self) {
+            syncer* s = static_cast<syncer*>(self);
+            pthread_mutex_lock(&s->lock);
+            while (true) {
+                s->sleep();
+                bool last = s->stopping;
+                if (s->pending) {
+                    s->pending = 0;
+                    ++s->generation;
+                    pthread_mutex_unlock(&s->lock);
+                    int result = s->fn(s->data);
+                    pthread_mutex_lock(&s->lock);
+                    s->done = s->generation;
+                    if (result == 0) {
+                        s->durable = s->done;
+                    }
+                    pthread_cond_broadcast(&s->synced);
+                }
+                if (last) {
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+
+        /* With our lock held, wait out the interval, unless enough is
+         * appended or we're stopped first */
+        void sleep() {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            uint64_t usec = tv.tv_usec + static_cast<uint64_t>(interval) * 1000;
+            struct timespec until;
+            until.tv_sec  = tv.tv_sec + usec / 1000000;
+            until.tv_nsec = (usec % 1000000) * 1000;
+
+            int result = 0;
+            while (!stopping && pending < bytes && result != ETIMEDOUT) {
+                result = pthread_cond_timedwait(&wake, &lock, &until);
+            }
+        }
+    };
+}
+
+#endif
@@ -24,6 +24,14 @@ namespace madb {
             }
         } data_type;
 
+        /* A data point along with the name of its metric, for inserting a
+         * whole batch of points at once */
+        typedef struct record_type_ {
+            key_type       name;
+            timestamp_type time;
+            value_type     value;
+        } record_type;
+
         /* A list of data points */
         typedef std::vector<data_type> values_type;
 
@@ -34,6 +42,16 @@ namespace madb {
         typedef void(* insert_cb_type)(void*);
         typedef void(*   read_cb_type)(const values_map_type&, void*);
         typedef void(*    get_cb_type)(const values_type&, void*);
+        typedef void(* update_cb_type)(const key_type&, const values_type&,
+            void*);
+        typedef void(*   name_cb_type)(const key_type&, void*);
+        typedef void(*  stale_cb_type)(const std::vector<key_type>&, void*);
+        typedef void(*  alarm_cb_type)(const key_type&, const data_type&,
+            bool, void*);
+
+        /* Combines the data points in [first, last), never empty, into one */
+        typedef value_type(* aggregate_type)(const data_type*,
+            const data_type*);
     };
 }
 
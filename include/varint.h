@@ -0,0 +1,60 @@
+#ifndef MADB__VARINT_H
+#define MADB__VARINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace madb {
+    /* Unsigned LEB128 variable-length integers. Small numbers take a single
+     * byte, and a 32-bit number never takes more than five */
+    namespace varint {
+        /* The most bytes a 32-bit varint can take */
+        static const size_t max_size = 5;
+
+        /* How many bytes it takes to encode a value */
+        inline size_t size(uint32_t value) {
+            size_t count = 1;
+            while (value >= 0x80) {
+                value >>= 7;
+                ++count;
+            }
+            return count;
+        }
+
+        /* Encode a value
+         *
+         * @param value -- the value to encode
+         * @param ptr -- where to encode it, with at least size(value) bytes
+         * @returns a pointer just past the encoded value */
+        inline char* encode(uint32_t value, char* ptr) {
+            while (value >= 0x80) {
+                *ptr++ = static_cast<char>((value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            *ptr++ = static_cast<char>(value);
+            return ptr;
+        }
+
+        /* Decode a value, never reading at or past `end`
+         *
+         * @param ptr -- where the encoded value begins
+         * @param end -- the end of readable memory
+         * @param value -- where to store the decoded value
+         * @returns a pointer just past the value, or NULL if it was truncated
+         *      or malformed */
+        inline const char* decode(const char* ptr, const char* end,
+            uint32_t& value) {
+            value = 0;
+            for (uint32_t shift = 0; ptr < end && shift < 35; shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(*ptr++);
+                value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return ptr;
+                }
+            }
+            return NULL;
+        }
+    }
+}
+
+#endif
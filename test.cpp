@@ -1,12 +1,16 @@
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
 
+#include <map>
 #include <vector>
+#include <fstream>
 #include <sstream>
 #include <iostream>
 
 #include <boost/filesystem.hpp>
 
+#include <pthread.h>
+
 typedef struct datum_ {
     uint32_t count;
     float    avg;
@@ -15,13 +19,97 @@ typedef struct datum_ {
     float    aux;
 } datum;
 
+/* A value with fields of different sizes, stored column by column */
+typedef struct sample_ {
+    uint64_t total;
+    float    max;
+    uint16_t flags;
+} sample;
+
 #include <db.h>
 
+namespace madb {
+    template <> struct layout<sample> {
+        static std::vector<column> columns() {
+            std::vector<column> fields;
+            fields.push_back(column::of(&sample::total));
+            fields.push_back(column::of(&sample::max));
+            fields.push_back(column::of(&sample::flags));
+            return fields;
+        }
+    };
+}
+
 using namespace madb;
 
 /* This is is how many data points we need to make a few rotations to happen */
 uint32_t count = 2 * (madb::buffer<datum>::max_size / sizeof(datum));
 
+/* Counts completed asynchronous inserts */
+void count_insert(void* data) {
+    ++*static_cast<uint32_t*>(data);
+}
+
+/* Adds up how many points asynchronous gets returned */
+void count_get(const madb::db<datum>::values_type& results, void* data) {
+    *static_cast<uint32_t*>(data) += results.size();
+}
+
+/* Syncs that succeed, or fail, and count themselves */
+int sync_ok(void* data) {
+    ++*static_cast<uint32_t*>(data);
+    return 0;
+}
+
+int sync_failed(void* data) {
+    ++*static_cast<uint32_t*>(data);
+    return -1;
+}
+
+/* Rolls a bucket up into its earliest data point */
+datum earliest(const madb::db<datum>::data_type* first,
+    const madb::db<datum>::data_type* last) {
+    return first->value;
+}
+
+/* What subscriptions have been told */
+typedef struct watched_ {
+    std::map<std::string, uint32_t> points;
+    std::vector<std::string>        names;
+    uint32_t                        next;
+    bool                            ordered;
+} watched;
+
+/* Counts the points a subscription is told about, and checks their order */
+void watch_points(const std::string& name,
+    const madb::db<datum>::values_type& points, void* data) {
+    watched* w = static_cast<watched*>(data);
+    w->points[name] += points.size();
+    for (size_t i = 0; i < points.size(); ++i) {
+        w->ordered = w->ordered && (name != "watched.busy" ||
+            points[i].time == w->next++);
+    }
+}
+
+/* Keeps the names a subscription is told about */
+void watch_names(const std::string& name, void* data) {
+    static_cast<watched*>(data)->names.push_back(name);
+}
+
+/* Keeps the names of metrics that went stale */
+void watch_stale(const std::vector<std::string>& names, void* data) {
+    std::vector<std::string>* stale = static_cast<std::vector<std::string>*>(
+        data);
+    stale->insert(stale->end(), names.begin(), names.end());
+}
+
+/* Keeps when each alarm went off or cleared, as (time << 1 | tripped) */
+void watch_alarm(const std::string& name,
+    const madb::db<datum>::data_type& datum, bool tripped, void* data) {
+    static_cast<std::vector<uint32_t>*>(data)->push_back(
+        datum.time << 1 | tripped);
+}
+
 TEST_CASE("db", "works as advertised") {
     SECTION("buffer", "creates directories as needed") {
         REQUIRE(!boost::filesystem::exists("foo"));
@@ -73,6 +161,926 @@ TEST_CASE("db", "works as advertised") {
         db.destroy();
     }
 
+    SECTION("buffer recovery", "recovers points left in mapped buffers") {
+        {
+            madb::db<datum> db("foo", 4);
+            for(uint32_t i = 0; i < 100; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                db.insert("testing", i, d);
+            }
+        }
+
+        /* Reopening should rotate the leftover buffers out to the slabs */
+        madb::db<datum> db("foo", 4);
+        madb::db<datum>::values_type results(db.get("testing", 0, 99));
+        REQUIRE(results.size() == 100);
+        REQUIRE(results[42].value.count == 42);
+        db.destroy();
+    }
+
+    SECTION("older buffers", "reads buffers left in older formats") {
+        typedef madb::db<datum>::data_type data_type;
+        boost::filesystem::create_directories("foo/buffers");
+
+        /* Mapped, with each record's name in full */
+        {
+            std::ofstream out("foo/buffers/.buffer.mapped",
+                std::ios::binary);
+            madb::buffer<datum>::header h = {
+                madb::buffer<datum>::magic, madb::buffer<datum>::named, 0};
+            h.written = 100 * (sizeof(size_t) + 7 + sizeof(data_type));
+            out.write(reinterpret_cast<char*>(&h), sizeof(h));
+            for (uint32_t i = 0; i < 100; ++i) {
+                size_t len = 7;
+                data_type d = {i, {i, 1, 1, 1, 1}};
+                out.write(reinterpret_cast<char*>(&len), sizeof(len));
+                out.write("testing", len);
+                out.write(reinterpret_cast<char*>(&d), sizeof(d));
+            }
+        }
+
+        /* Streamed, without any header */
+        {
+            std::ofstream out("foo/buffers/.buffer.streamed",
+                std::ios::binary);
+            for (uint32_t i = 100; i < 200; ++i) {
+                size_t len = 7;
+                data_type d = {i, {i, 1, 1, 1, 1}};
+                out.write(reinterpret_cast<char*>(&len), sizeof(len));
+                out.write("testing", len);
+                out.write(reinterpret_cast<char*>(&d), sizeof(d));
+            }
+        }
+
+        /* And something else entirely, which is left alone */
+        {
+            std::ofstream out("foo/buffers/.buffer.unknown",
+                std::ios::binary);
+            std::string junk(4096, '\xff');
+            out.write(junk.data(), junk.size());
+        }
+
+        madb::db<datum> db("foo", 4);
+        madb::db<datum>::values_type results(db.get("testing", 0, 199));
+        REQUIRE(results.size() == 200);
+        REQUIRE(results[42].value.count == 42);
+        REQUIRE(results[142].value.count == 142);
+        REQUIRE(!boost::filesystem::exists("foo/buffers/.buffer.mapped"));
+        REQUIRE(!boost::filesystem::exists("foo/buffers/.buffer.streamed"));
+        REQUIRE(boost::filesystem::file_size("foo/buffers/.buffer.unknown") ==
+            4096);
+        db.destroy();
+    }
+
+    SECTION("older slabs", "renames slabs named for their latest point") {
+        typedef madb::db<datum>::data_type data_type;
+        boost::filesystem::create_directories("foo/metrics/testing");
+        for (uint32_t slab = 0; slab < 2; ++slab) {
+            std::stringstream name;
+            name << "foo/metrics/testing/" << 100 * slab + 99;
+            std::ofstream out(name.str().c_str(), std::ios::binary);
+            for (uint32_t i = 100 * slab; i < 100 * slab + 100; ++i) {
+                data_type d = {i, {i, 1, 1, 1, 1}};
+                out.write(reinterpret_cast<char*>(&d), sizeof(d));
+            }
+        }
+
+        madb::db<datum> db("foo", 4);
+        REQUIRE(boost::filesystem::exists("foo/bounds"));
+        REQUIRE(boost::filesystem::exists("foo/metrics/testing/100"));
+        REQUIRE(boost::filesystem::exists("foo/metrics/testing/200"));
+        REQUIRE(!boost::filesystem::exists("foo/metrics/testing/99"));
+        REQUIRE(db.get("testing", 99, 99).size() == 1);
+        REQUIRE(db.get("testing", 0, 199).size() == 200);
+        db.destroy();
+    }
+
+    SECTION("failed rotation", "inserts fail when no buffer can be made") {
+        madb::db<datum> db("foo", 1);
+        boost::filesystem::rename("foo/buffers", "foo/buffers.away");
+        std::ofstream("foo/buffers").put('x');
+
+        /* Once the active buffer fills up, there's nowhere to go */
+        uint32_t failed = 0;
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            failed += (db.insert("testing", i, d) != 0);
+        }
+        REQUIRE(failed > 0);
+        REQUIRE(failed < count);
+
+        boost::filesystem::remove("foo/buffers");
+        boost::filesystem::rename("foo/buffers.away", "foo/buffers");
+        datum d = {count, 1, 1, 1, 1};
+        REQUIRE(db.insert("testing", count, d) == 0);
+        REQUIRE(db.get("testing", 0, count).size() == count - failed + 1);
+        db.destroy();
+    }
+
+    SECTION("failed dump", "dumps that fail are tried again before long") {
+        madb::db<datum> db("foo", 1);
+        boost::filesystem::create_directories("foo/metrics/testing/latest");
+        uint32_t failed = 0;
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            failed += (db.insert("testing", i, d) != 0);
+        }
+        REQUIRE(failed == 0);
+        REQUIRE(std::distance(boost::filesystem::directory_iterator(
+            "foo/buffers"), boost::filesystem::directory_iterator()) > 1);
+
+        /* Without another rotation, an insert gets it tried again */
+        boost::filesystem::remove("foo/metrics/testing/latest");
+        sleep(madb::shard<datum>::retry_seconds + 1);
+        datum d = {count, 1, 1, 1, 1};
+        REQUIRE(db.insert("testing", count, d) == 0);
+        REQUIRE(std::distance(boost::filesystem::directory_iterator(
+            "foo/buffers"), boost::filesystem::directory_iterator()) == 1);
+        REQUIRE(db.get("testing", 0, count).size() == count + 1);
+        db.destroy();
+    }
+
+    SECTION("background flush", "gets see buffers while they're dumped") {
+        madb::options opts;
+        opts.flush_threads = 2;
+        opts.max_pending   = 2;
+        madb::db<datum> db("foo", 1, opts);
+
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {1, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+
+        /* Whether or not the dumps have finished, nothing should be missing */
+        REQUIRE(db.get("testing", 0, count).size() == count);
+
+        db.flush();
+        REQUIRE(boost::filesystem::exists("foo/metrics/testing/latest"));
+        REQUIRE(db.get("testing", 0, count).size() == count);
+        db.destroy();
+    }
+
+    SECTION("batch insert", "inserts whole batches across rotations") {
+        madb::db<datum> db("foo", 4);
+
+        /* Spread a batch over a few metrics, big enough to rotate */
+        std::vector<madb::db<datum>::record_type> batch(count);
+        for(uint32_t i = 0; i < count; ++i) {
+            std::stringstream ss;
+            ss << "testing-" << (i % 3);
+            batch[i].name  = ss.str();
+            batch[i].time  = i / 3;
+            batch[i].value.count = i;
+        }
+        db.insert_batch(&batch[0], &batch[0] + batch.size());
+
+        size_t total = 0;
+        for(uint32_t i = 0; i < 3; ++i) {
+            std::stringstream ss;
+            ss << "testing-" << i;
+            total += db.get(ss.str(), 0, count).size();
+        }
+        REQUIRE(total == count);
+        db.destroy();
+    }
+
+    SECTION("handles", "resolved handles survive rotations") {
+        madb::db<datum> db("foo", 4);
+        madb::db<datum>::handle h(db.resolve("testing"));
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert(h, i, d);
+            db.insert("other", i, d);
+        }
+        REQUIRE(db.get("testing", 0, count).size() == count);
+        REQUIRE(db.get("other", 0, count).size() == count);
+
+        /* Names too long to insert, and ids no shard gave out, insert
+         * nothing */
+        std::string huge(madb::buffer<datum>::max_size, 'x');
+        madb::db<datum>::handle bad(db.resolve(huge));
+        madb::db<datum>::handle bogus(h);
+        bogus.id += 1000;
+        datum d = {0, 1, 1, 1, 1};
+        db.insert(bad, 0, d);
+        db.insert(bogus, 0, d);
+        REQUIRE(bad.id == madb::shard<datum>::unresolved);
+        REQUIRE(db.get("testing", 0, count).size() == count);
+        db.destroy();
+    }
+
+    SECTION("range", "gets only the data points within a range") {
+        madb::db<datum> db("foo", 4);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+
+        madb::db<datum>::values_type results(db.get("testing", 100000, 100999));
+        REQUIRE(results.size() == 1000);
+        REQUIRE(results.front().time == 100000);
+        REQUIRE(results.back().time == 100999);
+        db.destroy();
+    }
+
+    SECTION("scan", "cursors return data points in order") {
+        madb::db<datum> db("foo", 4);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+
+        madb::db<datum>::cursor_type c(db.scan("testing", 10, count - 11));
+        madb::db<datum>::data_type datum;
+        uint32_t expected = 10;
+        uint32_t mismatched = 0;
+        while (c.next(datum)) {
+            mismatched += (datum.time != expected++);
+        }
+        REQUIRE(mismatched == 0);
+        REQUIRE(expected == count - 10);
+
+        /* Slabs stay open for as long as the cursor needs them */
+        db.flush();
+        madb::db< ::datum>::cursor_type kept(db.scan("testing", 0, count));
+        REQUIRE(boost::filesystem::remove("foo/metrics/testing/43691"));
+        madb::db< ::datum>::values_type results;
+        kept.drain(results);
+        REQUIRE(results.size() == count);
+        db.destroy();
+    }
+
+    SECTION("compression", "compressed slabs read back what was written") {
+        madb::options opts;
+        opts.compress_slabs = true;
+        madb::db<datum> db("foo", 4, opts);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 0.5f * (i % 100), -1.0f * i, 1e6f, 1};
+            db.insert("testing", 60 * i + (i % 7 == 0), d);
+        }
+
+        boost::filesystem::path p("foo/metrics/testing");
+        std::stringstream ss;
+        ss << (madb::slab<datum>::max_size /
+            sizeof(madb::db<datum>::data_type)) * 60 + 1;
+        p /= ss.str() + madb::slab<datum>::compressed_suffix();
+        REQUIRE(boost::filesystem::exists(p));
+        REQUIRE(boost::filesystem::file_size(p) <
+            madb::slab<datum>::max_size / 4);
+
+        madb::db<datum>::values_type results(
+            db.get("testing", 60 * 1000, 60 * 100000));
+        REQUIRE(results.size() == 99001);
+        uint32_t mismatched = 0;
+        for (uint32_t i = 0; i < results.size(); ++i) {
+            uint32_t j = i + 1000;
+            mismatched += (results[i].time != 60 * j + (j % 7 == 0)) ||
+                (results[i].value.count != j) ||
+                (results[i].value.avg != 0.5f * (j % 100)) ||
+                (results[i].value.min != -1.0f * j);
+        }
+        REQUIRE(mismatched == 0);
+        db.destroy();
+    }
+
+    SECTION("columnar", "slabs stored by column read back what was written") {
+        typedef madb::db<sample>::data_type data_type;
+        madb::db<sample> db("foo", 4);
+        for(uint32_t i = 0; i < count; ++i) {
+            sample s = {i * 1000000007ULL, 0.25f * i, uint16_t(i)};
+            db.insert("testing", i, s);
+        }
+
+        /* Padding isn't stored, so it's smaller than the points were */
+        boost::filesystem::path p("foo/metrics/testing");
+        std::stringstream ss;
+        ss << madb::slab<sample>::max_size / sizeof(data_type) + 1;
+        p /= ss.str() + madb::slab<sample>::columnar_suffix();
+        REQUIRE(boost::filesystem::exists(p));
+        REQUIRE(boost::filesystem::file_size(p) <
+            madb::slab<sample>::max_size * 19 / sizeof(data_type));
+
+        madb::db<sample>::values_type results(
+            db.get("testing", 1000, count - 1000));
+        REQUIRE(results.size() == count - 1999);
+        uint32_t mismatched = 0;
+        for (uint32_t i = 0; i < results.size(); ++i) {
+            uint32_t j = i + 1000;
+            mismatched += (results[i].time != j) ||
+                (results[i].value.total != j * 1000000007ULL) ||
+                (results[i].value.max != 0.25f * j) ||
+                (results[i].value.flags != uint16_t(j));
+        }
+        REQUIRE(mismatched == 0);
+        db.destroy();
+    }
+
+    SECTION("aggregate", "summarizes ranges without getting every point") {
+        /* Slabs of whole data points */
+        madb::db<datum> db("foo", 4);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 0.5f * (i % 100), 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+        madb::db<datum>::values_type points(db.get("testing", 1000, 200000));
+        double sum = 0;
+        for (uint32_t i = 0; i < points.size(); ++i) {
+            sum += points[i].value.avg;
+        }
+        madb::db<datum>::summary_type s(
+            db.aggregate("testing", 1000, 200000, &datum::avg));
+        REQUIRE(s.count == points.size());
+        REQUIRE(s.sum == sum);
+        REQUIRE(s.min == 0);
+        REQUIRE(s.max == 49.5);
+        REQUIRE(s.first.time == 1000);
+        REQUIRE(s.last.value.count == 200000);
+        db.destroy();
+
+        /* Columnar slabs, read a column at a time, or from their totals */
+        madb::db<sample> columnar("foo", 4);
+        for(uint32_t i = 0; i < count; ++i) {
+            sample c = {i, 0.25f * i, uint16_t(i)};
+            columnar.insert("testing", i, c);
+        }
+        madb::db<sample>::summary_type c(
+            columnar.aggregate("testing", 1000, count - 1000, &sample::max));
+        REQUIRE(c.count == count - 1999);
+        REQUIRE(c.sum == 0.25 * (1000.0 + count - 1000) / 2 * c.count);
+        REQUIRE(c.min == 250);
+        REQUIRE(c.max == 0.25 * (count - 1000));
+        REQUIRE(c.last.value.total == count - 1000);
+
+        c = columnar.aggregate("testing", 0, count, &sample::total);
+        REQUIRE(c.count == count);
+        REQUIRE(c.sum == (count - 1.0) * count / 2);
+        REQUIRE(c.max == count - 1);
+
+        /* Only counting doesn't need any values */
+        c = columnar.aggregate("testing", 0, count, &sample::flags,
+            madb::summary_count);
+        REQUIRE(c.count == count);
+        REQUIRE(c.sum == 0);
+        REQUIRE(columnar.aggregate("testing", count, count + 10,
+            &sample::max).count == 0);
+        columnar.destroy();
+    }
+
+    SECTION("rollups", "coarse gets read from tiers rolled up in the back") {
+        madb::options opts;
+        opts.policies.push_back(madb::policy("test"));
+        opts.policies.back().tiers.push_back(madb::tier(60));
+        opts.aggregate_with<datum>(&earliest);
+        REQUIRE(opts.aggregate_of<datum>() == &earliest);
+        REQUIRE(opts.aggregate_of<sample>() == NULL);
+        madb::db<datum> db("foo", 4, opts);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+        db.flush();
+        REQUIRE(boost::filesystem::exists(
+            "foo/rollups/60/metrics/testing/latest"));
+        REQUIRE(boost::filesystem::exists(
+            "foo/rollups/60/metrics/testing/rolled"));
+
+        /* Rolled up buckets, and then the ones downsampled on the fly */
+        madb::db<datum>::values_type results(
+            db.get("testing", 30, count - 1, 300));
+        REQUIRE(results.size() == (count + 59) / 60);
+        uint32_t mismatched = 0;
+        for (uint32_t i = 0; i < results.size(); ++i) {
+            mismatched += (results[i].time != 60 * i) ||
+                (results[i].value.count != 60 * i);
+        }
+        REQUIRE(mismatched == 0);
+
+        /* Rolling the same slabs up again adds nothing */
+        madb::slab<datum>::files_type files(
+            madb::slab<datum>("foo", "testing", true).files());
+        REQUIRE(!files.empty());
+        madb::rollups<datum> again("foo", opts.policies, false);
+        for (uint32_t i = 0; i < files.size(); ++i) {
+            madb::rollups<datum>::rotated("testing", files[i].first, &again);
+        }
+        again.drain();
+        REQUIRE(db.get("testing", 30, count - 1, 300).size() ==
+            results.size());
+
+        /* Finer than any tier, so the raw data points */
+        REQUIRE(db.get("testing", 0, count - 1, 30).size() == count);
+        db.destroy();
+    }
+
+    SECTION("retention", "pruning removes only slabs that have expired") {
+        madb::options opts;
+        opts.policies.push_back(madb::policy("", 100000));
+        madb::db<datum> db("foo", 4, opts);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+        db.flush();
+
+        /* Everything from count - 100000 on is still in retention */
+        uint32_t cutoff = count - 100000;
+        REQUIRE(db.prune(count) > 0);
+        REQUIRE(!boost::filesystem::exists("foo/metrics/testing/43691"));
+
+        madb::db<datum>::values_type results(db.get("testing", 0, count));
+        REQUIRE(results.size() < count);
+        REQUIRE(results.front().time <= cutoff);
+        uint32_t mismatched = 0;
+        for (uint32_t i = 0; i < results.size(); ++i) {
+            mismatched += (results[i].time != results.front().time + i);
+        }
+        REQUIRE(mismatched == 0);
+        REQUIRE(results.back().time == count - 1);
+        REQUIRE(db.prune(count) == 0);
+        db.destroy();
+    }
+
+    SECTION("catalog", "lists metrics by prefix and pattern") {
+        {
+            madb::db<datum> db("foo", 4);
+            datum d = {1, 1, 1, 1, 1};
+            db.insert("foo/bar", 1, d);
+            db.insert("foo/baz", 1, d);
+            db.insert("whiz", 1, d);
+        }
+
+        /* Reopening dumps the leftover buffers, cataloging the metrics */
+        {
+            madb::db<datum> db("foo", 4);
+            REQUIRE(db.list("").size() == 3);
+            std::vector<std::string> names(db.list("foo/"));
+            REQUIRE(names.size() == 2);
+            REQUIRE(names[0] == "foo/bar");
+            REQUIRE(names[1] == "foo/baz");
+            REQUIRE(db.glob("*z").size() == 2);
+            REQUIRE(db.glob("foo/b?r").size() == 1);
+        }
+
+        /* Names are merged into the index a few at a time */
+        {
+            madb::catalog known("foo", 2);
+            REQUIRE(boost::filesystem::exists("foo/catalog.index"));
+            REQUIRE(known.size() == 3);
+            REQUIRE(!known.add("foo/bar"));
+            REQUIRE(known.add("foo/bam"));
+            REQUIRE(known.add("whir"));
+            REQUIRE(!known.add("whir"));
+            std::vector<std::string> names(known.list("foo/"));
+            REQUIRE(names.size() == 3);
+            REQUIRE(names[0] == "foo/bam");
+            REQUIRE(names[2] == "foo/baz");
+            REQUIRE(known.glob("wh*").size() == 2);
+
+            /* And gone through a page at a time */
+            std::vector<std::string> first(known.page("", 3));
+            REQUIRE(first.size() == 3);
+            REQUIRE(first[2] == "foo/baz");
+            std::vector<std::string> rest(known.page(first.back(), 3));
+            REQUIRE(rest.size() == 2);
+            REQUIRE(rest[0] == "whir");
+            REQUIRE(known.page(rest.back(), 3).empty());
+        }
+
+        /* And one without a catalog gets it back from its directories */
+        boost::filesystem::remove("foo/catalog");
+        boost::filesystem::remove("foo/catalog.index");
+        madb::db<datum> db("foo", 4);
+        REQUIRE(db.list("").size() == 3);
+        REQUIRE(db.list("whiz").size() == 1);
+        db.destroy();
+    }
+
+    SECTION("segments", "dumps pack metrics into merged segments") {
+        madb::options opts;
+        opts.segments = true;
+        opts.segment_fanout = 2;
+        {
+            madb::db<datum> db("foo", 1, opts);
+            for(uint32_t i = 0; i < count; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                std::stringstream ss;
+                ss << "testing-" << (i % 3);
+                db.insert(ss.str(), i / 3, d);
+            }
+            db.flush();
+            REQUIRE(!boost::filesystem::exists("foo/metrics"));
+            REQUIRE(boost::filesystem::exists("foo/segments/0-1"));
+            REQUIRE(db.list("testing-").size() == 3);
+
+            madb::db<datum>::values_type results(
+                db.get("testing-1", 0, count));
+            REQUIRE(results.size() == (count + 1) / 3);
+            uint32_t mismatched = 0;
+            for (uint32_t i = 0; i < results.size(); ++i) {
+                mismatched += (results[i].time != i) ||
+                    (results[i].value.count != 3 * i + 1);
+            }
+            REQUIRE(mismatched == 0);
+
+            /* Only the range is read, and none of the neighboring metrics */
+            results = db.get("testing-1", 100, 1099);
+            REQUIRE(results.size() == 1000);
+            REQUIRE(results.front().value.count == 301);
+            REQUIRE(results.back().value.count == 3298);
+        }
+
+        /* Reopening picks up the segments, and whatever was left buffered */
+        {
+            madb::db<datum> db("foo", 1, opts);
+            REQUIRE(db.get("testing-2", 0, count).size() == count / 3);
+            REQUIRE(db.get("missing", 0, count).size() == 0);
+        }
+
+        /* Without segments, dumps go to slabs, and both are read until the
+         * segments expire */
+        opts.segments = false;
+        opts.policies.push_back(madb::policy("testing-", 10));
+        madb::db<datum> db("foo", 1, opts);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing-2", count + i, d);
+        }
+        db.flush();
+        REQUIRE(boost::filesystem::exists("foo/metrics/testing-2"));
+        REQUIRE(db.get("testing-2", 0, 2 * count).size() ==
+            count / 3 + count);
+        REQUIRE(db.prune(count + 10) > 0);
+        REQUIRE(db.get("testing-2", 0, 2 * count).size() == count);
+        REQUIRE(db.get("testing-1", 0, count).size() == 0);
+        REQUIRE(boost::filesystem::is_empty("foo/segments"));
+        db.destroy();
+    }
+
+    SECTION("io_uring", "batched reads and writes go through io_uring") {
+        madb::options opts;
+        opts.io_uring = true;
+        opts.flush_threads = 2;
+        madb::db<datum> db("foo", 4, opts);
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            std::stringstream ss;
+            ss << "testing-" << (i % 3);
+            db.insert(ss.str(), i, d);
+        }
+        db.flush();
+
+        madb::db<datum>::values_type results(db.get("testing-0", 0, count));
+        REQUIRE(results.size() == (count + 2) / 3);
+        uint32_t mismatched = 0;
+        for (uint32_t i = 0; i < results.size(); ++i) {
+            mismatched += (results[i].time != 3 * i) ||
+                (results[i].value.count != 3 * i);
+        }
+        REQUIRE(mismatched == 0);
+        REQUIRE(db.stats().io_uring == madb::io::local(true).uses_uring());
+
+        /* Another database in the process needn't use it */
+        madb::db<datum> other("bar", 4);
+        REQUIRE(!other.stats().io_uring);
+        other.destroy();
+        db.destroy();
+    }
+
+    SECTION("async", "callbacks are dispatched once operations are done") {
+        madb::options opts;
+        opts.async_threads = 2;
+        madb::db<datum> db("foo", 4, opts);
+        uint32_t inserted = 0;
+        for(uint32_t i = 0; i < 10000; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d, count_insert, &inserted);
+        }
+
+        /* Nothing is invoked until we dispatch, but flushing waits for the
+         * inserts themselves */
+        REQUIRE(inserted == 0);
+        REQUIRE(db.fd() >= 0);
+        db.flush();
+        REQUIRE(inserted == 0);
+        REQUIRE(db.dispatch() == 10000);
+        REQUIRE(inserted == 10000);
+        REQUIRE(db.dispatch() == 0);
+
+        uint32_t got = 0;
+        for(uint32_t i = 0; i < 100; ++i) {
+            db.get("testing", 100 * i, 100 * i + 99, count_get, &got);
+        }
+        size_t dispatched = 0;
+        while (dispatched < 100) {
+            dispatched += db.poll(1000);
+        }
+        REQUIRE(got == 10000);
+        db.destroy();
+    }
+
+    SECTION("parallel recovery", "recovers shards' buffers in the background") {
+        {
+            madb::db<datum> db("foo", 4);
+            for(uint32_t i = 0; i < 100; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                for (char c = 'a'; c < 'i'; ++c) {
+                    db.insert(std::string("recover.") + c, i, d);
+                }
+            }
+        }
+
+        /* Gets see the leftovers before they're dumped, and inserts go in
+         * after them */
+        madb::options opts;
+        opts.recovery_threads    = 4;
+        opts.background_recovery = true;
+        madb::db<datum> db("foo", 4, opts);
+        REQUIRE(db.stats().recovered == 4);
+        for(uint32_t i = 100; i < 150; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("recover.a", i, d);
+        }
+        REQUIRE(db.get("recover.h", 0, 99).size() == 100);
+
+        db.flush();
+        REQUIRE(db.stats().recovering == 0);
+        REQUIRE(db.stats().recovery_seconds > 0);
+        madb::db<datum>::values_type results(db.get("recover.a", 0, 149));
+        REQUIRE(results.size() == 150);
+        REQUIRE(results[120].value.count == 120);
+        db.destroy();
+    }
+
+    SECTION("durability", "group commits, and drops corrupt records") {
+        {
+            madb::options opts;
+            opts.sync_mode     = madb::durability_group;
+            opts.sync_interval = 1;
+            madb::db<datum> db("foo", 1, opts);
+            uint32_t failed = 0;
+            for(uint32_t i = 0; i < 100; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                failed += (db.insert("testing", i, d) != 0);
+            }
+            REQUIRE(failed == 0);
+            REQUIRE(db.stats().syncs > 0);
+        }
+
+        /* Flip a bit in the 51st record of the leftover buffer, after the
+         * header, the defining record and forty-nine others */
+        size_t record = 1 + sizeof(madb::db<datum>::data_type) + 4;
+        boost::filesystem::directory_iterator it("foo/buffers");
+        std::fstream f(it->path().string().c_str(),
+            std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(16 + (record + 1 + 7) + 49 * record + 3);
+        f.put(0x7f);
+        f.close();
+
+        madb::db<datum> db("foo", 1);
+        madb::db<datum>::values_type results(db.get("testing", 0, 99));
+        REQUIRE(results.size() == 50);
+        REQUIRE(results.back().value.count == 49);
+        db.destroy();
+    }
+
+    SECTION("failed syncs", "group commits report syncs that failed") {
+        uint32_t calls = 0;
+        {
+            madb::syncer good(madb::durability_group, 1, 1 << 20, sync_ok,
+                &calls);
+            REQUIRE(good.commit(16) == 0);
+        }
+        {
+            madb::syncer bad(madb::durability_group, 1, 1 << 20, sync_failed,
+                &calls);
+            REQUIRE(bad.commit(16) == -1);
+            REQUIRE(bad.commit(16) == -1);
+        }
+        {
+            madb::syncer periodic(madb::durability_periodic, 1, 1 << 20,
+                sync_failed, &calls);
+            periodic.commit(16);
+            usleep(50000);
+            REQUIRE(periodic.commit(16) == -1);
+        }
+        REQUIRE(calls >= 4);
+    }
+
+    SECTION("durable dumps", "sync slabs before removing their buffers") {
+        madb::options opts;
+        opts.sync_mode = madb::durability_periodic;
+        madb::db<datum> db("foo", 1, opts);
+        uint64_t before = db.stats().syncs;
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+        }
+        db.flush();
+        usleep(50000);
+        REQUIRE(db.stats().syncs > before);
+        REQUIRE(db.get("testing", 0, count).size() == count);
+        db.destroy();
+    }
+
+    SECTION("recent", "gets of only recent points are answered from memory") {
+        {
+            madb::db<datum> db("foo", 4);
+            for(uint32_t i = 0; i < 100; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                db.insert("testing", i, d);
+                db.insert("backfilled", i, d);
+            }
+            datum d = {1000, 1, 1, 1, 1};
+            db.insert("backfilled", 1000, d);
+        }
+
+        madb::options opts;
+        opts.recent_points = 50;
+        madb::db<datum> db("foo", 4, opts);
+        for(uint32_t i = 100; i < 200; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("testing", i, d);
+            db.insert("backfilled", i, d);
+        }
+
+        madb::db<datum>::values_type results(db.get("testing", 150, 199));
+        REQUIRE(results.size() == 50);
+        REQUIRE(results[0].value.count == 150);
+        REQUIRE(db.get("testing", 0, 199).size() == 200);
+        madb::db<datum>::stats_type stats(db.stats());
+        REQUIRE(stats.recent_hits == 1);
+        REQUIRE(stats.recent_misses == 1);
+        REQUIRE(stats.recent_bytes ==
+            2 * 50 * sizeof(madb::db<datum>::data_type));
+
+        /* Points from before it was opened aren't in memory */
+        REQUIRE(db.get("backfilled", 150, 2000).size() == 51);
+        REQUIRE(db.stats().recent_misses == 2);
+        db.destroy();
+    }
+
+    SECTION("subscriptions", "tells about new points and metrics") {
+        madb::options opts;
+        opts.subscription_pending = count;
+        madb::db<datum> db("foo", 1, opts);
+        watched w;
+        w.next    = 0;
+        w.ordered = true;
+        uint32_t points = db.subscribe("watched.*", watch_points, &w);
+        db.subscribe("watched.*", watch_names, &w);
+
+        /* Enough to rotate the buffer, and have the names dumped */
+        for(uint32_t i = 0; i < count; ++i) {
+            datum d = {i, 1, 1, 1, 1};
+            db.insert("watched.busy", i, d);
+            if (i == 0) {
+                db.insert("watched.quiet", i, d);
+                db.insert("ignored", i, d);
+            }
+        }
+        db.flush();
+        REQUIRE(w.points["watched.busy"] == count);
+        REQUIRE(w.points["watched.quiet"] == 1);
+        REQUIRE(w.points.count("ignored") == 0);
+        REQUIRE(w.ordered);
+        REQUIRE(w.names.size() == 2);
+        REQUIRE(db.stats().subscription_drops == 0);
+
+        db.unsubscribe(points);
+        datum d = {0, 1, 1, 1, 1};
+        db.insert("watched.quiet", count, d);
+        db.flush();
+        REQUIRE(w.points["watched.quiet"] == 1);
+        db.destroy();
+    }
+
+    SECTION("stale", "tells when metrics stop getting data points") {
+        madb::db<datum> db("foo", 4);
+        std::vector<std::string> stale;
+        uint32_t id = db.watch_stale("stale.*", 2, watch_stale, &stale);
+
+        /* Only the quiet one goes stale, and only once */
+        datum d = {0, 1, 1, 1, 1};
+        db.insert("stale.quiet", 0, d);
+        db.insert("ignored", 0, d);
+        for(uint32_t i = 0; i < 40; ++i) {
+            db.insert("stale.busy", i, d);
+            usleep(100000);
+        }
+        db.unwatch_stale(id);
+        REQUIRE(stale.size() == 1);
+        REQUIRE(stale[0] == "stale.quiet");
+        db.destroy();
+    }
+
+    SECTION("alarms", "go off and clear as thresholds are crossed") {
+        typedef madb::db<datum>::threshold_type threshold;
+        madb::db<datum> db("foo", 4);
+        std::vector<uint32_t> high, range;
+        uint32_t id = db.alarm("alarm.*", threshold::above(&datum::max, 90),
+            watch_alarm, &high);
+        db.alarm("alarm.cpu", threshold::inside(&datum::count, 10, 20),
+            watch_alarm, &range);
+
+        /* Only crossing the threshold counts, either way */
+        float max[] = {50, 95, 96, 40, 99};
+        for (uint32_t i = 0; i < 5; ++i) {
+            datum d = {i * 5, 1, 1, max[i], 1};
+            db.insert("alarm.cpu", i, d);
+            db.insert("ignored", i, d);
+        }
+        db.flush();
+        REQUIRE(high.size() == 3);
+        REQUIRE(high[0] == (1 << 1 | 1));
+        REQUIRE(high[1] == (3 << 1 | 0));
+        REQUIRE(high[2] == (4 << 1 | 1));
+        REQUIRE(range.size() == 1);
+        REQUIRE(range[0] == (2 << 1 | 1));
+
+        /* Adding an alarm doesn't set off the ones already going off */
+        db.alarm("other.*", threshold::below(&datum::min, 0),
+            watch_alarm, &high);
+        datum d = {20, 1, 1, 99, 1};
+        db.insert("alarm.cpu", 5, d);
+        db.flush();
+        REQUIRE(high.size() == 3);
+
+        /* Nor does one that's gone */
+        db.unalarm(id);
+        d.count = 0;
+        d.max   = 10;
+        db.insert("alarm.cpu", 6, d);
+        db.flush();
+        REQUIRE(high.size() == 3);
+        REQUIRE(range.size() == 2);
+        REQUIRE(range[1] == (6 << 1 | 0));
+        REQUIRE(db.stats().alarm_drops == 0);
+
+        /* And the rule sets for the old alarms are gone */
+        REQUIRE(db.stats().alarm_rule_sets == 1);
+        db.destroy();
+    }
+
+    SECTION("slab rotate failure", "keeps the latest slab if rotating fails") {
+        typedef madb::db<datum>::data_type data_type;
+        uint32_t full = (madb::slab<datum>::max_size + sizeof(data_type) - 1) /
+            sizeof(data_type);
+        std::stringstream ss;
+        ss << "foo/metrics/testing/" << full;
+        boost::filesystem::create_directories(ss.str());
+        {
+            madb::slab<datum> s("foo", "testing");
+            uint32_t failed = 0;
+            for (uint32_t i = 0; i < full; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                failed += (s.insert(i, d) != 0);
+            }
+            REQUIRE(failed == 0);
+            REQUIRE(s.files().empty());
+            REQUIRE(s.get(0, full).size() == full);
+
+            /* Once it can be, the next insert rotates it out */
+            boost::filesystem::remove(ss.str());
+            datum d = {full, 1, 1, 1, 1};
+            REQUIRE(s.insert(full, d) == 0);
+            REQUIRE(s.files().size() == 1);
+            REQUIRE(s.get(0, full).size() == full + 1);
+        }
+        boost::filesystem::remove_all("foo");
+    }
+
+    SECTION("slab ranges", "reads skip slabs that begin after the range") {
+        typedef madb::db<datum>::data_type data_type;
+        uint32_t full = (madb::slab<datum>::max_size + sizeof(data_type) - 1) /
+            sizeof(data_type);
+        {
+            madb::slab<datum> s("foo", "testing");
+            uint32_t failed = 0;
+            for (uint32_t i = 0; i < 2 * full; ++i) {
+                datum d = {i, 1, 1, 1, 1};
+                failed += (s.insert(i, d) != 0);
+            }
+            REQUIRE(failed == 0);
+            madb::slab<datum>::ranges_type ranges(s.ranges());
+            REQUIRE(ranges.size() == 2);
+            REQUIRE(ranges[full] == 0);
+            REQUIRE(ranges[2 * full] == full);
+
+            /* A point planted early in the later slab isn't read for a
+             * range that ends before that slab begins */
+            std::stringstream later;
+            later << "foo/metrics/testing/" << 2 * full;
+            std::fstream f(later.str().c_str(),
+                std::ios::in | std::ios::out | std::ios::binary);
+            data_type planted = {5, {5, 1, 1, 1, 1}};
+            f.write(reinterpret_cast<char*>(&planted), sizeof(planted));
+            f.close();
+            REQUIRE(s.get(0, 10).size() == 11);
+            REQUIRE(s.get(full + 1, full + 10).size() == 10);
+        }
+        boost::filesystem::remove_all("foo");
+    }
+
     SECTION("slab rotate", "can rotate out to new slabs at needed") {
         uint32_t timestamp = (madb::slab<datum>::max_size /
             sizeof(madb::db<datum>::data_type)) + 1;
@@ -98,6 +1106,65 @@ TEST_CASE("db", "works as advertised") {
     }
 }
 
+/* Each stress thread inserts this many points into its own metric, and as
+ * many into a metric that all the threads share */
+const uint32_t per_thread = 100000;
+const uint32_t num_threads = 4;
+
+typedef struct stress_ {
+    madb::db<datum>* db;
+    uint32_t         id;
+} stress;
+
+void* stress_insert(void* data) {
+    stress* s = static_cast<stress*>(data);
+    std::stringstream ss;
+    ss << "thread-" << s->id;
+    for (uint32_t i = 0; i < per_thread; ++i) {
+        datum d = {s->id, 1, 1, 1, 1};
+        s->db->insert(ss.str(), i, d);
+        s->db->insert("shared", s->id * per_thread + i, d);
+    }
+    return NULL;
+}
+
+TEST_CASE("concurrency", "inserts from many threads are neither lost nor "
+    "duplicated") {
+    madb::options opts;
+    opts.flush_threads = 2;
+    madb::db<datum> db("foo", 4, opts);
+
+    pthread_t threads[num_threads];
+    stress    args[num_threads];
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        args[i].db = &db;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, stress_insert, &args[i]);
+    }
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        std::stringstream ss;
+        ss << "thread-" << i;
+        REQUIRE(db.get(ss.str(), 0, per_thread).size() == per_thread);
+    }
+
+    /* Every timestamp of the shared metric should show up exactly once */
+    madb::db<datum>::values_type shared(
+        db.get("shared", 0, num_threads * per_thread));
+    REQUIRE(shared.size() == num_threads * per_thread);
+    std::sort(shared.begin(), shared.end());
+    uint32_t mismatched = 0;
+    for (uint32_t i = 0; i < shared.size(); ++i) {
+        mismatched += (shared[i].time != i);
+    }
+    REQUIRE(mismatched == 0);
+
+    db.destroy();
+}
+
 int main(int argc, char* const argv[]) {    
     return Catch::Main(argc, argv);
 }